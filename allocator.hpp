@@ -0,0 +1,149 @@
+/**
+ * Memory accounting. Index structures (kd-tree nodes, owned point
+ * copies, build scratch) are allocated through an \c allocator, so a
+ * caller can plug in its own to enforce a budget or watch the peak
+ * reached during a build. \c memory_breakdown is what an nn_obj
+ * reports it holds.
+ */
+#ifndef __FASTANN_ALLOCATOR_HPP
+#define __FASTANN_ALLOCATOR_HPP
+
+#include <stdlib.h>
+
+#include <new>
+
+namespace fastann {
+
+class
+allocator
+{
+public:
+    /**
+     * Returns \c sz bytes aligned to \c align (a power of two, at least
+     * sizeof(void*)), or throws std::bad_alloc.
+     */
+    virtual void* allocate(size_t sz, size_t align) = 0;
+
+    /**
+     * Frees \c p, which was returned by allocate(\c sz, ...).
+     */
+    virtual void deallocate(void* p, size_t sz) = 0;
+
+    virtual ~allocator() { }
+};
+
+/**
+ * posix_memalign and free.
+ */
+class
+malloc_allocator : public allocator
+{
+public:
+    virtual void*
+    allocate(size_t sz, size_t align)
+    {
+        void* mem = 0;
+        if (align < sizeof(void*)) align = sizeof(void*);
+        if (posix_memalign(&mem, align, sz ? sz : 1)) throw std::bad_alloc();
+        return mem;
+    }
+
+    virtual void deallocate(void* p, size_t) { free(p); }
+};
+
+/**
+ * The allocator used when none is given.
+ */
+inline allocator&
+default_allocator()
+{
+    static malloc_allocator alloc;
+    return alloc;
+}
+
+/**
+ * Forwards to another allocator, counting the bytes outstanding and the
+ * peak, and throwing std::bad_alloc from allocate() rather than going
+ * over \c budget bytes (0 for no limit). Safe to share between threads.
+ */
+class
+budget_allocator : public allocator
+{
+    allocator& base_;
+    size_t budget_;
+    size_t current_;
+    size_t peak_;
+
+    budget_allocator(const budget_allocator&);
+    budget_allocator& operator=(const budget_allocator&);
+
+public:
+    explicit budget_allocator(size_t budget = 0, allocator& base = default_allocator())
+     : base_(base), budget_(budget), current_(0), peak_(0)
+    { }
+
+    virtual void*
+    allocate(size_t sz, size_t align)
+    {
+        size_t now = __sync_add_and_fetch(&current_, sz);
+        if (budget_ && now > budget_) {
+            __sync_sub_and_fetch(&current_, sz);
+            throw std::bad_alloc();
+        }
+
+        void* p;
+        try {
+            p = base_.allocate(sz, align);
+        }
+        catch (...) {
+            __sync_sub_and_fetch(&current_, sz);
+            throw;
+        }
+
+        size_t m = peak_;
+        while (now > m && !__sync_bool_compare_and_swap(&peak_, m, now)) m = peak_;
+        return p;
+    }
+
+    virtual void
+    deallocate(void* p, size_t sz)
+    {
+        base_.deallocate(p, sz);
+        __sync_sub_and_fetch(&current_, sz);
+    }
+
+    size_t budget() const { return budget_; }
+    size_t current() const { return current_; }
+    size_t peak() const { return peak_; }
+    void reset_peak() { peak_ = current_; }
+};
+
+/**
+ * Bytes held by an index, by what they hold.
+ */
+struct
+memory_breakdown
+{
+    size_t nodes;        // Tree nodes, excluding the point indices in leaves.
+    size_t leaf_indices; // Point indices stored in leaves.
+    size_t points;       // Owned (or mapped) copies of the points.
+    size_t aux;          // Everything else: permutations, roots, headers.
+
+    memory_breakdown() : nodes(0), leaf_indices(0), points(0), aux(0) { }
+
+    size_t total() const { return nodes + leaf_indices + points + aux; }
+
+    memory_breakdown&
+    operator+=(const memory_breakdown& o)
+    {
+        nodes += o.nodes;
+        leaf_indices += o.leaf_indices;
+        points += o.points;
+        aux += o.aux;
+        return *this;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,351 @@
+/**
+ * bench_ann: recall against QPS for the fastann indexes on standard
+ * TEXMEX datasets (SIFT1M etc.), sweeping index parameters.
+ *
+ *   bench_ann -b base.fvecs -q query.fvecs [-g groundtruth.ivecs]
+ *             [-i exact,kdtree,kdtree_copy,kdtree_huge,mapped] [-t 4,8] [-c 64,256,1024]
+ *             [-k 10] [-j 1,4] [-f csv|json] [-o out]
+ *   bench_ann -S 100000,128,1000 ...   (synthetic unit random data)
+ *
+ * .bvecs inputs are benchmarked as unsigned char. Without -g the
+ * ground truth is computed with the exact index first. Every row
+ * reports build time, memory (nn_obj::memory_usage(), so the points
+ * of exact and kdtree, which borrow them, aren't counted), recall@K, single thread QPS with latency
+ * percentiles and QPS over each thread count in -j, plus hardware
+ * counters per query over the single thread run where perf_event_open
+ * allows it (see perf_counters.hpp). kdtree_huge is kdtree_copy with
+ * the points and nodes on huge pages; compare their dTLB misses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "fastann.hpp"
+#include "huge_page_allocator.hpp"
+#include "nn_kdtree.hpp"
+#include "perf_counters.hpp"
+#include "rand_point_gen.hpp"
+#include "vecs_io.hpp"
+
+namespace {
+
+using namespace fastann::bench;
+
+bool
+ends_with(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+struct options
+{
+    std::string base_path, query_path, gt_path, out_path, format;
+    unsigned synth_n, synth_d, synth_nq;
+    std::vector<std::string> types;
+    std::vector<unsigned> ntrees, nchecks, threads;
+    unsigned K;
+};
+
+struct result
+{
+    std::string type;
+    unsigned ntrees, nchecks, K;
+    double build_s, mem_mb, recall, qps_1t, p50_us, p90_us, p99_us;
+    double hw_per_query[fastann::perf_counters::ncounters]; // Negative if unavailable.
+    std::vector< std::pair<unsigned, double> > qps_mt;
+};
+
+template<class Float>
+void
+run_one(const options& opt, const std::string& type, unsigned ntrees, unsigned nchecks,
+        const Float* pnts, unsigned N, unsigned D, const Float* qus, unsigned NQ,
+        const std::vector<unsigned>& gt, unsigned gt_K, std::vector<result>& results)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type accum_float_type;
+    unsigned K = opt.K;
+
+    char path[64] = "";
+    fastann::huge_page_allocator huge;
+    double t0 = now();
+    fastann::nn_obj<Float>* nno = 0;
+    if (type == "exact") nno = fastann::nn_obj_build_exact(pnts, N, D);
+    else if (type == "kdtree") nno = fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks);
+    else if (type == "kdtree_copy") nno = fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks, true);
+    else if (type == "kdtree_huge") {
+        nno = fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks, true, &huge);
+        fprintf(stderr, "bench_ann: %.1f MB on hugetlbfs pages, %.1f MB advised for THP\n",
+                huge.hugetlb_bytes()/1048576.0, huge.thp_bytes()/1048576.0);
+    }
+    else if (type == "mapped") {
+        snprintf(path, sizeof(path), "/tmp/bench_ann.%d.fkd", (int)getpid());
+        if (fastann::nn_obj_write_kdtree(path, pnts, N, D, ntrees)) {
+            nno = fastann::nn_obj_map_kdtree<Float>(path, nchecks);
+        }
+    }
+    if (!nno) {
+        fprintf(stderr, "bench_ann: can't build index type %s\n", type.c_str());
+        return;
+    }
+    double build_s = now() - t0;
+
+    result r;
+    r.type = type;
+    r.ntrees = type == "exact" ? 0 : ntrees;
+    r.nchecks = type == "exact" ? 0 : nchecks;
+    r.K = K;
+    r.build_s = build_s;
+    r.mem_mb = nno->memory_usage().total()/1048576.0;
+
+    std::vector<unsigned> argmins((size_t)NQ*K);
+    std::vector<accum_float_type> mins((size_t)NQ*K);
+    std::vector<double> lat(NQ);
+
+    // Single thread, one query at a time for the latencies.
+    fastann::perf_counters pc;
+    pc.start();
+    t0 = now();
+    for (unsigned n=0; n < NQ; ++n) {
+        double tq = now();
+        nno->search_knn(qus + (size_t)n*D, 1, K, &argmins[(size_t)n*K], &mins[(size_t)n*K]);
+        lat[n] = now() - tq;
+    }
+    double elapsed = now() - t0;
+    pc.stop();
+    for (unsigned c=0; c < fastann::perf_counters::ncounters; ++c) r.hw_per_query[c] = pc.per(c, NQ);
+    r.qps_1t = NQ/elapsed;
+    if (!lat.empty()) {
+        std::sort(lat.begin(), lat.end());
+        r.p50_us = 1e6*lat[(size_t)(0.50*(NQ - 1))];
+        r.p90_us = 1e6*lat[(size_t)(0.90*(NQ - 1))];
+        r.p99_us = 1e6*lat[(size_t)(0.99*(NQ - 1))];
+    }
+
+    // Recall@K: the fraction of the true K nearest found in the top K.
+    size_t nfound = 0;
+    for (unsigned n=0; n < NQ; ++n) {
+        const unsigned* g = &gt[(size_t)n*gt_K];
+        for (unsigned k=0; k < K; ++k) {
+            if (std::find(g, g + K, argmins[(size_t)n*K + k]) != g + K) ++nfound;
+        }
+    }
+    r.recall = NQ ? (double)nfound/((size_t)NQ*K) : 0.0;
+
+    for (size_t j=0; j < opt.threads.size(); ++j) {
+        unsigned T = std::max(1u, opt.threads[j]);
+        r.qps_mt.push_back(std::make_pair(T, search_qps(nno, qus, NQ, D, K, T, &argmins[0], &mins[0])));
+    }
+
+    delete nno;
+    if (path[0]) unlink(path);
+
+    fprintf(stderr, "%-12s ntrees %3u nchecks %5u: recall@%u %.4f, %.0f QPS\n",
+            type.c_str(), r.ntrees, r.nchecks, K, r.recall, r.qps_1t);
+    results.push_back(r);
+}
+
+/**
+ * Writes the per query hardware counters, empty (CSV) or null (JSON)
+ * where unavailable.
+ */
+void
+write_hw(const result& r, bool json, FILE* fp)
+{
+    for (unsigned c=0; c < fastann::perf_counters::ncounters; ++c) {
+        double v = r.hw_per_query[c];
+        if (json) {
+            fprintf(fp, "%s\"%s\": ", c ? ", " : "", fastann::perf_counters::name(c));
+            if (v < 0.0) fprintf(fp, "null");
+            else fprintf(fp, "%.2f", v);
+        }
+        else {
+            if (v < 0.0) fprintf(fp, ",");
+            else fprintf(fp, ",%.2f", v);
+        }
+    }
+}
+
+void
+write_results(const options& opt, const std::vector<result>& results, FILE* fp)
+{
+    bool json = opt.format == "json";
+    if (json) fprintf(fp, "[\n");
+    else {
+        fprintf(fp, "type,ntrees,nchecks,leaf_size,K,build_s,mem_mb,recall,qps_1t,p50_us,p90_us,p99_us,threads,qps_mt");
+        for (unsigned c=0; c < fastann::perf_counters::ncounters; ++c) {
+            fprintf(fp, ",%s_per_query", fastann::perf_counters::name(c));
+        }
+        fprintf(fp, "\n");
+    }
+
+    for (size_t i=0; i < results.size(); ++i) {
+        const result& r = results[i];
+        if (json) {
+            fprintf(fp, "  {\"type\": \"%s\", \"ntrees\": %u, \"nchecks\": %u, \"leaf_size\": %u, \"K\": %u, "
+                        "\"build_s\": %.6f, \"mem_mb\": %.3f, \"recall\": %.6f, \"qps_1t\": %.2f, "
+                        "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"qps_mt\": {",
+                    r.type.c_str(), r.ntrees, r.nchecks, fastann::nn_kdtree_internal::leaf_max_points, r.K,
+                    r.build_s, r.mem_mb, r.recall, r.qps_1t, r.p50_us, r.p90_us, r.p99_us);
+            for (size_t j=0; j < r.qps_mt.size(); ++j) {
+                fprintf(fp, "%s\"%u\": %.2f", j ? ", " : "", r.qps_mt[j].first, r.qps_mt[j].second);
+            }
+            fprintf(fp, "}, \"hw_per_query\": {");
+            write_hw(r, json, fp);
+            fprintf(fp, "}}%s\n", i + 1 < results.size() ? "," : "");
+        }
+        else {
+            // One row per thread count.
+            for (size_t j=0; j < std::max<size_t>(1, r.qps_mt.size()); ++j) {
+                fprintf(fp, "%s,%u,%u,%u,%u,%.6f,%.3f,%.6f,%.2f,%.2f,%.2f,%.2f,%u,%.2f",
+                        r.type.c_str(), r.ntrees, r.nchecks, fastann::nn_kdtree_internal::leaf_max_points, r.K,
+                        r.build_s, r.mem_mb, r.recall, r.qps_1t, r.p50_us, r.p90_us, r.p99_us,
+                        r.qps_mt.empty() ? 1 : r.qps_mt[j].first,
+                        r.qps_mt.empty() ? r.qps_1t : r.qps_mt[j].second);
+                write_hw(r, json, fp);
+                fprintf(fp, "\n");
+            }
+        }
+    }
+    if (json) fprintf(fp, "]\n");
+}
+
+template<class Float>
+int
+run(const options& opt, Float* pnts, unsigned N, unsigned D, Float* qus, unsigned NQ, unsigned QD)
+{
+    if (QD != D) {
+        fprintf(stderr, "bench_ann: base has dimension %u but queries %u\n", D, QD);
+        return 1;
+    }
+
+    std::vector<unsigned> gt;
+    unsigned gt_K = opt.K;
+    if (!opt.gt_path.empty()) {
+        unsigned gt_N;
+        int* g = fastann::read_vecs<int>(opt.gt_path.c_str(), &gt_N, &gt_K);
+        if (!g || gt_N < NQ || gt_K < opt.K) {
+            fprintf(stderr, "bench_ann: bad ground truth %s\n", opt.gt_path.c_str());
+            delete[] g;
+            return 1;
+        }
+        gt.assign(g, g + (size_t)NQ*gt_K);
+        delete[] g;
+    }
+    else {
+        fprintf(stderr, "bench_ann: computing ground truth with the exact index\n");
+        fastann::nn_obj<Float>* exact = fastann::nn_obj_build_exact(pnts, N, D);
+        std::vector<typename fastann::nn_obj<Float>::accum_float_type> mins((size_t)NQ*gt_K);
+        gt.resize((size_t)NQ*gt_K);
+        exact->search_knn(qus, NQ, gt_K, &gt[0], &mins[0]);
+        delete exact;
+    }
+
+    std::vector<result> results;
+    for (size_t i=0; i < opt.types.size(); ++i) {
+        if (opt.types[i] == "exact") {
+            run_one(opt, opt.types[i], 0, 0, pnts, N, D, qus, NQ, gt, gt_K, results);
+            continue;
+        }
+        for (size_t t=0; t < opt.ntrees.size(); ++t) {
+            for (size_t c=0; c < opt.nchecks.size(); ++c) {
+                run_one(opt, opt.types[i], opt.ntrees[t], opt.nchecks[c], pnts, N, D, qus, NQ, gt, gt_K, results);
+            }
+        }
+    }
+
+    FILE* fp = opt.out_path.empty() ? stdout : fopen(opt.out_path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "bench_ann: can't write %s\n", opt.out_path.c_str());
+        return 1;
+    }
+    write_results(opt, results, fp);
+    if (fp != stdout) fclose(fp);
+    return 0;
+}
+
+template<class Float>
+int
+load_and_run(const options& opt)
+{
+    unsigned N, D, NQ, QD;
+    Float* pnts = fastann::read_vecs<Float>(opt.base_path.c_str(), &N, &D);
+    Float* qus = fastann::read_vecs<Float>(opt.query_path.c_str(), &NQ, &QD);
+    if (!pnts || !qus) {
+        fprintf(stderr, "bench_ann: can't read %s or %s\n", opt.base_path.c_str(), opt.query_path.c_str());
+        delete[] pnts;
+        delete[] qus;
+        return 1;
+    }
+    int ret = run(opt, pnts, N, D, qus, NQ, QD);
+    delete[] pnts;
+    delete[] qus;
+    return ret;
+}
+
+void
+usage()
+{
+    fprintf(stderr, "usage: bench_ann (-b base.[fb]vecs -q query.[fb]vecs [-g gt.ivecs] | -S N,D,NQ)\n"
+                    "                 [-i exact,kdtree,kdtree_copy,kdtree_huge,mapped] [-t ntrees,...] [-c nchecks,...]\n"
+                    "                 [-k K] [-j threads,...] [-f csv|json] [-o out]\n");
+    exit(2);
+}
+
+}
+
+int
+main(int argc, char** argv)
+{
+    options opt;
+    opt.synth_n = opt.synth_d = opt.synth_nq = 0;
+    opt.types = parse_names("exact,kdtree");
+    opt.ntrees = parse_list("8");
+    opt.nchecks = parse_list("64,256,1024");
+    opt.threads = parse_list("1");
+    opt.K = 10;
+    opt.format = "csv";
+
+    int c;
+    while ((c = getopt(argc, argv, "b:q:g:S:i:t:c:k:j:f:o:")) != -1) {
+        switch (c) {
+            case 'b': opt.base_path = optarg; break;
+            case 'q': opt.query_path = optarg; break;
+            case 'g': opt.gt_path = optarg; break;
+            case 'S': {
+                std::vector<unsigned> s = parse_list(optarg);
+                if (s.size() != 3) usage();
+                opt.synth_n = s[0]; opt.synth_d = s[1]; opt.synth_nq = s[2];
+                break;
+            }
+            case 'i': opt.types = parse_names(optarg); break;
+            case 't': opt.ntrees = parse_list(optarg); break;
+            case 'c': opt.nchecks = parse_list(optarg); break;
+            case 'k': opt.K = atoi(optarg); break;
+            case 'j': opt.threads = parse_list(optarg); break;
+            case 'f': opt.format = optarg; break;
+            case 'o': opt.out_path = optarg; break;
+            default: usage();
+        }
+    }
+    if (opt.K == 0 || (opt.format != "csv" && opt.format != "json")) usage();
+
+    if (opt.synth_n) {
+        float* pnts = fastann::gen_unit_random<float>(opt.synth_n, opt.synth_d, 42);
+        float* qus = fastann::gen_unit_random<float>(opt.synth_nq, opt.synth_d, 43);
+        int ret = run(opt, pnts, opt.synth_n, opt.synth_d, qus, opt.synth_nq, opt.synth_d);
+        delete[] pnts;
+        delete[] qus;
+        return ret;
+    }
+
+    if (opt.base_path.empty() || opt.query_path.empty()) usage();
+    if (ends_with(opt.base_path, ".bvecs")) return load_and_run<unsigned char>(opt);
+    return load_and_run<float>(opt);
+}
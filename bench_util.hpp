@@ -0,0 +1,119 @@
+/**
+ * Helpers shared by the benchmark tools (bench_ann, perf_kdtree):
+ * timing, comma separated option lists and batch search over a number
+ * of threads.
+ */
+#ifndef __FASTANN_BENCH_UTIL_HPP
+#define __FASTANN_BENCH_UTIL_HPP
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "fastann.hpp"
+
+namespace fastann {
+
+namespace bench {
+
+/**
+ * Seconds on the monotonic clock.
+ */
+inline double
+now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/**
+ * Parses "64,256,1024", stopping at the first character that isn't
+ * part of the list.
+ */
+inline std::vector<unsigned>
+parse_list(const char* s)
+{
+    std::vector<unsigned> ret;
+    for (const char* p = s; *p; ) {
+        ret.push_back((unsigned)strtoul(p, (char**)&p, 10));
+        if (*p == ',') ++p;
+        else if (*p) break;
+    }
+    return ret;
+}
+
+inline std::vector<std::string>
+parse_names(const char* s)
+{
+    std::vector<std::string> ret;
+    std::string cur;
+    for (const char* p = s; ; ++p) {
+        if (*p == ',' || !*p) {
+            if (!cur.empty()) ret.push_back(cur);
+            cur.clear();
+            if (!*p) break;
+        }
+        else cur += *p;
+    }
+    return ret;
+}
+
+template<class Float>
+struct
+mt_arg
+{
+    const nn_obj<Float>* nno;
+    const Float* qus;
+    unsigned N, D, K;
+    unsigned* argmins;
+    typename nn_obj<Float>::accum_float_type* mins;
+};
+
+template<class Float>
+void*
+mt_main(void* arg)
+{
+    mt_arg<Float>* a = (mt_arg<Float>*)arg;
+    if (a->N) a->nno->search_knn(a->qus, a->N, a->K, a->argmins, a->mins);
+    return 0;
+}
+
+/**
+ * Searches \c NQ queries split evenly over \c T threads of their own,
+ * \c K results each, and returns the queries per second. A share whose
+ * thread can't be started is searched by the caller.
+ */
+template<class Float>
+double
+search_qps(const nn_obj<Float>* nno, const Float* qus, unsigned NQ, unsigned D, unsigned K, unsigned T,
+           unsigned* argmins, typename nn_obj<Float>::accum_float_type* mins)
+{
+    T = std::max(1u, T);
+    std::vector< mt_arg<Float> > args(T);
+    std::vector<pthread_t> ths(T);
+    std::vector<char> started(T, 0);
+    double t0 = now();
+    for (unsigned t=0; t < T; ++t) {
+        unsigned begin = (unsigned)((size_t)NQ*t/T), end = (unsigned)((size_t)NQ*(t + 1)/T);
+        mt_arg<Float> a = { nno, qus + (size_t)begin*D, end - begin, D, K,
+                            &argmins[(size_t)begin*K], &mins[(size_t)begin*K] };
+        args[t] = a;
+        started[t] = pthread_create(&ths[t], 0, &mt_main<Float>, &args[t]) == 0;
+        if (!started[t]) mt_main<Float>(&args[t]);
+    }
+    for (unsigned t=0; t < T; ++t) {
+        if (started[t]) pthread_join(ths[t], 0);
+    }
+    return NQ/(now() - t0);
+}
+
+}
+
+}
+
+#endif
@@ -42,4 +42,16 @@ dist_l2_best(unsigned D)
     return ret;
 }
 
+dist_l2_mixed_wrapper
+dist_l2_mixed_best(unsigned D)
+{
+    dist_l2_mixed_wrapper ret;
+#ifdef __SSE2__
+    ret.func = &ml2v_4_16;
+#else
+    ret.func = &ml2s;
+#endif
+    return ret;
+}
+
 }
@@ -8,6 +8,7 @@ namespace fastann {
 typedef void(*cl2func)(const unsigned char*, const unsigned char*, unsigned, unsigned, unsigned*);//   cl2func;
 typedef void(*sl2func)(const float*, const float*, unsigned, unsigned, float*);//                      sl2func;
 typedef void(*dl2func)(const double*, const double*, unsigned, unsigned, double*);//                   dl2func;
+typedef void(*ml2func)(const float*, const unsigned char*, unsigned, unsigned, float*);//              ml2func;
 
 template<class Float>
 struct dist_l2_wrapper
@@ -41,6 +42,19 @@ struct dist_l2_wrapper<double>
     typedef double AccumFloat;
 };
 
+/**
+ * Float queries against unsigned char points, with float distances:
+ * the points are converted as they are loaded, so queries keep their
+ * precision while the points stay a byte per element.
+ */
+struct dist_l2_mixed_wrapper
+{
+    ml2func func;
+
+    typedef unsigned char Float;
+    typedef float AccumFloat;
+};
+
 /**
  * Returns a best effort distance function.
  *
@@ -51,6 +65,9 @@ template<class Float>
 dist_l2_wrapper<Float>
 dist_l2_best(unsigned D = 0);
 
+dist_l2_mixed_wrapper
+dist_l2_mixed_best(unsigned D = 0);
+
 }
 
 #endif
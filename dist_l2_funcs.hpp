@@ -34,7 +34,7 @@ cl2s(const unsigned char* qu, const unsigned char* pnts,
     for (unsigned n = 0; n < N; ++n) {
         dsq_out[n] = 0;
         for (unsigned d = 0; d < D; ++d) {
-            dsq_out[n] += ((unsigned)qu[d] - (unsigned)pnts[n*D + d])*((unsigned)qu[d] - (unsigned)pnts[n*D + d]);
+            dsq_out[n] += ((unsigned)qu[d] - (unsigned)pnts[(size_t)n*D + d])*((unsigned)qu[d] - (unsigned)pnts[(size_t)n*D + d]);
         }
     }
 }
@@ -46,7 +46,7 @@ cl2f_1_8(const unsigned char* qu, const unsigned char* pnts,
          unsigned* dsq_out)
 {
     for (unsigned n=0; n < N; ++n) {
-        const unsigned char* pnt_n = pnts + n*D;
+        const unsigned char* pnt_n = pnts + (size_t)n*D;
         dsq_out[n] = 0;
         unsigned d;
         for (d = 0; d < (D&-8); d+=8) {
@@ -76,7 +76,7 @@ cl2v_2_32(const unsigned char* qu, const unsigned char* pnts,
     {0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00,
      0xff, 0x00, 0xff, 0x00, 0xff, 0x00, 0xff, 0x00};
     for (unsigned n = 0; n < N; ++n) {
-        const unsigned char* pnt_n = pnts + n*D;
+        const unsigned char* pnt_n = pnts + (size_t)n*D;
         unsigned d = 0;
         __m128i acur1, bcur1, acur2, bcur2;
         __m128i t1, t2, t3;
@@ -132,7 +132,7 @@ sl2s(const float* qu, const float* pnts,
     for (unsigned n=0; n < N; ++n) {
         dsq_out[n] = 0.0f;
         for (unsigned d=0; d<D; ++d) {
-            dsq_out[n] += (qu[d] - pnts[n*D + d])*(qu[d] - pnts[n*D + d]);
+            dsq_out[n] += (qu[d] - pnts[(size_t)n*D + d])*(qu[d] - pnts[(size_t)n*D + d]);
         }
     }
 }
@@ -144,7 +144,7 @@ sl2f_1_8(const float* qu, const float* pnts,
          float* dsq_out)
 {
     for (unsigned n = 0; n < N; ++n) {
-        const float* pnt_n = pnts + n*D;
+        const float* pnt_n = pnts + (size_t)n*D;
         dsq_out[n] = 0.0f;
         unsigned d;
         for (d=0; d < (D&-8); d+=8) {
@@ -172,7 +172,7 @@ sl2u_2_8(const float* qu, const float* pnts,
          float* dsq_out)
 {
     for (unsigned n = 0; n < N; ++n) {
-        const float* pnt_n = pnts + n*D;
+        const float* pnt_n = pnts + (size_t)n*D;
         unsigned d = 0;
         __m128 acc1, acc2; // Two accumulators
         __m128 acur1, bcur1, acur2, bcur2; // Contain 4 elems each from a and b
@@ -219,7 +219,7 @@ dl2s(const double* qu, const double* pnts,
     for (unsigned n=0; n < N; ++n) {
         dsq_out[n] = 0.0;
         for (unsigned d=0; d < D; ++d) {
-            dsq_out[n] += (qu[d] - pnts[n*D + d])*(qu[d] - pnts[n*D + d]);
+            dsq_out[n] += (qu[d] - pnts[(size_t)n*D + d])*(qu[d] - pnts[(size_t)n*D + d]);
         }
     }
 }
@@ -231,7 +231,7 @@ dl2f_1_8(const double* qu, const double* pnts,
          double* dsq_out)
 {
     for (unsigned n=0; n < N; ++n) {
-        const double* pnt_n = pnts + n*D;
+        const double* pnt_n = pnts + (size_t)n*D;
         unsigned d;
         dsq_out[n] = 0.0;
         for (d = 0; d < (D&-8); d+=8) {
@@ -258,7 +258,7 @@ dl2v_2_8(const double* qu, const double* pnts,
          double* dsq_out)
 {
     for (unsigned n=0; n < N; ++n) {
-        const double* pnt_n = pnts + n*D;
+        const double* pnt_n = pnts + (size_t)n*D;
         unsigned d = 0;
 
         __m128d acc1, acc2; // Two accumulators
@@ -300,6 +300,143 @@ dl2v_2_8(const double* qu, const double* pnts,
 }
 #endif
 
+/**
+ * Float queries against unsigned char points.
+ */
+inline
+void
+ml2s(const float* qu, const unsigned char* pnts,
+     unsigned N, unsigned D,
+     float* dsq_out)
+{
+    for (unsigned n=0; n < N; ++n) {
+        dsq_out[n] = 0.0f;
+        for (unsigned d=0; d<D; ++d) {
+            dsq_out[n] += (qu[d] - pnts[(size_t)n*D + d])*(qu[d] - pnts[(size_t)n*D + d]);
+        }
+    }
+}
+
+#ifdef __SSE2__
+/**
+ * Widens 16 bytes of the point to four vectors of floats per pass.
+ */
+inline
+void
+ml2v_4_16(const float* qu, const unsigned char* pnts,
+          unsigned N, unsigned D,
+          float* dsq_out)
+{
+    __m128i zero = _mm_setzero_si128();
+    for (unsigned n = 0; n < N; ++n) {
+        const unsigned char* pnt_n = pnts + (size_t)n*D;
+        unsigned d = 0;
+        __m128 acc1 = _mm_setzero_ps(), acc2 = _mm_setzero_ps();
+        __m128 acc3 = _mm_setzero_ps(), acc4 = _mm_setzero_ps();
+        __m128 t1, t2, t3, t4;
+
+        for ( ; d < (D&-16); d+=16) {
+            __m128i b = _mm_loadu_si128((const __m128i*)(pnt_n + d));
+            __m128i blo = _mm_unpacklo_epi8(b, zero); // 16 bit [b0 .. b7]
+            __m128i bhi = _mm_unpackhi_epi8(b, zero); // 16 bit [b8 .. b15]
+
+            t1 = _mm_sub_ps(_mm_loadu_ps(qu + d),      _mm_cvtepi32_ps(_mm_unpacklo_epi16(blo, zero)));
+            t2 = _mm_sub_ps(_mm_loadu_ps(qu + d + 4),  _mm_cvtepi32_ps(_mm_unpackhi_epi16(blo, zero)));
+            t3 = _mm_sub_ps(_mm_loadu_ps(qu + d + 8),  _mm_cvtepi32_ps(_mm_unpacklo_epi16(bhi, zero)));
+            t4 = _mm_sub_ps(_mm_loadu_ps(qu + d + 12), _mm_cvtepi32_ps(_mm_unpackhi_epi16(bhi, zero)));
+
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(t1, t1));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(t2, t2));
+            acc3 = _mm_add_ps(acc3, _mm_mul_ps(t3, t3));
+            acc4 = _mm_add_ps(acc4, _mm_mul_ps(t4, t4));
+        }
+
+        // Horizontal add
+        acc1 = _mm_add_ps(_mm_add_ps(acc1, acc2), _mm_add_ps(acc3, acc4));
+        acc2 = _mm_movehl_ps(acc2, acc1);
+        acc1 = _mm_add_ps(acc1, acc2);
+        acc2 = _mm_shuffle_ps(acc1, acc1, 0x1);
+        acc1 = _mm_add_ss(acc1, acc2);
+        _mm_store_ss(&dsq_out[n], acc1);
+
+        for ( ; d < D; ++d) { // Finish up
+            dsq_out[n] += (qu[d] - pnt_n[d])*(qu[d] - pnt_n[d]);
+        }
+    }
+}
+#endif
+
+/**
+ * A kernel fixed at compile time, used like a dist_l2_wrapper. Calls
+ * through it are direct, so a search loop instantiated with it gets
+ * the kernel inlined rather than an indirect call per point.
+ */
+template<class QueryFloat, class Float, class AccumFloat,
+         void (*Func)(const QueryFloat*, const Float*, unsigned, unsigned, AccumFloat*)>
+struct dist_l2_static
+{
+    static inline __attribute__ ((always_inline, flatten)) void
+    func(const QueryFloat* qu, const Float* pnts, unsigned N, unsigned D, AccumFloat* dsq_out)
+    {
+        Func(qu, pnts, N, D, dsq_out);
+    }
+};
+
+/**
+ * Calls \c visit(d), where \c d is the dist_l2_static of the kernel
+ * in \c dist if it is one dist_l2_best can return, else \c dist
+ * itself. \c visit has a template operator() instantiating the search
+ * for each; dispatching once per batch keeps the choice out of the
+ * per point loop.
+ */
+template<class Visitor>
+void
+dispatch_dist_l2(dist_l2_wrapper<unsigned char> dist, const Visitor& visit)
+{
+#ifdef __SSE2__
+    if (dist.func == &cl2v_2_32) return visit(dist_l2_static<unsigned char, unsigned char, unsigned, &cl2v_2_32>());
+#else
+    if (dist.func == &cl2f_1_8) return visit(dist_l2_static<unsigned char, unsigned char, unsigned, &cl2f_1_8>());
+#endif
+    visit(dist);
+}
+
+template<class Visitor>
+void
+dispatch_dist_l2(dist_l2_wrapper<float> dist, const Visitor& visit)
+{
+#ifdef __SSE__
+    if (dist.func == &sl2u_2_8) return visit(dist_l2_static<float, float, float, &sl2u_2_8>());
+#else
+    if (dist.func == &sl2f_1_8) return visit(dist_l2_static<float, float, float, &sl2f_1_8>());
+#endif
+    visit(dist);
+}
+
+template<class Visitor>
+void
+dispatch_dist_l2(dist_l2_wrapper<double> dist, const Visitor& visit)
+{
+#ifdef __SSE2__
+    if (dist.func == &dl2v_2_8) return visit(dist_l2_static<double, double, double, &dl2v_2_8>());
+#else
+    if (dist.func == &dl2f_1_8) return visit(dist_l2_static<double, double, double, &dl2f_1_8>());
+#endif
+    visit(dist);
+}
+
+template<class Visitor>
+void
+dispatch_dist_l2(dist_l2_mixed_wrapper dist, const Visitor& visit)
+{
+#ifdef __SSE2__
+    if (dist.func == &ml2v_4_16) return visit(dist_l2_static<float, unsigned char, float, &ml2v_4_16>());
+#else
+    if (dist.func == &ml2s) return visit(dist_l2_static<float, unsigned char, float, &ml2s>());
+#endif
+    visit(dist);
+}
+
 /**
  * GCC does such a piss poor attempt at optimizing the above 
  * intrinsics I thought i'd have a go myself in pure assembly.
@@ -0,0 +1,181 @@
+/**
+ * Epoch based reclamation: readers announce themselves in a slot
+ * instead of taking a lock, and memory a writer has unlinked is freed
+ * only once no reader that could still hold a pointer into it remains.
+ */
+#ifndef __FASTANN_EPOCH_HPP
+#define __FASTANN_EPOCH_HPP
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "allocator.hpp"
+
+namespace fastann {
+
+class
+epoch_domain
+{
+public:
+    static const unsigned nslots = 256;
+
+    /**
+     * Frees \c p, retired with \c ctx and \c sz.
+     */
+    typedef void (*free_func)(void* p, void* ctx, size_t sz);
+
+private:
+    struct slot
+    {
+        uint64_t epoch; // 0 if free, else the epoch its reader started in.
+        char pad[64 - sizeof(uint64_t)];
+    };
+
+    struct retired
+    {
+        free_func free;
+        void* p;
+        void* ctx;
+        size_t sz;
+        uint64_t epoch;
+    };
+
+    uint64_t epoch_;
+    slot slots_[nslots];
+
+    // Only touched by writers, under mutex_.
+    std::vector<retired> retired_;
+    pthread_mutex_t mutex_;
+
+    epoch_domain(const epoch_domain&);
+    epoch_domain& operator=(const epoch_domain&);
+
+    /**
+     * The smallest epoch of any active reader, or ~0 if there is none.
+     */
+    uint64_t
+    min_reader_epoch() const
+    {
+        uint64_t m = ~(uint64_t)0;
+        for (unsigned s=0; s < nslots; ++s) {
+            uint64_t e = *(volatile const uint64_t*)&slots_[s].epoch;
+            if (e && e < m) m = e;
+        }
+        return m;
+    }
+
+    static void
+    free_to_allocator(void* p, void* ctx, size_t sz)
+    {
+        ((allocator*)ctx)->deallocate(p, sz);
+    }
+
+public:
+    epoch_domain() : epoch_(1)
+    {
+        for (unsigned s=0; s < nslots; ++s) slots_[s].epoch = 0;
+        pthread_mutex_init(&mutex_, 0);
+    }
+
+    /**
+     * Frees everything still retired, so no reader may be left.
+     */
+    ~epoch_domain()
+    {
+        for (size_t i=0; i < retired_.size(); ++i) {
+            retired_[i].free(retired_[i].p, retired_[i].ctx, retired_[i].sz);
+        }
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    /**
+     * Keeps everything reachable when it was entered alive for as long
+     * as it exists. Entering and leaving are a few atomic operations
+     * and never wait on a writer.
+     */
+    class
+    guard
+    {
+        slot* slot_;
+
+        guard(const guard&);
+        guard& operator=(const guard&);
+
+    public:
+        explicit guard(const epoch_domain& ed)
+        {
+            epoch_domain& d = const_cast<epoch_domain&>(ed);
+            // Claim a free slot, starting from one that depends on the
+            // thread so that readers rarely collide.
+            unsigned s = (unsigned)(((uintptr_t)pthread_self() >> 6) % nslots);
+            for (;;) {
+                uint64_t e = *(volatile uint64_t*)&d.epoch_;
+                if (__sync_bool_compare_and_swap(&d.slots_[s].epoch, 0, e)) break;
+                if (++s == nslots) {
+                    s = 0;
+                    sched_yield(); // Every slot busy: more readers than slots.
+                }
+            }
+            slot_ = &d.slots_[s];
+            __sync_synchronize();
+        }
+
+        ~guard()
+        {
+            __sync_synchronize();
+            *(volatile uint64_t*)&slot_->epoch = 0;
+        }
+    };
+
+    /**
+     * Hands \c p, which the caller has just made unreachable, over to
+     * be freed by \c free(p, ctx, sz) in a later reclaim().
+     */
+    void
+    retire(void* p, free_func free, void* ctx, size_t sz = 0)
+    {
+        __sync_synchronize();
+        retired r = { free, p, ctx, sz, __sync_add_and_fetch(&epoch_, 1) };
+        pthread_mutex_lock(&mutex_);
+        retired_.push_back(r);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    /**
+     * As retire(), for a block of \c sz bytes from \c alloc.
+     */
+    void
+    retire(void* p, allocator& alloc, size_t sz)
+    {
+        retire(p, &free_to_allocator, &alloc, sz);
+    }
+
+    /**
+     * Frees everything retired that no reader can still be using.
+     * Returns true if nothing is left.
+     */
+    bool
+    reclaim()
+    {
+        pthread_mutex_lock(&mutex_);
+        __sync_synchronize();
+        uint64_t m = min_reader_epoch();
+        size_t kept = 0;
+        for (size_t i=0; i < retired_.size(); ++i) {
+            // A reader that started in an epoch before the retire may hold it.
+            if (retired_[i].epoch <= m) retired_[i].free(retired_[i].p, retired_[i].ctx, retired_[i].sz);
+            else retired_[kept++] = retired_[i];
+        }
+        retired_.resize(kept);
+        bool empty = retired_.empty();
+        pthread_mutex_unlock(&mutex_);
+        return empty;
+    }
+};
+
+}
+
+#endif
@@ -1,6 +1,10 @@
+#include <pthread.h>
+
 #include "fastann.hpp"
 #include "dist_l2.hpp"
+#include "epoch.hpp"
 #include "nn_kdtree.hpp"
+#include "point_store.hpp"
 
 namespace fastann {
 
@@ -14,9 +18,16 @@ public:
     virtual void search_nn(const float_type* qus, unsigned N,
                            unsigned* argmins, accum_float_type* mins) const
     {
-        std::vector< accum_float_type > dsqout(npoints_);
+        epoch_domain::guard g(epoch_);
+        unsigned npoints = this->npoints();
+        const Float* pnts = store_.data();
+
+        std::vector< accum_float_type > dsqout(npoints);
+        batch_stats_scope batch(&stats_);
         for (unsigned n=0; n < N; ++n) {
-            dist_.func(qus + n*ndims_, pnts_, npoints_, ndims_, &dsqout[0]);
+            query_stats_scope st(0, batch.get());
+            dist_.func(qus + (size_t)n*ndims_, pnts, npoints, ndims_, &dsqout[0]);
+            FASTANN_STAT_ADD(st.get(), ndists, npoints);
 
             argmins[n] = (unsigned)(std::min_element(dsqout.begin(), dsqout.end()) - dsqout.begin());
             mins[n] = dsqout[argmins[n]];
@@ -26,33 +37,126 @@ public:
     virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
                             unsigned* argmins, accum_float_type* mins) const
     {
-        std::vector< accum_float_type > dsqout(npoints_);
-        std::vector< std::pair<accum_float_type,unsigned> > knn_prs(npoints_);
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        knn_visitor<float_type, accum_float_type> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_, v);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        knn_visitor<float, float> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_l2_mixed_best(ndims_), v);
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        pthread_mutex_lock(&write_mutex_);
+        memory_breakdown mem;
+        mem.points = store_.size_bytes();
+        pthread_mutex_unlock(&write_mutex_);
+        return mem;
+    }
+
+    /**
+     * Searches already running keep the count they started with.
+     */
+    virtual void
+    add_points(const Float* pnts, unsigned N)
+    {
+        pthread_mutex_lock(&write_mutex_);
+        try {
+            store_.append(pnts, N, epoch_);
+        }
+        catch (...) {
+            pthread_mutex_unlock(&write_mutex_);
+            throw;
+        }
+        __atomic_store_n(&npoints_, npoints_ + N, __ATOMIC_RELEASE);
+        epoch_.reclaim();
+        pthread_mutex_unlock(&write_mutex_);
+    }
+    
+    virtual unsigned ndims() const { return ndims_; }
+    virtual unsigned npoints() const { return __atomic_load_n(&npoints_, __ATOMIC_ACQUIRE); }
+
+    nn_obj_exact(const Float* pnts, unsigned N, unsigned D, bool copy_points, allocator& alloc)
+     : store_(alloc, D), ndims_(D), npoints_(N), dist_(dist_l2_best<Float>(D))
+    {
+        if (copy_points) store_.assign(pnts, N);
+        else store_.borrow(pnts, N);
+        pthread_mutex_init(&write_mutex_, 0);
+    }
+
+    virtual ~nn_obj_exact() { pthread_mutex_destroy(&write_mutex_); }
+private:
+    /**
+     * search_knn_with for the distance dispatch_dist_l2 picks.
+     */
+    template<class Query, class DistT>
+    struct
+    knn_visitor
+    {
+        const nn_obj_exact* self;
+        const Query* qus;
+        unsigned N;
+        unsigned K;
+        unsigned* argmins;
+        DistT* mins;
+        search_stats* stats;
+
+        template<class Dist>
+        void operator()(Dist dist) const { self->search_knn_with(qus, dist, N, K, argmins, mins, stats); }
+    };
+
+    template<class Query, class Dist, class DistT>
+    void
+    search_knn_with(const Query* qus, Dist dist, unsigned N, unsigned K,
+                    unsigned* argmins, DistT* mins, search_stats* stats) const
+    {
+        epoch_domain::guard g(epoch_);
+        unsigned npoints = this->npoints();
+        const Float* pnts = store_.data();
+
+        std::vector< DistT > dsqout(npoints);
+        std::vector< std::pair<DistT,unsigned> > knn_prs(npoints);
+        batch_stats_scope batch(&stats_);
         for (unsigned n=0; n < N; ++n) {
-            dist_.func(qus + n*ndims_, pnts_, npoints_, ndims_, &dsqout[0]);
+            query_stats_scope st(stats ? &stats[n] : 0, batch.get());
+            dist.func(qus + (size_t)n*ndims_, pnts, npoints, ndims_, &dsqout[0]);
+            FASTANN_STAT_ADD(st.get(), ndists, npoints);
 
-            for (unsigned p=0; p < npoints_; ++p) knn_prs[p] = std::make_pair(dsqout[p], p);
+            for (unsigned p=0; p < npoints; ++p) knn_prs[p] = std::make_pair(dsqout[p], p);
 
             std::partial_sort(knn_prs.begin(), knn_prs.begin() + K, knn_prs.end());
 
             for (unsigned k=0; k < K; ++k) {
-                argmins[n*K + k] = knn_prs[k].second;
-                mins[n*K + k] = knn_prs[k].first;
+                argmins[(size_t)n*K + k] = knn_prs[k].second;
+                mins[(size_t)n*K + k] = knn_prs[k].first;
             }
         }
     }
-    
-    virtual unsigned ndims() const { return ndims_; }
-    virtual unsigned npoints() const { return npoints_; }
 
-    nn_obj_exact(const Float* pnts, unsigned N, unsigned D)
-     : pnts_(pnts), ndims_(D), npoints_(N), dist_(dist_l2_best<Float>(D))
-    { }
-private:
-    const Float* pnts_;
+    append_store<Float> store_;
     unsigned ndims_;
     unsigned npoints_;
     dist_l2_wrapper<Float> dist_;
+    mutable search_stats_summary stats_;
+    epoch_domain epoch_;
+    mutable pthread_mutex_t write_mutex_;
 };
 
 template<class Float>
@@ -65,78 +169,301 @@ public:
     virtual void search_nn(const float_type* qus, unsigned N,
                            unsigned* argmins, accum_float_type* mins) const
     {
-        for (unsigned n=0; n < N; ++n) {
-            std::pair<unsigned, accum_float_type> nn;
-            kdt_.search(qus + n*ndims_, dist_, 1, &nn, nchecks_);
-            argmins[n] = nn.first;
-            mins[n] = nn.second;
-        }
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
     }
 
     virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
                             unsigned* argmins, accum_float_type* mins) const
     {
-        std::vector< std::pair<unsigned, accum_float_type> > nns(K);
-        for (unsigned n=0; n < N; ++n) {
-            kdt_.search(qus + n*ndims_, dist_, K, &nns[0], nchecks_);
-            for (unsigned k=0; k < K; ++k) {
-                argmins[n*K + k] = nns[k].first;
-                mins[n*K + k] = nns[k].second;
-            }
-        }
+        search_knn_stats(qus, N, K, argmins, mins, 0);
     }
 
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        knn_visitor<float_type, accum_float_type> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_, v);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        knn_visitor<float, float> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_l2_mixed_best(ndims_), v);
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    virtual memory_breakdown memory_usage() const { return kdt_.memory_usage(); }
+
+    virtual void add_points(const Float* pnts, unsigned N) { kdt_.add_points(pnts, N); }
+
     virtual unsigned ndims() const { return ndims_; }
-    virtual unsigned npoints() const { return npoints_; }
+    virtual unsigned npoints() const { return kdt_.npoints(); }
 
-    nn_obj_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks)
-     : kdt_(pnts, N, D, ntrees), npoints_(N), ndims_(D), nchecks_(nchecks), dist_(dist_l2_best<Float>(D))
+    nn_obj_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                  bool copy_points, allocator& alloc)
+     : kdt_(pnts, N, D, ntrees, 42, copy_points, alloc), ndims_(D), nchecks_(nchecks), dist_(dist_l2_best<Float>(D))
     { }
 
     virtual ~nn_obj_kdtree() { }
 
 private:
+    /**
+     * search_knn_with for the distance dispatch_dist_l2 picks.
+     */
+    template<class Query, class DistT>
+    struct
+    knn_visitor
+    {
+        const nn_obj_kdtree* self;
+        const Query* qus;
+        unsigned N;
+        unsigned K;
+        unsigned* argmins;
+        DistT* mins;
+        search_stats* stats;
+
+        template<class Dist>
+        void operator()(Dist dist) const { self->search_knn_with(qus, dist, N, K, argmins, mins, stats); }
+    };
+
+    template<class Query, class Dist, class DistT>
+    void
+    search_knn_with(const Query* qus, Dist dist, unsigned N, unsigned K,
+                    unsigned* argmins, DistT* mins, search_stats* stats) const
+    {
+        std::vector< std::pair<unsigned, DistT> > nns(K);
+        batch_stats_scope batch(&stats_);
+        for (unsigned n=0; n < N; ++n) {
+            query_stats_scope st(stats ? &stats[n] : 0, batch.get());
+            kdt_.search(qus + (size_t)n*ndims_, dist, K, &nns[0], nchecks_, st.get());
+            for (unsigned k=0; k < K; ++k) {
+                argmins[(size_t)n*K + k] = nns[k].first;
+                mins[(size_t)n*K + k] = nns[k].second;
+            }
+        }
+    }
+
     nn_kdtree<Float> kdt_;
-    unsigned npoints_;
     unsigned ndims_;
     unsigned nchecks_;
     dist_l2_wrapper<Float> dist_;
+    mutable search_stats_summary stats_;
 };
 
 template<class Float>
 nn_obj<Float>*
-nn_obj_build_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks)
+nn_obj_build_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                    bool copy_points, allocator* alloc)
 {
-    return new nn_obj_kdtree<Float>(pnts, N, D, ntrees, nchecks);
+    return new nn_obj_kdtree<Float>(pnts, N, D, ntrees, nchecks, copy_points,
+                                    alloc ? *alloc : default_allocator());
 }
 
 
 template
 nn_obj<unsigned char>*
-nn_obj_build_kdtree<unsigned char>(const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks);
+nn_obj_build_kdtree<unsigned char>(const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         bool copy_points, allocator* alloc);
 
 template
 nn_obj<float>*
-nn_obj_build_kdtree<float>(const float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks);
+nn_obj_build_kdtree<float>(const float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         bool copy_points, allocator* alloc);
 
 template
 nn_obj<double>*
-nn_obj_build_kdtree<double>(const double* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks);
+nn_obj_build_kdtree<double>(const double* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         bool copy_points, allocator* alloc);
+
+template<class Float>
+class nn_obj_rerank_impl : public nn_obj_rerank<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_rerank(qus, N, 1, R_, argmins, mins);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_rerank(qus, N, K, R_, argmins, mins);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        search_knn_rerank(qus, N, K, R_, argmins, mins, stats);
+    }
+
+    virtual void search_knn_rerank(const float_type* qus, unsigned N, unsigned K, unsigned R,
+                                   unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_rerank(qus, N, K, R, argmins, mins, 0);
+    }
+
+    /**
+     * The counters for each query include those of its first stage.
+     */
+    void search_knn_rerank(const float_type* qus, unsigned N, unsigned K, unsigned R,
+                           unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        if (K > npoints_) throw 0;
+        if (R < K) R = K;
+        if (R > npoints_) R = npoints_;
+
+        // Candidates are fetched from the first stage a block of
+        // queries at a time, so it still sees a batch.
+        unsigned nblock = std::min(N, block_queries);
+        std::vector< unsigned > cands(nblock*R);
+        std::vector< accum_float_type > cand_dsqs(nblock*R);
+        std::vector< std::pair<accum_float_type, unsigned> > prs(R);
+        std::vector< search_stats > first_stats(nblock);
+
+        batch_stats_scope batch(&stats_);
+        for (unsigned n0=0; n0 < N; n0 += nblock) {
+            unsigned nb = std::min(nblock, N - n0);
+            first_->search_knn_stats(qus + (size_t)n0*ndims_, nb, R, &cands[0], &cand_dsqs[0], &first_stats[0]);
+
+            for (unsigned b=0; b < nb; ++b) {
+                query_stats_scope st(stats ? &stats[n0 + b] : 0, batch.get());
+#ifdef FASTANN_STATS
+                *st.get() = first_stats[b];
+#endif
+                FASTANN_STAT_ADD(st.get(), ndists, R);
+                const float_type* qu = qus + (size_t)(n0 + b)*ndims_;
+                const unsigned* cand = &cands[b*R];
+                for (unsigned r=0; r < R; ++r) {
+                    accum_float_type dsq;
+                    dist_.func(qu, pnts_ + (size_t)cand[r]*ndims_, 1, ndims_, &dsq);
+                    prs[r] = std::make_pair(dsq, cand[r]);
+                }
+
+                std::partial_sort(prs.begin(), prs.begin() + K, prs.end());
+
+                for (unsigned k=0; k < K; ++k) {
+                    argmins[(size_t)(n0 + b)*K + k] = prs[k].second;
+                    mins[(size_t)(n0 + b)*K + k] = prs[k].first;
+                }
+            }
+        }
+    }
+
+    virtual unsigned ndims() const { return ndims_; }
+    virtual unsigned npoints() const { return npoints_; }
+
+    nn_obj_rerank_impl(nn_obj<Float>* first_stage, const Float* pnts, unsigned N, unsigned D, unsigned R)
+     : first_(first_stage), pnts_(pnts), ndims_(D), npoints_(N), R_(R), dist_(dist_l2_best<Float>(D))
+    { }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    /**
+     * The first stage's memory; \c pnts is borrowed.
+     */
+    virtual memory_breakdown memory_usage() const { return first_->memory_usage(); }
+
+    virtual ~nn_obj_rerank_impl() { delete first_; }
+
+private:
+    static const unsigned block_queries = 64;
+
+    nn_obj<Float>* first_;
+    const Float* pnts_;
+    unsigned ndims_;
+    unsigned npoints_;
+    unsigned R_;
+    dist_l2_wrapper<Float> dist_;
+    mutable search_stats_summary stats_;
+};
+
+template<class Float>
+nn_obj_rerank<Float>*
+nn_obj_build_rerank(nn_obj<Float>* first_stage, const Float* pnts, unsigned N, unsigned D, unsigned R)
+{
+    // Checked here: a throwing constructor would never delete it.
+    if (first_stage->ndims() != D || first_stage->npoints() != N) {
+        delete first_stage;
+        throw 0;
+    }
+    try {
+        return new nn_obj_rerank_impl<Float>(first_stage, pnts, N, D, R);
+    }
+    catch (...) {
+        delete first_stage;
+        throw;
+    }
+}
+template
+nn_obj_rerank<unsigned char>*
+nn_obj_build_rerank(nn_obj<unsigned char>* first_stage, const unsigned char* pnts, unsigned N, unsigned D, unsigned R);
+template
+nn_obj_rerank<float>*
+nn_obj_build_rerank(nn_obj<float>* first_stage, const float* pnts, unsigned N, unsigned D, unsigned R);
+template
+nn_obj_rerank<double>*
+nn_obj_build_rerank(nn_obj<double>* first_stage, const double* pnts, unsigned N, unsigned D, unsigned R);
 
 template<class Float>
 nn_obj<Float>*
-nn_obj_build_exact(const Float* pnts, unsigned N, unsigned D)
+nn_obj_build_exact(const Float* pnts, unsigned N, unsigned D, bool copy_points, allocator* alloc)
 {
-    return new nn_obj_exact<Float>(pnts, N, D);
+    return new nn_obj_exact<Float>(pnts, N, D, copy_points, alloc ? *alloc : default_allocator());
 }
 template
 nn_obj<unsigned char>*
-nn_obj_build_exact(const unsigned char* pnts, unsigned N, unsigned D);
+nn_obj_build_exact(const unsigned char* pnts, unsigned N, unsigned D, bool copy_points, allocator* alloc);
 template
 nn_obj<float>*
-nn_obj_build_exact(const float* pnts, unsigned N, unsigned D);
+nn_obj_build_exact(const float* pnts, unsigned N, unsigned D, bool copy_points, allocator* alloc);
 template
 nn_obj<double>*
-nn_obj_build_exact(const double* pnts, unsigned N, unsigned D);
+nn_obj_build_exact(const double* pnts, unsigned N, unsigned D, bool copy_points, allocator* alloc);
+
+template<class Float>
+memory_breakdown
+nn_obj_estimate_exact(unsigned N, unsigned D, bool copy_points)
+{
+    memory_breakdown mem;
+    if (copy_points) mem.points = (size_t)N*D*sizeof(Float);
+    return mem;
+}
+template
+memory_breakdown
+nn_obj_estimate_exact<unsigned char>(unsigned N, unsigned D, bool copy_points);
+template
+memory_breakdown
+nn_obj_estimate_exact<float>(unsigned N, unsigned D, bool copy_points);
+template
+memory_breakdown
+nn_obj_estimate_exact<double>(unsigned N, unsigned D, bool copy_points);
+
+template<class Float>
+memory_breakdown
+nn_obj_estimate_kdtree(unsigned N, unsigned D, unsigned ntrees, bool copy_points)
+{
+    return nn_kdtree<Float>::estimate_memory(N, D, ntrees, copy_points);
+}
+template
+memory_breakdown
+nn_obj_estimate_kdtree<unsigned char>(unsigned N, unsigned D, unsigned ntrees, bool copy_points);
+template
+memory_breakdown
+nn_obj_estimate_kdtree<float>(unsigned N, unsigned D, unsigned ntrees, bool copy_points);
+template
+memory_breakdown
+nn_obj_estimate_kdtree<double>(unsigned N, unsigned D, unsigned ntrees, bool copy_points);
 
 }
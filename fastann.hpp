@@ -5,10 +5,50 @@
 #ifndef __FASTANN_FASTANN_HPP
 #define __FASTANN_FASTANN_HPP
 
+#include "allocator.hpp"
 #include "rand_point_gen.hpp"
+#include "search_stats.hpp"
 
 namespace fastann {
 
+/**
+ * Completion callback for nn_obj::submit_knn. \c status is 0 if the
+ * search succeeded and non-zero otherwise. It is called from a pool
+ * thread.
+ */
+typedef void (*search_callback)(void* user, int status);
+
+/**
+ * Handle on an asynchronous search started by nn_obj::submit_knn.
+ * Deleting it waits for the search to finish.
+ */
+class
+search_future
+{
+public:
+    struct state;
+
+    explicit search_future(state* st) : st_(st) { }
+    ~search_future();
+
+    /**
+     * Blocks until the results are written, returning the status.
+     */
+    int wait() const;
+    bool ready() const;
+
+private:
+    search_future(const search_future&);
+    search_future& operator=(const search_future&);
+
+    state* st_;
+};
+
+/**
+ * Points are numbered with unsigned, so an nn_obj holds fewer than
+ * 2^32 of them (offsets into the points are size_t, so N*D may be
+ * larger). For more, use nn_kdtree<Float, uint64_t> directly.
+ */
 template<class Float>
 class
 nn_obj
@@ -21,7 +61,48 @@ public:
                            unsigned* argmins, Float* mins) const = 0;
     virtual void search_knn(const Float* qus, unsigned N, unsigned K,
                             unsigned* argmins, Float* mins) const = 0;
+    /**
+     * As search_knn, also filling \c stats[n] for every query. The
+     * counters are all zero unless the library was built with
+     * FASTANN_STATS.
+     */
+    virtual void search_knn_stats(const Float* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, Float* mins, search_stats* stats) const
+    {
+        search_knn(qus, N, K, argmins, mins);
+        memset(stats, 0, N*sizeof(search_stats));
+    }
+
+    /**
+     * Counters aggregated over every query answered so far, or 0 if
+     * this object doesn't keep them.
+     */
+    virtual const search_stats_summary* stats_summary() const { return 0; }
+    virtual void reset_stats() { }
+
+    /**
+     * The bytes this object holds, by kind. Borrowed points are not
+     * counted; mapped ones are.
+     */
+    virtual memory_breakdown memory_usage() const { return memory_breakdown(); }
+
+    /**
+     * Asynchronous search_knn on the library's thread pool, split into
+     * chunks of queries that run in parallel. Results are written
+     * straight into \c argmins and \c mins, which (like \c qus) must
+     * stay valid until the search completes.
+     */
+    search_future* submit_knn(const Float* qus, unsigned N, unsigned K,
+                              unsigned* argmins, Float* mins) const;
+    void submit_knn(const Float* qus, unsigned N, unsigned K,
+                    unsigned* argmins, Float* mins,
+                    search_callback cb, void* user) const;
     
+    /**
+     * Appends \c N points, numbered on from npoints(). The exact and
+     * kd-tree indexes copy them and take them while other threads keep
+     * searching; other indexes throw.
+     */
     virtual void add_points(const Float* pnts, unsigned N)
     { throw 0; }
 
@@ -44,6 +125,35 @@ public:
     virtual void search_knn(const unsigned char* qus, unsigned N, unsigned K,
                             unsigned* argmins, unsigned* mins) const = 0;
 
+    virtual void search_knn_stats(const unsigned char* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, unsigned* mins, search_stats* stats) const
+    {
+        search_knn(qus, N, K, argmins, mins);
+        memset(stats, 0, N*sizeof(search_stats));
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return 0; }
+    virtual void reset_stats() { }
+
+    virtual memory_breakdown memory_usage() const { return memory_breakdown(); }
+
+    search_future* submit_knn(const unsigned char* qus, unsigned N, unsigned K,
+                              unsigned* argmins, unsigned* mins) const;
+    void submit_knn(const unsigned char* qus, unsigned N, unsigned K,
+                    unsigned* argmins, unsigned* mins,
+                    search_callback cb, void* user) const;
+
+    /**
+     * As search_knn_stats (\c stats may be 0), for float queries on the
+     * same scale as the points: rather than being rounded to bytes they
+     * are compared with the points widened to float, and the distances
+     * are float. The exact and kd-tree indexes (mapped and NUMA ones
+     * too) implement it; others throw.
+     */
+    virtual void search_knn_float(const float* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, float* mins, search_stats* stats) const
+    { throw 0; }
+
     virtual void add_points(const unsigned char* pnts, unsigned N)
     { throw 0; }
 
@@ -53,13 +163,170 @@ public:
     virtual ~nn_obj() { }
 };
 
+/**
+ * By default the builders borrow \c pnts, which must then outlive the
+ * returned object unmodified. With \c copy_points set the object
+ * copies the points into its own aligned storage (for the kd-tree,
+ * reordered to follow its leaves) and \c pnts may be freed at once.
+ * Tree nodes, point copies and build scratch come from \c alloc (the
+ * default allocator if 0), which must outlive the object; a
+ * budget_allocator turns running over budget into std::bad_alloc.
+ */
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_exact(const Float* pnts, unsigned N, unsigned D, bool copy_points=false,
+                   allocator* alloc=0);
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                    bool copy_points=false, allocator* alloc=0);
+
+/**
+ * Exact search, like nn_obj_build_exact, that skips blocks of points.
+ * The points are copied in kd-tree order into blocks of
+ * \c block_points, each with its bounding box, and a query reads
+ * blocks nearest first until the next box lies beyond its K-th
+ * neighbour. Answers are those of nn_obj_build_exact. Worthwhile on
+ * clustered or low dimensional points; on uniform high dimensional
+ * ones nothing is skipped and it is up to about 20% slower than
+ * nn_obj_build_exact. \c pnts may be freed at once.
+ */
 template<class Float>
 nn_obj<Float>*
-nn_obj_build_exact(const Float* pnts, unsigned N, unsigned D);
+nn_obj_build_exact_blocked(const Float* pnts, unsigned N, unsigned D, unsigned block_points=256,
+                           allocator* alloc=0);
+
+/**
+ * Predicts memory_usage() of the object the matching builder would
+ * return, without building it. The kd-tree figure is an estimate (leaf
+ * occupancy depends on the data); a kd-tree build also needs 4N bytes
+ * of scratch on top.
+ */
+template<class Float>
+memory_breakdown
+nn_obj_estimate_exact(unsigned N, unsigned D, bool copy_points=false);
+
+template<class Float>
+memory_breakdown
+nn_obj_estimate_kdtree(unsigned N, unsigned D, unsigned ntrees, bool copy_points=false);
 
+/**
+ * Where nn_obj_build_kdtree_numa puts the index on a NUMA machine.
+ * numa_first_touch: one copy, on the node of the building thread.
+ * numa_interleaved: one copy, its pages spread over every node.
+ * numa_replicated: a copy of the trees and points per node, each built
+ * by a thread on that node and searched by threads running there.
+ */
+enum numa_policy { numa_first_touch, numa_interleaved, numa_replicated };
+
+/**
+ * As nn_obj_build_kdtree with \c copy_points set, placing the copies
+ * (on huge pages where possible) by \c policy. Replicas are built with
+ * the same seed, so every node returns the same answers.
+ */
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_kdtree_numa(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         numa_policy policy);
+
+/**
+ * Pins the workers of the library's thread pool, spread evenly over
+ * the NUMA nodes, so that submit_knn on a replicated index always
+ * reads the local copy. Returns false if the kernel refused a pin.
+ */
+bool
+numa_pin_thread_pool();
+
+/**
+ * Builds a kd-forest over \c pnts and writes it, together with a copy
+ * of the points, to \c path as a single position independent file.
+ * The file is written under a unique temporary name beside \c path
+ * and renamed into place, so processes that already map an older
+ * version are unaffected and concurrent writers don't clobber each
+ * other (the last rename wins). It is created readable by everyone
+ * (0644). Returns false on an I/O error or if \c ntrees is 0.
+ */
+template<class Float>
+bool
+nn_obj_write_kdtree(const char* path, const Float* pnts, unsigned N, unsigned D, unsigned ntrees);
+
+/**
+ * Maps a file written by nn_obj_write_kdtree read-only and searches it
+ * in place, so any number of processes mapping the same file (or a
+ * POSIX shared memory segment under /dev/shm) share one copy of the
+ * index in the page cache. Returns 0 if the file can't be mapped,
+ * wasn't written for this \c Float, or is truncated or corrupt: the
+ * tree nodes, roots and leaf indices are checked when it is mapped,
+ * the points and point order aren't (they are only read or returned).
+ */
+template<class Float>
+nn_obj<Float>*
+nn_obj_map_kdtree(const char* path, unsigned nchecks);
+
+/**
+ * A two stage search: a cheap \c first_stage index proposes \c R
+ * candidates per query which are then reranked with exact distances
+ * against the full precision points.
+ */
+template<class Float>
+class
+nn_obj_rerank : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    /**
+     * As search_knn, but with the number of candidates to rerank
+     * given per call rather than using the default from the builder.
+     */
+    virtual void search_knn_rerank(const float_type* qus, unsigned N, unsigned K, unsigned R,
+                                   unsigned* argmins, accum_float_type* mins) const = 0;
+};
+
+/**
+ * Wraps \c first_stage (which must take the same \c D dimensional
+ * queries) and reranks its top \c R candidates with exact distances
+ * to \c pnts. \c pnts is not copied, so it may equally be in RAM or
+ * mmap'd. The returned object takes ownership of \c first_stage, and
+ * if the builder throws (0 if \c first_stage doesn't hold \c N points
+ * of dimension \c D, or std::bad_alloc) it has already deleted it.
+ */
+template<class Float>
+nn_obj_rerank<Float>*
+nn_obj_build_rerank(nn_obj<Float>* first_stage, const Float* pnts, unsigned N, unsigned D, unsigned R);
+
+/**
+ * Projects the points onto their leading \c d principal components
+ * (see pca.hpp), learned from \c nsample of them (0 for a default),
+ * and builds a kd-forest over the projection; queries are projected as
+ * they are searched. With \c R > 0 the top \c R candidates are then
+ * reranked with exact distances in all \c D dimensions, and \c pnts
+ * must outlive the object. Otherwise \c pnts may be freed at once and
+ * the distances returned are those between the projections.
+ */
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_pca_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees,
+                        unsigned nchecks, unsigned R=0, unsigned nsample=0);
+
+/**
+ * Exact search over \c D dimensional points left in the file at
+ * \c path, for databases too big for memory. Rows start \c offset
+ * bytes in and each is \c header_bytes (4 for .fvecs/.bvecs, whose
+ * header must hold \c D) followed by the point. Every search reads the
+ * whole file sequentially in blocks of about \c block_bytes, reading
+ * the next block while the current one is compared with all the
+ * queries, so pass queries in large batches. With \c direct_io the
+ * file is read with O_DIRECT where the file system allows it, keeping
+ * it out of the page cache. Returns 0 if the file can't be opened or
+ * isn't a whole number of rows; searches throw 0 on a read error.
+ */
 template<class Float>
 nn_obj<Float>*
-nn_obj_build_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks);
+nn_obj_open_exact_stream(const char* path, unsigned D, size_t header_bytes=0, size_t offset=0,
+                         bool direct_io=false, size_t block_bytes=64 << 20);
 
 }
 
@@ -0,0 +1,194 @@
+#include <pthread.h>
+
+#include <algorithm>
+
+#include "fastann.hpp"
+#include "thread_pool.hpp"
+
+namespace fastann {
+
+struct search_future::state
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    int status;
+
+    state() : done(false), status(0)
+    {
+        pthread_mutex_init(&mutex, 0);
+        pthread_cond_init(&cond, 0);
+    }
+
+    ~state()
+    {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void
+    complete(int st)
+    {
+        pthread_mutex_lock(&mutex);
+        status = st;
+        done = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+search_future::~search_future()
+{
+    wait();
+    delete st_;
+}
+
+int
+search_future::wait() const
+{
+    pthread_mutex_lock(&st_->mutex);
+    while (!st_->done) pthread_cond_wait(&st_->cond, &st_->mutex);
+    int ret = st_->status;
+    pthread_mutex_unlock(&st_->mutex);
+    return ret;
+}
+
+bool
+search_future::ready() const
+{
+    pthread_mutex_lock(&st_->mutex);
+    bool ret = st_->done;
+    pthread_mutex_unlock(&st_->mutex);
+    return ret;
+}
+
+namespace {
+
+static const unsigned queries_per_chunk = 32;
+
+/**
+ * One submit_knn call. Every pool task claims chunks of queries until
+ * none remain; the last task to exit completes the job and frees it.
+ */
+template<class Float>
+struct knn_job
+{
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    const nn_obj<Float>* nno;
+    const Float* qus;
+    unsigned N;
+    unsigned K;
+    unsigned* argmins;
+    accum_float_type* mins;
+
+    search_callback cb;
+    void* user;
+    search_future::state* fut;
+
+    unsigned next;   // Next unclaimed query, advanced atomically.
+    unsigned ntasks; // Tasks still running, advanced atomically.
+    int failed;
+};
+
+template<class Float>
+void
+knn_job_task(void* arg)
+{
+    knn_job<Float>* job = (knn_job<Float>*)arg;
+    unsigned D = job->nno->ndims();
+
+    for (;;) {
+        unsigned begin = __sync_fetch_and_add(&job->next, queries_per_chunk);
+        if (begin >= job->N) break;
+        unsigned nq = std::min(queries_per_chunk, job->N - begin);
+        try {
+            job->nno->search_knn(job->qus + (size_t)begin*D, nq, job->K,
+                                 job->argmins + (size_t)begin*job->K,
+                                 job->mins + (size_t)begin*job->K);
+        }
+        catch (...) {
+            __sync_lock_test_and_set(&job->failed, 1);
+        }
+    }
+
+    if (__sync_sub_and_fetch(&job->ntasks, 1) == 0) {
+        __sync_synchronize();
+        int status = job->failed ? -1 : 0;
+        if (job->fut) job->fut->complete(status);
+        if (job->cb) job->cb(job->user, status);
+        delete job;
+    }
+}
+
+template<class Float>
+void
+submit_knn_impl(const nn_obj<Float>* nno, const Float* qus, unsigned N, unsigned K,
+                unsigned* argmins, typename nn_obj<Float>::accum_float_type* mins,
+                search_callback cb, void* user, search_future::state* fut)
+{
+    thread_pool& pool = thread_pool::global();
+
+    knn_job<Float>* job = new knn_job<Float>;
+    job->nno = nno;
+    job->qus = qus;
+    job->N = N;
+    job->K = K;
+    job->argmins = argmins;
+    job->mins = mins;
+    job->cb = cb;
+    job->user = user;
+    job->fut = fut;
+    job->next = 0;
+    job->failed = 0;
+
+    unsigned nchunks = (N + queries_per_chunk - 1)/queries_per_chunk;
+    unsigned ntasks = std::max(1u, std::min(pool.nthreads(), nchunks));
+    job->ntasks = ntasks;
+    for (unsigned t=0; t < ntasks; ++t) pool.submit(&knn_job_task<Float>, job);
+}
+
+}
+
+template<class Float>
+search_future*
+nn_obj<Float>::submit_knn(const Float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, Float* mins) const
+{
+    search_future::state* st = new search_future::state;
+    search_future* ret = new search_future(st);
+    submit_knn_impl(this, qus, N, K, argmins, mins, 0, 0, st);
+    return ret;
+}
+
+template<class Float>
+void
+nn_obj<Float>::submit_knn(const Float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, Float* mins,
+                          search_callback cb, void* user) const
+{
+    submit_knn_impl(this, qus, N, K, argmins, mins, cb, user, 0);
+}
+
+search_future*
+nn_obj<unsigned char>::submit_knn(const unsigned char* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, unsigned* mins) const
+{
+    search_future::state* st = new search_future::state;
+    search_future* ret = new search_future(st);
+    submit_knn_impl(this, qus, N, K, argmins, mins, 0, 0, st);
+    return ret;
+}
+
+void
+nn_obj<unsigned char>::submit_knn(const unsigned char* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, unsigned* mins,
+                                  search_callback cb, void* user) const
+{
+    submit_knn_impl(this, qus, N, K, argmins, mins, cb, user, 0);
+}
+
+template class nn_obj<float>;
+template class nn_obj<double>;
+
+}
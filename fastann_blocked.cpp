@@ -0,0 +1,301 @@
+#include <float.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fastann.hpp"
+#include "dist_l2.hpp"
+#include "dist_l2_funcs.hpp"
+#include "point_store.hpp"
+
+namespace fastann {
+
+namespace {
+
+/**
+ * How far a kernel's distance may fall below the true one, relative to
+ * it, so that pruning against it never drops a block it would have
+ * answered from. Byte distances are exact.
+ */
+template<class DistT>
+inline double
+bound_slack(unsigned D) { return 0.0; }
+
+template<>
+inline double
+bound_slack<float>(unsigned D) { return (D + 2)*(double)FLT_EPSILON; }
+
+template<>
+inline double
+bound_slack<double>(unsigned D) { return (D + 2)*DBL_EPSILON; }
+
+template<class Float>
+struct
+coord_less
+{
+    const Float* pnts;
+    unsigned D;
+    unsigned d;
+
+    bool operator()(unsigned a, unsigned b) const { return pnts[(size_t)a*D + d] < pnts[(size_t)b*D + d]; }
+};
+
+/**
+ * Splits \c order[begin, end) at the median of its widest dimension
+ * until every part holds at most \c block points, so that consecutive
+ * blocks of the result are kd-tree leaves. Splits fall on multiples of
+ * \c block, leaving only the last block short.
+ */
+template<class Float>
+void
+kd_order(const Float* pnts, unsigned D, unsigned* order, size_t begin, size_t end, unsigned block)
+{
+    size_t n = end - begin;
+    if (n <= block) return;
+
+    unsigned best = 0;
+    double best_spread = -1;
+    for (unsigned d=0; d < D; ++d) {
+        Float lo = pnts[(size_t)order[begin]*D + d], hi = lo;
+        for (size_t i=begin + 1; i < end; ++i) {
+            Float v = pnts[(size_t)order[i]*D + d];
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+        if ((double)hi - lo > best_spread) {
+            best_spread = (double)hi - lo;
+            best = d;
+        }
+    }
+
+    size_t nblocks = (n + block - 1)/block;
+    size_t mid = begin + (nblocks/2)*(size_t)block;
+    coord_less<Float> cmp = { pnts, D, best };
+    std::nth_element(order + begin, order + mid, order + end, cmp);
+    kd_order(pnts, D, order, begin, mid, block);
+    kd_order(pnts, D, order, mid, end, block);
+}
+
+/**
+ * Exact search that skips whole blocks of points. The points are
+ * copied in kd-tree leaf order and cut into blocks, each with the
+ * bounding box of its points. A query visits the blocks nearest box
+ * first and stops at the first whose box is further than its K-th
+ * neighbour so far; on clustered points most blocks are never read.
+ * In high dimensions, or on uniform points, the boxes overlap and every
+ * block is read; with the box distances, the sort and the per block
+ * heap updates on top of the full scan it is then somewhat slower than
+ * nn_obj_exact (0.8x to 1.0x on 128 dimensional unit random points).
+ */
+template<class Float>
+class nn_obj_exact_blocked : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    /**
+     * Blocks read are counted as leaves.
+     */
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        knn_visitor<float_type, accum_float_type> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_, v);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        knn_visitor<float, float> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_l2_mixed_best(D_), v);
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    /**
+     * The reordered copy of the points, with the boxes and the original
+     * numbering as aux.
+     */
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        memory_breakdown mem;
+        mem.points = store_.size_bytes();
+        mem.aux = (lo_.capacity() + hi_.capacity())*sizeof(Float) + old_of_new_.capacity()*sizeof(unsigned);
+        return mem;
+    }
+
+    virtual unsigned ndims() const { return D_; }
+    virtual unsigned npoints() const { return N_; }
+
+    nn_obj_exact_blocked(const Float* pnts, unsigned N, unsigned D, unsigned block, allocator& alloc)
+     : store_(alloc), D_(D), N_(N), block_(block ? block : 1), old_of_new_(N), dist_(dist_l2_best<Float>(D))
+    {
+        if (N == 0) return;
+        for (unsigned n=0; n < N; ++n) old_of_new_[n] = n;
+        kd_order(pnts, D, &old_of_new_[0], 0, N, block_);
+        store_.assign(pnts, N, D, &old_of_new_[0]);
+
+        unsigned nblocks = (N + block_ - 1)/block_;
+        const Float* rows = store_.data();
+        lo_.resize((size_t)nblocks*D);
+        hi_.resize((size_t)nblocks*D);
+        for (unsigned b=0; b < nblocks; ++b) {
+            unsigned first = b*block_, last = std::min(N, first + block_);
+            Float* lo = &lo_[(size_t)b*D];
+            Float* hi = &hi_[(size_t)b*D];
+            std::copy(rows + (size_t)first*D, rows + (size_t)(first + 1)*D, lo);
+            std::copy(rows + (size_t)first*D, rows + (size_t)(first + 1)*D, hi);
+            for (unsigned n=first + 1; n < last; ++n) {
+                for (unsigned d=0; d < D; ++d) {
+                    lo[d] = std::min(lo[d], rows[(size_t)n*D + d]);
+                    hi[d] = std::max(hi[d], rows[(size_t)n*D + d]);
+                }
+            }
+        }
+    }
+
+private:
+    /**
+     * search_knn_with for the distance dispatch_dist_l2 picks.
+     */
+    template<class Query, class DistT>
+    struct
+    knn_visitor
+    {
+        const nn_obj_exact_blocked* self;
+        const Query* qus;
+        unsigned N;
+        unsigned K;
+        unsigned* argmins;
+        DistT* mins;
+        search_stats* stats;
+
+        template<class Dist>
+        void operator()(Dist dist) const { self->search_knn_with(qus, dist, N, K, argmins, mins, stats); }
+    };
+
+    /**
+     * The squared distance from \c qu to block \c b's box, a lower
+     * bound on its distance to any of the block's points.
+     */
+    template<class Query>
+    double
+    box_dsq(const Query* qu, unsigned b) const
+    {
+        const Float* lo = &lo_[(size_t)b*D_];
+        const Float* hi = &hi_[(size_t)b*D_];
+        double dsq = 0;
+        for (unsigned d=0; d < D_; ++d) {
+            double q = qu[d];
+            double diff = q < lo[d] ? lo[d] - q : (q > hi[d] ? q - hi[d] : 0.0);
+            dsq += diff*diff;
+        }
+        return dsq;
+    }
+
+    template<class Query, class Dist, class DistT>
+    void
+    search_knn_with(const Query* qus, Dist dist, unsigned N, unsigned K,
+                    unsigned* argmins, DistT* mins, search_stats* stats) const
+    {
+        const Float* rows = store_.data();
+        unsigned nblocks = (unsigned)(lo_.size()/D_);
+        double slack = 1.0 + bound_slack<DistT>(D_);
+
+        std::vector< std::pair<double,unsigned> > order(nblocks);
+        std::vector< DistT > dsqout(block_);
+        std::vector< std::pair<DistT,unsigned> > knn; // A max heap of the K best so far.
+        knn.reserve(K);
+        batch_stats_scope batch(&stats_);
+        for (unsigned n=0; n < N; ++n) {
+            query_stats_scope st(stats ? &stats[n] : 0, batch.get());
+            const Query* qu = qus + (size_t)n*D_;
+            for (unsigned b=0; b < nblocks; ++b) order[b] = std::make_pair(box_dsq(qu, b), b);
+            std::sort(order.begin(), order.end());
+
+            knn.clear();
+            for (unsigned i=0; i < nblocks; ++i) {
+                // Ties with the K-th are read, so the answer is nn_obj_exact's.
+                if (knn.size() == K && order[i].first > knn.front().first*slack) break;
+
+                unsigned first = order[i].second*block_, nb = std::min(N_ - first, block_);
+                dist.func(qu, rows + (size_t)first*D_, nb, D_, &dsqout[0]);
+                FASTANN_STAT_ADD(st.get(), ndists, nb);
+                FASTANN_STAT_ADD(st.get(), nleaves, 1);
+
+                for (unsigned p=0; p < nb; ++p) {
+                    std::pair<DistT,unsigned> pr(dsqout[p], old_of_new_[first + p]);
+                    if (knn.size() < K) {
+                        knn.push_back(pr);
+                        std::push_heap(knn.begin(), knn.end());
+                    }
+                    else if (pr < knn.front()) {
+                        std::pop_heap(knn.begin(), knn.end());
+                        knn.back() = pr;
+                        std::push_heap(knn.begin(), knn.end());
+                    }
+                }
+            }
+
+            std::sort_heap(knn.begin(), knn.end());
+            for (unsigned k=0; k < knn.size(); ++k) {
+                argmins[(size_t)n*K + k] = knn[k].second;
+                mins[(size_t)n*K + k] = knn[k].first;
+            }
+        }
+    }
+
+    point_store<Float> store_;
+    unsigned D_;
+    unsigned N_;
+    unsigned block_;
+    std::vector<unsigned> old_of_new_;
+    std::vector<Float> lo_; // Per block box corners, D each.
+    std::vector<Float> hi_;
+    dist_l2_wrapper<Float> dist_;
+    mutable search_stats_summary stats_;
+};
+
+}
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_exact_blocked(const Float* pnts, unsigned N, unsigned D, unsigned block_points,
+                           allocator* alloc)
+{
+    return new nn_obj_exact_blocked<Float>(pnts, N, D, block_points, alloc ? *alloc : default_allocator());
+}
+
+template
+nn_obj<unsigned char>*
+nn_obj_build_exact_blocked(const unsigned char* pnts, unsigned N, unsigned D, unsigned block_points,
+                           allocator* alloc);
+template
+nn_obj<float>*
+nn_obj_build_exact_blocked(const float* pnts, unsigned N, unsigned D, unsigned block_points,
+                           allocator* alloc);
+template
+nn_obj<double>*
+nn_obj_build_exact_blocked(const double* pnts, unsigned N, unsigned D, unsigned block_points,
+                           allocator* alloc);
+
+}
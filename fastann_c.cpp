@@ -0,0 +1,246 @@
+#include <new>
+
+#include "fastann.hpp"
+#include "fastann_c.h"
+
+enum fastann_dtype { FASTANN_DTYPE_U8, FASTANN_DTYPE_F32, FASTANN_DTYPE_F64 };
+
+struct fastann_index
+{
+    fastann_dtype dtype;
+    void* obj;
+};
+
+namespace {
+
+template<class Float> struct dtype_of { };
+template<> struct dtype_of<unsigned char> { static const fastann_dtype value = FASTANN_DTYPE_U8; };
+template<> struct dtype_of<float> { static const fastann_dtype value = FASTANN_DTYPE_F32; };
+template<> struct dtype_of<double> { static const fastann_dtype value = FASTANN_DTYPE_F64; };
+
+template<class Float>
+fastann::nn_obj<Float>*
+get_obj(const fastann_index* idx)
+{
+    if (idx->dtype != dtype_of<Float>::value) return 0;
+    return (fastann::nn_obj<Float>*)idx->obj;
+}
+
+template<class Float>
+void
+delete_obj(fastann_index* idx)
+{
+    delete (fastann::nn_obj<Float>*)idx->obj;
+}
+
+/**
+ * Takes ownership of \c obj, wrapping it in a handle.
+ */
+template<class Float>
+int
+wrap(fastann::nn_obj<Float>* obj, fastann_index** out)
+{
+    fastann_index* idx = new (std::nothrow) fastann_index;
+    if (!idx) { delete obj; return FASTANN_ENOMEM; }
+    idx->dtype = dtype_of<Float>::value;
+    idx->obj = obj;
+    *out = idx;
+    return FASTANN_OK;
+}
+
+template<class Float>
+int
+build_exact(const Float* pnts, unsigned N, unsigned D, fastann_index** out)
+{
+    if (!pnts || !out || !N || !D) return FASTANN_EINVAL;
+    try {
+        return wrap(fastann::nn_obj_build_exact(pnts, N, D), out);
+    }
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+template<class Float>
+int
+build_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks, fastann_index** out)
+{
+    if (!pnts || !out || !N || !D || !ntrees) return FASTANN_EINVAL;
+    try {
+        return wrap(fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks), out);
+    }
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+template<class Float>
+int
+write_kdtree(const char* path, const Float* pnts, unsigned N, unsigned D, unsigned ntrees)
+{
+    if (!path || !pnts || !N || !D || !ntrees) return FASTANN_EINVAL;
+    try {
+        return fastann::nn_obj_write_kdtree(path, pnts, N, D, ntrees) ? FASTANN_OK : FASTANN_EIO;
+    }
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+template<class Float>
+int
+map_kdtree(const char* path, unsigned nchecks, fastann_index** out)
+{
+    if (!path || !out) return FASTANN_EINVAL;
+    try {
+        fastann::nn_obj<Float>* obj = fastann::nn_obj_map_kdtree<Float>(path, nchecks);
+        if (!obj) return FASTANN_EIO;
+        return wrap(obj, out);
+    }
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+template<class Float>
+int
+build_rerank(fastann_index* first_stage, const Float* pnts, unsigned N, unsigned D, unsigned R,
+             fastann_index** out)
+{
+    if (!first_stage) return FASTANN_EINVAL;
+    fastann::nn_obj<Float>* first = get_obj<Float>(first_stage);
+    if (!first) { fastann_free(first_stage); return FASTANN_ETYPE; }
+    delete first_stage; // The handle, not the object.
+
+    if (!pnts || !out || first->ndims() != D || first->npoints() != N) {
+        delete first;
+        return FASTANN_EINVAL;
+    }
+    try {
+        return wrap(fastann::nn_obj_build_rerank(first, pnts, N, D, R), out);
+    }
+    // The builder deletes first when it throws.
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+template<class Float>
+int
+search_knn(const fastann_index* idx, const Float* qus, unsigned N, unsigned K,
+           unsigned* argmins, typename fastann::nn_obj<Float>::accum_float_type* mins)
+{
+    if (!idx || !argmins || !mins || (N && !qus)) return FASTANN_EINVAL;
+    const fastann::nn_obj<Float>* obj = get_obj<Float>(idx);
+    if (!obj) return FASTANN_ETYPE;
+    if (K == 0 || K > obj->npoints()) return FASTANN_EINVAL;
+    if (N == 0) return FASTANN_OK;
+    try {
+        obj->search_knn(qus, N, K, argmins, mins);
+        return FASTANN_OK;
+    }
+    catch (const std::bad_alloc&) { return FASTANN_ENOMEM; }
+    catch (...) { return FASTANN_EINTERNAL; }
+}
+
+}
+
+extern "C" {
+
+const char*
+fastann_strerror(int status)
+{
+    switch (status) {
+        case FASTANN_OK: return "success";
+        case FASTANN_EINVAL: return "invalid argument";
+        case FASTANN_ENOMEM: return "out of memory";
+        case FASTANN_ETYPE: return "element type does not match index";
+        case FASTANN_EINTERNAL: return "internal error";
+        case FASTANN_EIO: return "i/o error";
+        default: return "unknown error";
+    }
+}
+
+int fastann_build_exact_u8(const unsigned char* pnts, unsigned N, unsigned D, fastann_index** out)
+{ return build_exact(pnts, N, D, out); }
+int fastann_build_exact_f32(const float* pnts, unsigned N, unsigned D, fastann_index** out)
+{ return build_exact(pnts, N, D, out); }
+int fastann_build_exact_f64(const double* pnts, unsigned N, unsigned D, fastann_index** out)
+{ return build_exact(pnts, N, D, out); }
+
+int fastann_build_kdtree_u8(const unsigned char* pnts, unsigned N, unsigned D,
+                            unsigned ntrees, unsigned nchecks, fastann_index** out)
+{ return build_kdtree(pnts, N, D, ntrees, nchecks, out); }
+int fastann_build_kdtree_f32(const float* pnts, unsigned N, unsigned D,
+                             unsigned ntrees, unsigned nchecks, fastann_index** out)
+{ return build_kdtree(pnts, N, D, ntrees, nchecks, out); }
+int fastann_build_kdtree_f64(const double* pnts, unsigned N, unsigned D,
+                             unsigned ntrees, unsigned nchecks, fastann_index** out)
+{ return build_kdtree(pnts, N, D, ntrees, nchecks, out); }
+
+int fastann_write_kdtree_u8(const char* path, const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees)
+{ return write_kdtree(path, pnts, N, D, ntrees); }
+int fastann_write_kdtree_f32(const char* path, const float* pnts, unsigned N, unsigned D, unsigned ntrees)
+{ return write_kdtree(path, pnts, N, D, ntrees); }
+int fastann_write_kdtree_f64(const char* path, const double* pnts, unsigned N, unsigned D, unsigned ntrees)
+{ return write_kdtree(path, pnts, N, D, ntrees); }
+
+int fastann_map_kdtree_u8(const char* path, unsigned nchecks, fastann_index** out)
+{ return map_kdtree<unsigned char>(path, nchecks, out); }
+int fastann_map_kdtree_f32(const char* path, unsigned nchecks, fastann_index** out)
+{ return map_kdtree<float>(path, nchecks, out); }
+int fastann_map_kdtree_f64(const char* path, unsigned nchecks, fastann_index** out)
+{ return map_kdtree<double>(path, nchecks, out); }
+
+int fastann_build_rerank_u8(fastann_index* first_stage, const unsigned char* pnts, unsigned N, unsigned D,
+                            unsigned R, fastann_index** out)
+{ return build_rerank(first_stage, pnts, N, D, R, out); }
+int fastann_build_rerank_f32(fastann_index* first_stage, const float* pnts, unsigned N, unsigned D,
+                             unsigned R, fastann_index** out)
+{ return build_rerank(first_stage, pnts, N, D, R, out); }
+int fastann_build_rerank_f64(fastann_index* first_stage, const double* pnts, unsigned N, unsigned D,
+                             unsigned R, fastann_index** out)
+{ return build_rerank(first_stage, pnts, N, D, R, out); }
+
+int fastann_search_knn_u8(const fastann_index* idx, const unsigned char* qus, unsigned N, unsigned K,
+                          unsigned* argmins, unsigned* mins)
+{ return search_knn(idx, qus, N, K, argmins, mins); }
+int fastann_search_knn_f32(const fastann_index* idx, const float* qus, unsigned N, unsigned K,
+                           unsigned* argmins, float* mins)
+{ return search_knn(idx, qus, N, K, argmins, mins); }
+int fastann_search_knn_f64(const fastann_index* idx, const double* qus, unsigned N, unsigned K,
+                           unsigned* argmins, double* mins)
+{ return search_knn(idx, qus, N, K, argmins, mins); }
+
+int
+fastann_ndims(const fastann_index* idx, unsigned* out)
+{
+    if (!idx || !out) return FASTANN_EINVAL;
+    switch (idx->dtype) {
+        case FASTANN_DTYPE_U8: *out = get_obj<unsigned char>(idx)->ndims(); break;
+        case FASTANN_DTYPE_F32: *out = get_obj<float>(idx)->ndims(); break;
+        case FASTANN_DTYPE_F64: *out = get_obj<double>(idx)->ndims(); break;
+    }
+    return FASTANN_OK;
+}
+
+int
+fastann_npoints(const fastann_index* idx, unsigned* out)
+{
+    if (!idx || !out) return FASTANN_EINVAL;
+    switch (idx->dtype) {
+        case FASTANN_DTYPE_U8: *out = get_obj<unsigned char>(idx)->npoints(); break;
+        case FASTANN_DTYPE_F32: *out = get_obj<float>(idx)->npoints(); break;
+        case FASTANN_DTYPE_F64: *out = get_obj<double>(idx)->npoints(); break;
+    }
+    return FASTANN_OK;
+}
+
+void
+fastann_free(fastann_index* idx)
+{
+    if (!idx) return;
+    switch (idx->dtype) {
+        case FASTANN_DTYPE_U8: delete_obj<unsigned char>(idx); break;
+        case FASTANN_DTYPE_F32: delete_obj<float>(idx); break;
+        case FASTANN_DTYPE_F64: delete_obj<double>(idx); break;
+    }
+    delete idx;
+}
+
+}
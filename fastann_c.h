@@ -0,0 +1,89 @@
+/**
+ * A C interface to fastann, for easy use from Python (ctypes), Go
+ * (cgo), Matlab etc.
+ *
+ * Indexes are opaque handles. Every function returns a fastann_status
+ * and no C++ exception ever crosses this interface. All output arrays
+ * are allocated by the caller and all searches take a batch of queries.
+ */
+#ifndef __FASTANN_FASTANN_C_H
+#define __FASTANN_FASTANN_C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fastann_index fastann_index;
+
+typedef enum fastann_status
+{
+    FASTANN_OK = 0,
+    FASTANN_EINVAL = 1,   /* Bad argument (null pointer, K > npoints, ...) */
+    FASTANN_ENOMEM = 2,   /* Allocation failed */
+    FASTANN_ETYPE = 3,    /* Element type doesn't match the index */
+    FASTANN_EINTERNAL = 4, /* Any other failure inside the library */
+    FASTANN_EIO = 5        /* A file couldn't be read, written or mapped */
+} fastann_status;
+
+const char* fastann_strerror(int status);
+
+/**
+ * Builders. The points are not copied, so \c pnts must outlive the
+ * index. On success \c *out holds a handle to release with
+ * fastann_free.
+ */
+int fastann_build_exact_u8(const unsigned char* pnts, unsigned N, unsigned D, fastann_index** out);
+int fastann_build_exact_f32(const float* pnts, unsigned N, unsigned D, fastann_index** out);
+int fastann_build_exact_f64(const double* pnts, unsigned N, unsigned D, fastann_index** out);
+
+int fastann_build_kdtree_u8(const unsigned char* pnts, unsigned N, unsigned D,
+                            unsigned ntrees, unsigned nchecks, fastann_index** out);
+int fastann_build_kdtree_f32(const float* pnts, unsigned N, unsigned D,
+                             unsigned ntrees, unsigned nchecks, fastann_index** out);
+int fastann_build_kdtree_f64(const double* pnts, unsigned N, unsigned D,
+                             unsigned ntrees, unsigned nchecks, fastann_index** out);
+
+/**
+ * Write a kd-forest to a file and map it read-only (see
+ * nn_obj_write_kdtree and nn_obj_map_kdtree in fastann.hpp).
+ */
+int fastann_write_kdtree_u8(const char* path, const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees);
+int fastann_write_kdtree_f32(const char* path, const float* pnts, unsigned N, unsigned D, unsigned ntrees);
+int fastann_write_kdtree_f64(const char* path, const double* pnts, unsigned N, unsigned D, unsigned ntrees);
+
+int fastann_map_kdtree_u8(const char* path, unsigned nchecks, fastann_index** out);
+int fastann_map_kdtree_f32(const char* path, unsigned nchecks, fastann_index** out);
+int fastann_map_kdtree_f64(const char* path, unsigned nchecks, fastann_index** out);
+
+/**
+ * Wraps \c first_stage in an exact rerank of its top \c R candidates.
+ * Ownership of \c first_stage passes to the new index, even on failure.
+ */
+int fastann_build_rerank_u8(fastann_index* first_stage, const unsigned char* pnts, unsigned N, unsigned D,
+                            unsigned R, fastann_index** out);
+int fastann_build_rerank_f32(fastann_index* first_stage, const float* pnts, unsigned N, unsigned D,
+                             unsigned R, fastann_index** out);
+int fastann_build_rerank_f64(fastann_index* first_stage, const double* pnts, unsigned N, unsigned D,
+                             unsigned R, fastann_index** out);
+
+/**
+ * Searches \c N queries stored contiguously in \c qus. \c argmins and
+ * \c mins must each hold \c N*K elements and are filled query-major.
+ */
+int fastann_search_knn_u8(const fastann_index* idx, const unsigned char* qus, unsigned N, unsigned K,
+                          unsigned* argmins, unsigned* mins);
+int fastann_search_knn_f32(const fastann_index* idx, const float* qus, unsigned N, unsigned K,
+                           unsigned* argmins, float* mins);
+int fastann_search_knn_f64(const fastann_index* idx, const double* qus, unsigned N, unsigned K,
+                           unsigned* argmins, double* mins);
+
+int fastann_ndims(const fastann_index* idx, unsigned* out);
+int fastann_npoints(const fastann_index* idx, unsigned* out);
+
+void fastann_free(fastann_index* idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
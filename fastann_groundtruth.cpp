@@ -0,0 +1,132 @@
+/**
+ * fastann-groundtruth: exact k-NN of a query set against a base set
+ * too large for memory, streamed from disk a block at a time.
+ *
+ *   fastann-groundtruth -b base.[fb]vecs -q query.[fb]vecs -k K
+ *                       -o groundtruth.ivecs [-d distances.fvecs]
+ *                       [-B block_rows]
+ *
+ * The base and query files must have the same element type. Squared
+ * distances are written with -d.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "groundtruth.hpp"
+#include "vecs_io.hpp"
+
+namespace {
+
+struct options
+{
+    const char* base_path;
+    const char* query_path;
+    const char* out_path;
+    const char* dist_path;
+    unsigned K;
+    unsigned block_rows;
+};
+
+double
+now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+template<class Float>
+int
+run(const options& opt)
+{
+    typedef typename fastann::groundtruth_knn<Float>::AccumFloat AccumFloat;
+
+    unsigned NQ, D;
+    Float* qus = fastann::read_vecs<Float>(opt.query_path, &NQ, &D);
+    fastann::vecs_view<Float> base;
+    if (!qus || !base.open(opt.base_path)) {
+        fprintf(stderr, "fastann-groundtruth: can't read %s or %s\n", opt.query_path, opt.base_path);
+        delete[] qus;
+        return 1;
+    }
+    if (base.ndims() != D || base.npoints() > 0xffffffffu) {
+        fprintf(stderr, "fastann-groundtruth: base and queries don't match\n");
+        delete[] qus;
+        return 1;
+    }
+
+    fastann::groundtruth_knn<Float> gt(qus, NQ, D, opt.K);
+    std::vector<Float> block((size_t)opt.block_rows*D);
+    size_t N = base.npoints();
+
+    double t0 = now();
+    for (size_t b=0; b < N; b += opt.block_rows) {
+        size_t nb = std::min<size_t>(opt.block_rows, N - b);
+        base.advise(b, b + nb, MADV_WILLNEED);
+        base.repack(&block[0], b, b + nb);
+        base.advise(b, b + nb, MADV_DONTNEED); // Clean pages; just drop them.
+        gt.add_block(&block[0], (unsigned)nb, (unsigned)b);
+        fprintf(stderr, "\rfastann-groundtruth: %zu / %zu points, %.1fs", b + nb, N, now() - t0);
+    }
+    fprintf(stderr, "\n");
+
+    std::vector<unsigned> argmins((size_t)NQ*opt.K);
+    std::vector<AccumFloat> mins((size_t)NQ*opt.K);
+    gt.results(&argmins[0], &mins[0]);
+
+    fastann::vecs_writer<int> w;
+    bool ok = w.open(opt.out_path) && w.write((const int*)&argmins[0], NQ, opt.K) && w.close();
+    if (ok && opt.dist_path) {
+        std::vector<float> fmins(mins.begin(), mins.end());
+        fastann::vecs_writer<float> dw;
+        ok = dw.open(opt.dist_path) && dw.write(&fmins[0], NQ, opt.K) && dw.close();
+    }
+    delete[] qus;
+
+    if (!ok) {
+        fprintf(stderr, "fastann-groundtruth: can't write results\n");
+        return 1;
+    }
+    return 0;
+}
+
+void
+usage()
+{
+    fprintf(stderr, "usage: fastann-groundtruth -b base.[fb]vecs -q query.[fb]vecs -k K -o gt.ivecs\n"
+                    "                           [-d distances.fvecs] [-B block_rows]\n");
+    exit(2);
+}
+
+}
+
+int
+main(int argc, char** argv)
+{
+    options opt = { 0, 0, 0, 0, 100, 1u << 16 };
+
+    int c;
+    while ((c = getopt(argc, argv, "b:q:k:o:d:B:")) != -1) {
+        switch (c) {
+            case 'b': opt.base_path = optarg; break;
+            case 'q': opt.query_path = optarg; break;
+            case 'k': opt.K = atoi(optarg); break;
+            case 'o': opt.out_path = optarg; break;
+            case 'd': opt.dist_path = optarg; break;
+            case 'B': opt.block_rows = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (!opt.base_path || !opt.query_path || !opt.out_path || !opt.K || !opt.block_rows) usage();
+
+    std::string base(opt.base_path);
+    if (base.size() > 6 && base.compare(base.size() - 6, 6, ".bvecs") == 0) return run<unsigned char>(opt);
+    return run<float>(opt);
+}
@@ -0,0 +1,230 @@
+#include <pthread.h>
+
+#include <vector>
+
+#include "fastann.hpp"
+#include "huge_page_allocator.hpp"
+#include "numa.hpp"
+#include "thread_pool.hpp"
+
+namespace fastann {
+
+namespace {
+
+/**
+ * One or more copies of a kd-tree index, each with its own allocator.
+ * Searches go to the copy on the caller's node.
+ */
+template<class Float>
+class nn_obj_numa : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        local().search_nn(qus, N, argmins, mins);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        local().search_knn(qus, N, K, argmins, mins);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        local().search_knn_stats(qus, N, K, argmins, mins, stats);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        local().search_knn_float(qus, N, K, argmins, mins, stats);
+    }
+
+    /**
+     * The sum over the replicas, as of this call.
+     */
+    virtual const search_stats_summary*
+    stats_summary() const
+    {
+        pthread_mutex_lock(&mutex_);
+        stats_.clear();
+        for (size_t r=0; r < replicas_.size(); ++r) {
+            const search_stats_summary* s = replicas_[r]->stats_summary();
+            if (s) stats_.merge(*s);
+        }
+        pthread_mutex_unlock(&mutex_);
+        return &stats_;
+    }
+
+    virtual void
+    reset_stats()
+    {
+        for (size_t r=0; r < replicas_.size(); ++r) replicas_[r]->reset_stats();
+    }
+
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        memory_breakdown mem;
+        for (size_t r=0; r < replicas_.size(); ++r) mem += replicas_[r]->memory_usage();
+        return mem;
+    }
+
+    virtual unsigned ndims() const { return replicas_[0]->ndims(); }
+    virtual unsigned npoints() const { return replicas_[0]->npoints(); }
+
+    /**
+     * Takes ownership of \c replicas (one per node, or just one) and of
+     * the allocators they were built from.
+     */
+    nn_obj_numa(const std::vector< nn_obj<Float>* >& replicas,
+                const std::vector< huge_page_allocator* >& allocs)
+     : replicas_(replicas), allocs_(allocs)
+    {
+        pthread_mutex_init(&mutex_, 0);
+    }
+
+    virtual ~nn_obj_numa()
+    {
+        for (size_t r=0; r < replicas_.size(); ++r) delete replicas_[r];
+        for (size_t a=0; a < allocs_.size(); ++a) delete allocs_[a];
+        pthread_mutex_destroy(&mutex_);
+    }
+
+private:
+    const nn_obj<Float>&
+    local() const
+    {
+        if (replicas_.size() == 1) return *replicas_[0];
+        return *replicas_[numa_topology::get().current_node() % replicas_.size()];
+    }
+
+    std::vector< nn_obj<Float>* > replicas_;
+    std::vector< huge_page_allocator* > allocs_;
+    mutable pthread_mutex_t mutex_;
+    mutable search_stats_summary stats_;
+};
+
+template<class Float>
+struct replica_build
+{
+    const Float* pnts;
+    unsigned N, D, ntrees, nchecks;
+    unsigned node;
+    huge_page_allocator* alloc;
+    nn_obj<Float>* nno;
+};
+
+/**
+ * Builds one replica from a thread pinned to its node, so that every
+ * page of it is first touched, and so placed, there.
+ */
+template<class Float>
+void*
+replica_build_main(void* arg)
+{
+    replica_build<Float>* b = (replica_build<Float>*)arg;
+    numa_pin_to_node(pthread_self(), b->node);
+    try {
+        b->nno = nn_obj_build_kdtree(b->pnts, b->N, b->D, b->ntrees, b->nchecks, true, b->alloc);
+    }
+    catch (...) {
+        b->nno = 0;
+    }
+    return 0;
+}
+
+}
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_kdtree_numa(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         numa_policy policy)
+{
+    const numa_topology& topo = numa_topology::get();
+    unsigned nreplicas = policy == numa_replicated ? topo.nnodes() : 1;
+
+    std::vector< replica_build<Float> > builds(nreplicas);
+    std::vector< huge_page_allocator* > allocs;
+    for (unsigned r=0; r < nreplicas; ++r) {
+        allocs.push_back(new huge_page_allocator(huge_page_allocator::page_2mb, true,
+                                                 policy == numa_interleaved));
+        replica_build<Float> b = { pnts, N, D, ntrees, nchecks, r, allocs.back(), 0 };
+        builds[r] = b;
+    }
+
+    if (policy == numa_replicated) {
+        // The replicas are built in parallel, one thread per node.
+        // A replica whose thread can't be started is built here instead,
+        // pinning this thread to its node for the while.
+        std::vector<pthread_t> ths(nreplicas);
+        std::vector<char> started(nreplicas, 0);
+        for (unsigned r=0; r < nreplicas; ++r) {
+            started[r] = pthread_create(&ths[r], 0, &replica_build_main<Float>, &builds[r]) == 0;
+        }
+        cpu_set_t saved;
+        bool restore = false;
+        for (unsigned r=0; r < nreplicas; ++r) {
+            if (started[r]) continue;
+            if (!restore) restore = pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0;
+            replica_build_main<Float>(&builds[r]);
+        }
+        if (restore) pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        for (unsigned r=0; r < nreplicas; ++r) {
+            if (started[r]) pthread_join(ths[r], 0);
+        }
+    }
+    else {
+        try {
+            builds[0].nno = nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks, true, allocs[0]);
+        }
+        catch (...) {
+            builds[0].nno = 0;
+        }
+    }
+
+    std::vector< nn_obj<Float>* > replicas;
+    bool failed = false;
+    for (unsigned r=0; r < nreplicas; ++r) {
+        if (builds[r].nno) replicas.push_back(builds[r].nno);
+        else failed = true;
+    }
+    if (failed) {
+        for (size_t r=0; r < replicas.size(); ++r) delete replicas[r];
+        for (size_t a=0; a < allocs.size(); ++a) delete allocs[a];
+        throw std::bad_alloc();
+    }
+
+    return new nn_obj_numa<Float>(replicas, allocs);
+}
+
+template
+nn_obj<unsigned char>*
+nn_obj_build_kdtree_numa(const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         numa_policy policy);
+template
+nn_obj<float>*
+nn_obj_build_kdtree_numa(const float* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         numa_policy policy);
+template
+nn_obj<double>*
+nn_obj_build_kdtree_numa(const double* pnts, unsigned N, unsigned D, unsigned ntrees, unsigned nchecks,
+                         numa_policy policy);
+
+bool
+numa_pin_thread_pool()
+{
+    return thread_pool::global().pin_workers();
+}
+
+}
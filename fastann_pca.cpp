@@ -0,0 +1,130 @@
+#include <math.h>
+
+#include <vector>
+
+#include "fastann.hpp"
+#include "pca.hpp"
+
+namespace fastann {
+
+namespace {
+
+static const unsigned query_block = 256; // Queries projected per forest search.
+
+/**
+ * Distances in the reduced space, as the caller's accumulator type.
+ */
+template<class Accum>
+inline Accum
+from_reduced(float dsq) { return Accum(dsq); }
+
+template<>
+inline unsigned
+from_reduced<unsigned>(float dsq) { return (unsigned)(dsq + 0.5f); }
+
+/**
+ * A kd-forest over points projected onto their leading principal
+ * components. Queries are projected a block at a time just before the
+ * forest is searched, so nothing D dimensional is ever copied.
+ */
+template<class Float>
+class nn_obj_pca : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        unsigned D = pca_.input_dims(), d = pca_.output_dims();
+        std::vector<float> proj((size_t)std::min(N, query_block)*d), tmp(D);
+        std::vector<float> dsqs((size_t)std::min(N, query_block)*K);
+
+        for (unsigned n0=0; n0 < N; n0 += query_block) {
+            unsigned nb = std::min(query_block, N - n0);
+            for (unsigned b=0; b < nb; ++b) {
+                pca_.project_one(qus + (size_t)(n0 + b)*D, &proj[(size_t)b*d], &tmp[0]);
+            }
+            if (stats) forest_->search_knn_stats(&proj[0], nb, K, argmins + (size_t)n0*K, &dsqs[0], stats + n0);
+            else forest_->search_knn(&proj[0], nb, K, argmins + (size_t)n0*K, &dsqs[0]);
+            for (size_t i=0; i < (size_t)nb*K; ++i) mins[(size_t)n0*K + i] = from_reduced<accum_float_type>(dsqs[i]);
+        }
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return forest_->stats_summary(); }
+    virtual void reset_stats() { forest_->reset_stats(); }
+
+    /**
+     * The projected points are counted as points, the model as aux.
+     */
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        memory_breakdown mem = forest_->memory_usage();
+        mem.points += proj_.capacity()*sizeof(float);
+        mem.aux += pca_.size_bytes();
+        return mem;
+    }
+
+    virtual unsigned ndims() const { return pca_.input_dims(); }
+    virtual unsigned npoints() const { return forest_->npoints(); }
+
+    nn_obj_pca(const Float* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees, unsigned nchecks,
+               unsigned nsample)
+     : forest_(0)
+    {
+        pca_.train(pnts, N, D, d, nsample);
+        proj_.resize((size_t)N*pca_.output_dims());
+        pca_.project(pnts, N, &proj_[0]);
+        forest_ = nn_obj_build_kdtree(&proj_[0], N, pca_.output_dims(), ntrees, nchecks);
+    }
+
+    virtual ~nn_obj_pca() { delete forest_; }
+
+    const pca<Float>& model() const { return pca_; }
+
+private:
+    pca<Float> pca_;
+    std::vector<float> proj_;
+    nn_obj<float>* forest_; // Borrows proj_.
+};
+
+}
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_build_pca_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees,
+                        unsigned nchecks, unsigned R, unsigned nsample)
+{
+    nn_obj<Float>* reduced = new nn_obj_pca<Float>(pnts, N, D, d, ntrees, nchecks, nsample);
+    if (R == 0) return reduced;
+    return nn_obj_build_rerank(reduced, pnts, N, D, R);
+}
+
+template
+nn_obj<unsigned char>*
+nn_obj_build_pca_kdtree(const unsigned char* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees,
+                        unsigned nchecks, unsigned R, unsigned nsample);
+template
+nn_obj<float>*
+nn_obj_build_pca_kdtree(const float* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees,
+                        unsigned nchecks, unsigned R, unsigned nsample);
+template
+nn_obj<double>*
+nn_obj_build_pca_kdtree(const double* pnts, unsigned N, unsigned D, unsigned d, unsigned ntrees,
+                        unsigned nchecks, unsigned R, unsigned nsample);
+
+}
@@ -0,0 +1,122 @@
+/**
+ * fastann-serve: loads a point set once and serves k-NN queries to
+ * other processes on the host over a Unix domain socket.
+ *
+ *   fastann-serve -s /tmp/fastann.sock (-p base.fvecs [-t ntrees] | -i index)
+ *                 [-o index] [-c nchecks] [-b max_batch] [-w max_wait_us]
+ *                 [-r max_results]
+ *
+ * With -p the kd-forest is built from an fvecs file at startup; with
+ * -i a file written by nn_obj_write_kdtree (or by -o on an earlier
+ * run) is mapped read-only and shared with every other process mapping
+ * it.
+ *
+ * Runs until SIGINT or SIGTERM. See serve.hpp for the wire format.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fastann.hpp"
+#include "serve.hpp"
+#include "vecs_io.hpp"
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: fastann-serve -s socket (-p points.fvecs [-t ntrees] | -i index)\n"
+                    "                     [-o index] [-c nchecks] [-b max_batch] [-w max_wait_us]\n"
+                    "                     [-r max_results]\n");
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    const char* socket_path = 0;
+    const char* points_path = 0;
+    const char* index_path = 0;
+    const char* out_path = 0;
+    unsigned ntrees = 8;
+    unsigned nchecks = 768;
+    unsigned max_batch = 256;
+    unsigned max_wait_us = 500;
+    size_t max_results = fastann::serve_default_max_results;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:i:o:t:c:b:w:r:")) != -1) {
+        switch (opt) {
+            case 's': socket_path = optarg; break;
+            case 'p': points_path = optarg; break;
+            case 'i': index_path = optarg; break;
+            case 'o': out_path = optarg; break;
+            case 't': ntrees = atoi(optarg); break;
+            case 'c': nchecks = atoi(optarg); break;
+            case 'b': max_batch = atoi(optarg); break;
+            case 'w': max_wait_us = atoi(optarg); break;
+            case 'r': max_results = strtoull(optarg, 0, 10); break;
+            default: usage();
+        }
+    }
+    if (!socket_path || !points_path == !index_path || !ntrees) usage();
+
+    // Block the signals in every thread; main collects them with sigwait.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, 0);
+
+    fastann::nn_obj<float>* nno = 0;
+    if (points_path) {
+        unsigned N, D;
+        float* pnts = fastann::read_vecs<float>(points_path, &N, &D);
+        if (!pnts) {
+            fprintf(stderr, "fastann-serve: can't read %s\n", points_path);
+            return 1;
+        }
+        if (out_path) {
+            if (!fastann::nn_obj_write_kdtree(out_path, pnts, N, D, ntrees)) {
+                fprintf(stderr, "fastann-serve: can't write %s\n", out_path);
+                delete[] pnts;
+                return 1;
+            }
+            index_path = out_path;
+        }
+        else {
+            nno = fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks, true);
+        }
+        delete[] pnts;
+    }
+    if (index_path) {
+        nno = fastann::nn_obj_map_kdtree<float>(index_path, nchecks);
+        if (!nno) {
+            fprintf(stderr, "fastann-serve: can't map %s\n", index_path);
+            return 1;
+        }
+    }
+
+    fastann::query_server server(nno, socket_path, max_batch, max_wait_us, max_results);
+    try {
+        server.start();
+    }
+    catch (...) {
+        fprintf(stderr, "fastann-serve: can't listen on %s\n", socket_path);
+        delete nno;
+        return 1;
+    }
+    fprintf(stderr, "fastann-serve: %u points of dimension %u on %s\n",
+            nno->npoints(), nno->ndims(), socket_path);
+
+    int sig;
+    sigwait(&sigs, &sig);
+
+    server.stop();
+    fprintf(stderr, "fastann-serve: served %llu queries in %llu batches\n",
+            server.nqueries(), server.nbatches());
+
+    delete nno;
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "fastann.hpp"
+#include "groundtruth.hpp"
+
+namespace fastann {
+
+namespace {
+
+static const size_t direct_align = 4096; // O_DIRECT offsets, lengths and buffers.
+
+/**
+ * Exact search over points that stay on disk. Every search reads the
+ * file from start to end once, a block at a time: while the pool
+ * compares every query of the batch with one block, a reader thread
+ * fills the other buffer with the next. The comparison is
+ * groundtruth_knn's, the single query kernel run over cache sized
+ * tiles of the block. Large query batches are what make it disk bound.
+ */
+template<class Float>
+class nn_obj_exact_stream : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    /**
+     * Throws 0 if the file can't be read.
+     */
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        groundtruth_knn<Float> gt(qus, N, D_, K);
+        buffer bufs[2];
+        read_job jobs[2];
+        size_t nblocks = (npoints_ + rows_per_block_ - 1)/rows_per_block_;
+
+        if (nblocks) {
+            jobs[0] = make_job(bufs[0], 0);
+            read_main(&jobs[0]);
+        }
+        for (size_t b=0; b < nblocks; ++b) {
+            read_job& cur = jobs[b % 2];
+            read_job& next = jobs[(b + 1) % 2];
+            bool reading = false;
+            if (cur.ok && b + 1 < nblocks) {
+                next = make_job(bufs[(b + 1) % 2], b + 1);
+                reading = pthread_create(&next.thread, 0, &read_main, &next) == 0;
+                if (!reading) read_main(&next);
+            }
+
+            if (cur.ok) {
+                const Float* rows = compact(cur);
+                gt.add_block(rows, (unsigned)cur.nrows, (unsigned)cur.first_row);
+                if (!direct_) {
+                    // Keep a scan of a huge file from evicting everything else.
+                    posix_fadvise(fd_, offset_ + cur.first_row*stride_, cur.nrows*stride_, POSIX_FADV_DONTNEED);
+                }
+            }
+            if (reading) pthread_join(next.thread, 0);
+            if (!cur.ok) throw 0;
+        }
+
+        gt.results(argmins, mins);
+        batch_stats_scope batch(&stats_);
+        for (unsigned n=0; n < N; ++n) {
+            query_stats_scope st(stats ? &stats[n] : 0, batch.get());
+            FASTANN_STAT_ADD(st.get(), ndists, npoints_);
+        }
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    /**
+     * Only the two block buffers, and only while a search runs.
+     */
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        memory_breakdown mem;
+        mem.aux = 2*buffer_bytes();
+        return mem;
+    }
+
+    virtual unsigned ndims() const { return D_; }
+    virtual unsigned npoints() const { return (unsigned)npoints_; }
+
+    nn_obj_exact_stream(int fd, bool direct, unsigned D, size_t header_bytes, size_t offset,
+                        size_t npoints, size_t block_bytes)
+     : fd_(fd), direct_(direct), D_(D), header_(header_bytes), offset_(offset),
+       stride_(header_bytes + D*sizeof(Float)), npoints_(npoints)
+    {
+        rows_per_block_ = block_bytes/stride_ ? block_bytes/stride_ : 1;
+        if (!direct_) posix_fadvise(fd_, offset_, npoints_*stride_, POSIX_FADV_SEQUENTIAL);
+    }
+
+    virtual ~nn_obj_exact_stream() { ::close(fd_); }
+
+private:
+    struct
+    buffer
+    {
+        void* mem;
+        size_t size;
+        buffer() : mem(0), size(0) { }
+        ~buffer() { if (mem) default_allocator().deallocate(mem, size); }
+    };
+
+    struct
+    read_job
+    {
+        const nn_obj_exact_stream* self;
+        buffer* buf;
+        size_t first_row;
+        size_t nrows;
+        char* rows; // First row, within buf.
+        bool ok;
+        pthread_t thread;
+    };
+
+    size_t
+    buffer_bytes() const
+    {
+        size_t sz = rows_per_block_*stride_;
+        return direct_ ? (sz + 3*direct_align - 1) & ~(direct_align - 1) : sz;
+    }
+
+    read_job
+    make_job(buffer& buf, size_t block) const
+    {
+        if (!buf.mem) {
+            buf.size = buffer_bytes();
+            buf.mem = default_allocator().allocate(buf.size, direct_align);
+        }
+        read_job job;
+        job.self = this;
+        job.buf = &buf;
+        job.first_row = block*rows_per_block_;
+        job.nrows = std::min(rows_per_block_, npoints_ - job.first_row);
+        job.rows = 0;
+        job.ok = true;
+        return job;
+    }
+
+    /**
+     * Reads a job's rows. With O_DIRECT the read is widened to aligned
+     * boundaries and the rows start part way into the buffer.
+     */
+    static void*
+    read_main(void* arg)
+    {
+        read_job* job = (read_job*)arg;
+        const nn_obj_exact_stream* self = job->self;
+        size_t begin = self->offset_ + job->first_row*self->stride_;
+        size_t end = begin + job->nrows*self->stride_;
+        size_t from = self->direct_ ? begin & ~(direct_align - 1) : begin;
+        size_t to = self->direct_ ? (end + direct_align - 1) & ~(direct_align - 1) : end;
+
+        char* dst = (char*)job->buf->mem;
+        size_t done = 0;
+        while (from + done < to) {
+            ssize_t r = pread(self->fd_, dst + done, to - from - done, from + done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break; // Error, or the end of the file within the last aligned page.
+            done += r;
+        }
+        job->ok = from + done >= end;
+        job->rows = dst + (begin - from);
+        return 0;
+    }
+
+    /**
+     * The job's rows as contiguous points: row headers (as in .fvecs)
+     * are squeezed out in place.
+     */
+    const Float*
+    compact(read_job& job) const
+    {
+        if (header_ == 0) return (const Float*)job.rows;
+        size_t row_bytes = D_*sizeof(Float);
+        for (size_t n=0; n < job.nrows; ++n) {
+            memmove(job.rows + n*row_bytes, job.rows + n*stride_ + header_, row_bytes);
+        }
+        return (const Float*)job.rows;
+    }
+
+    int fd_;
+    bool direct_;
+    unsigned D_;
+    size_t header_;
+    size_t offset_;
+    size_t stride_;
+    size_t npoints_;
+    size_t rows_per_block_;
+    mutable search_stats_summary stats_;
+};
+
+}
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_open_exact_stream(const char* path, unsigned D, size_t header_bytes, size_t offset,
+                         bool direct_io, size_t block_bytes)
+{
+    bool direct = false;
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct_io) {
+        fd = ::open(path, O_RDONLY | O_DIRECT);
+        direct = fd >= 0;
+    }
+#endif
+    if (fd < 0) fd = ::open(path, O_RDONLY); // Also where O_DIRECT isn't supported (tmpfs).
+    if (fd < 0) return 0;
+
+    struct stat st;
+    size_t stride = header_bytes + D*sizeof(Float);
+    if (D == 0 || fstat(fd, &st) || (size_t)st.st_size < offset ||
+        ((size_t)st.st_size - offset) % stride || ((size_t)st.st_size - offset)/stride > ~0u) {
+        ::close(fd);
+        return 0;
+    }
+
+    // A .vecs style header holds the dimension; check the first.
+    if (header_bytes == sizeof(uint32_t) && (size_t)st.st_size > offset) {
+        uint32_t dim = 0;
+        int fd_check = ::open(path, O_RDONLY);
+        bool ok = fd_check >= 0 && pread(fd_check, &dim, sizeof(dim), offset) == sizeof(dim) && dim == D;
+        if (fd_check >= 0) ::close(fd_check);
+        if (!ok) {
+            ::close(fd);
+            return 0;
+        }
+    }
+
+    return new nn_obj_exact_stream<Float>(fd, direct, D, header_bytes, offset,
+                                          ((size_t)st.st_size - offset)/stride, block_bytes);
+}
+
+template
+nn_obj<unsigned char>*
+nn_obj_open_exact_stream(const char* path, unsigned D, size_t header_bytes, size_t offset,
+                         bool direct_io, size_t block_bytes);
+template
+nn_obj<float>*
+nn_obj_open_exact_stream(const char* path, unsigned D, size_t header_bytes, size_t offset,
+                         bool direct_io, size_t block_bytes);
+template
+nn_obj<double>*
+nn_obj_open_exact_stream(const char* path, unsigned D, size_t header_bytes, size_t offset,
+                         bool direct_io, size_t block_bytes);
+
+}
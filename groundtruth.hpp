@@ -0,0 +1,151 @@
+/**
+ * Exact k-NN ground truth for large base sets, which are fed in blocks
+ * (e.g. streamed from disk) while per-query top-K heaps are kept in
+ * memory. Work is spread over the thread pool by query, so no locks
+ * are needed.
+ */
+#ifndef __FASTANN_GROUNDTRUTH_HPP
+#define __FASTANN_GROUNDTRUTH_HPP
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "dist_l2.hpp"
+#include "thread_pool.hpp"
+
+namespace fastann {
+
+template<class Float>
+class
+groundtruth_knn
+{
+public:
+    typedef typename dist_l2_wrapper<Float>::AccumFloat AccumFloat;
+    typedef std::pair<AccumFloat, unsigned> entry_type; // (distance, base index)
+
+    static const unsigned queries_per_tile = 16;
+    static const unsigned points_per_tile = 1024;
+
+private:
+    const Float* qus_;
+    unsigned NQ_;
+    unsigned D_;
+    unsigned K_;
+    dist_l2_wrapper<Float> dist_;
+
+    // Query n's heap is heaps_[n*K_ .. n*K_ + sizes_[n]), a max heap
+    // on (distance, index) so ties resolve to the lowest index.
+    std::vector<entry_type> heaps_;
+    std::vector<unsigned> sizes_;
+
+    struct block_ctx
+    {
+        groundtruth_knn* self;
+        const Float* pnts;
+        unsigned N;
+        unsigned first_index;
+    };
+
+    void
+    push(unsigned q, AccumFloat dsq, unsigned index)
+    {
+        entry_type* heap = &heaps_[(size_t)q*K_];
+        unsigned& sz = sizes_[q];
+        entry_type e(dsq, index);
+        if (sz < K_) {
+            heap[sz++] = e;
+            std::push_heap(heap, heap + sz);
+        }
+        else if (e < heap[0]) {
+            std::pop_heap(heap, heap + sz);
+            heap[sz - 1] = e;
+            std::push_heap(heap, heap + sz);
+        }
+    }
+
+    /**
+     * Queries [begin, end) against a whole block: a tile of queries is
+     * run over a cache sized tile of points at a time, so each point
+     * tile is loaded from memory once per queries_per_tile queries.
+     * The distances are still the single query kernel's, one call per
+     * query and point tile, which keeps them bit for bit those of the
+     * exact index; the tiling only improves cache reuse.
+     */
+    static void
+    block_range(void* arg, size_t begin, size_t end)
+    {
+        block_ctx* ctx = (block_ctx*)arg;
+        groundtruth_knn* self = ctx->self;
+        unsigned D = self->D_;
+        std::vector<AccumFloat> dsqs(points_per_tile);
+
+        for (unsigned p0=0; p0 < ctx->N; p0 += points_per_tile) {
+            unsigned np = std::min(points_per_tile, ctx->N - p0);
+            const Float* tile = ctx->pnts + (size_t)p0*D;
+            for (size_t q=begin; q < end; ++q) {
+                self->dist_.func(self->qus_ + q*D, tile, np, D, &dsqs[0]);
+
+                const entry_type* heap = &self->heaps_[q*self->K_];
+                bool full = self->sizes_[q] == self->K_;
+                for (unsigned p=0; p < np; ++p) {
+                    if (full && dsqs[p] > heap[0].first) continue; // The common case.
+                    self->push((unsigned)q, dsqs[p], ctx->first_index + p0 + p);
+                    full = self->sizes_[q] == self->K_;
+                }
+            }
+        }
+    }
+
+    groundtruth_knn(const groundtruth_knn&);
+    groundtruth_knn& operator=(const groundtruth_knn&);
+
+public:
+    /**
+     * \c qus (\c NQ x \c D) must stay valid until the last add_block.
+     */
+    groundtruth_knn(const Float* qus, unsigned NQ, unsigned D, unsigned K)
+     : qus_(qus), NQ_(NQ), D_(D), K_(K), dist_(dist_l2_best<Float>(D)),
+       heaps_((size_t)NQ*K), sizes_(NQ, 0)
+    { }
+
+    /**
+     * Adds \c N contiguous base points whose first has index
+     * \c first_index, and returns once every query has seen them.
+     */
+    void
+    add_block(const Float* pnts, unsigned N, unsigned first_index,
+              thread_pool& pool = thread_pool::global())
+    {
+        block_ctx ctx = { this, pnts, N, first_index };
+        parallel_for(pool, NQ_, queries_per_tile, &block_range, &ctx);
+    }
+
+    /**
+     * Writes the K nearest seen so far for every query, nearest first.
+     * Queries that have seen fewer than K points are padded with
+     * index ~0u.
+     */
+    void
+    results(unsigned* argmins, AccumFloat* mins) const
+    {
+        std::vector<entry_type> sorted(K_);
+        for (size_t q=0; q < NQ_; ++q) {
+            unsigned sz = sizes_[q];
+            std::copy(&heaps_[q*K_], &heaps_[q*K_] + sz, sorted.begin());
+            std::sort(sorted.begin(), sorted.begin() + sz);
+            for (unsigned k=0; k < K_; ++k) {
+                argmins[q*K_ + k] = k < sz ? sorted[k].second : ~0u;
+                mins[q*K_ + k] = k < sz ? sorted[k].first : AccumFloat(0);
+            }
+        }
+    }
+
+    unsigned nqueries() const { return NQ_; }
+    unsigned ndims() const { return D_; }
+    unsigned K() const { return K_; }
+};
+
+}
+
+#endif
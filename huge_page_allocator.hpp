@@ -0,0 +1,198 @@
+/**
+ * An allocator that backs index storage with 2 MB (or 1 GB) pages, to
+ * cut the dTLB misses of random accesses into large point arrays and
+ * node arenas. It tries explicit hugetlbfs pages first, then an
+ * aligned anonymous mapping advised with MADV_HUGEPAGE for transparent
+ * huge pages, which the kernel may still back with small pages.
+ * Optionally every mapping is interleaved over the NUMA nodes.
+ */
+#ifndef __FASTANN_HUGE_PAGE_ALLOCATOR_HPP
+#define __FASTANN_HUGE_PAGE_ALLOCATOR_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <map>
+#include <new>
+
+#include "allocator.hpp"
+#include "numa.hpp"
+
+namespace fastann {
+
+/**
+ * Allocations of at least a quarter of a page get mappings of their
+ * own. Smaller ones (kd-tree nodes) are carved from page sized chunks,
+ * and a chunk is unmapped when everything in it has been freed.
+ */
+class
+huge_page_allocator : public allocator
+{
+public:
+    static const size_t page_2mb = (size_t)1 << 21;
+    static const size_t page_1gb = (size_t)1 << 30;
+
+private:
+    struct chunk
+    {
+        size_t len;  // Mapped bytes.
+        size_t used; // Bump pointer, 0 for a mapping of its own.
+        size_t live; // Blocks not yet freed.
+    };
+
+    size_t page_size_;
+    bool use_hugetlb_;
+    bool interleave_;
+    std::map<char*, chunk> chunks_; // By start address.
+    char* current_;                 // Chunk small blocks come from, or 0.
+    size_t hugetlb_bytes_;
+    size_t thp_bytes_;
+    pthread_mutex_t mutex_;
+
+    huge_page_allocator(const huge_page_allocator&);
+    huge_page_allocator& operator=(const huge_page_allocator&);
+
+    size_t small_max() const { return page_size_/4; }
+
+    size_t round_up(size_t sz) const { return (sz + page_size_ - 1) & ~(page_size_ - 1); }
+
+    /**
+     * Maps \c len bytes (a multiple of the page size), preferring
+     * hugetlbfs pages.
+     */
+    char*
+    map_pages(size_t len)
+    {
+        int prot = PROT_READ | PROT_WRITE;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+        if (use_hugetlb_) {
+            int huge = MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+            huge |= (page_size_ == page_1gb ? 30 : 21) << MAP_HUGE_SHIFT;
+#endif
+            void* p = mmap(0, len, prot, flags | huge, -1, 0);
+            if (p != MAP_FAILED) {
+                if (interleave_) numa_interleave(p, len);
+                hugetlb_bytes_ += len;
+                return (char*)p;
+            }
+        }
+#endif
+        // Transparent huge pages are at most 2 MB and need the mapping
+        // aligned, so over-map and trim.
+        size_t align = page_2mb;
+        void* p = mmap(0, len + align, prot, flags, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        char* base = (char*)p;
+        char* aligned = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+        if (aligned > base) munmap(base, aligned - base);
+        munmap(aligned + len, base + len + align - (aligned + len));
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+        if (interleave_) numa_interleave(aligned, len);
+        thp_bytes_ += len;
+        return aligned;
+    }
+
+    void
+    unmap_chunk(std::map<char*, chunk>::iterator it)
+    {
+        munmap(it->first, it->second.len);
+        if (it->first == current_) current_ = 0;
+        chunks_.erase(it);
+    }
+
+    struct
+    lock
+    {
+        pthread_mutex_t* m;
+        explicit lock(pthread_mutex_t* mm) : m(mm) { pthread_mutex_lock(m); }
+        ~lock() { pthread_mutex_unlock(m); }
+    };
+
+public:
+    /**
+     * \c page_size is page_2mb or page_1gb; 1 GB pages are only
+     * available through hugetlbfs, so without them it falls back to
+     * 2 MB transparent huge pages. With \c use_hugetlb unset only
+     * transparent huge pages are used. With \c interleave set the
+     * pages of every mapping are spread over the NUMA nodes.
+     */
+    explicit huge_page_allocator(size_t page_size = page_2mb, bool use_hugetlb = true,
+                                 bool interleave = false)
+     : page_size_(page_size == page_1gb ? page_1gb : page_2mb), use_hugetlb_(use_hugetlb),
+       interleave_(interleave), current_(0), hugetlb_bytes_(0), thp_bytes_(0)
+    {
+        pthread_mutex_init(&mutex_, 0);
+    }
+
+    /**
+     * Unmaps everything, so every index allocated from this allocator
+     * must have been deleted first.
+     */
+    ~huge_page_allocator()
+    {
+        while (!chunks_.empty()) unmap_chunk(chunks_.begin());
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    virtual void*
+    allocate(size_t sz, size_t align)
+    {
+        lock l(&mutex_);
+        if (sz == 0) sz = 1;
+        if (align < sizeof(void*)) align = sizeof(void*);
+
+        if (sz >= small_max() || align > small_max()) {
+            size_t len = round_up(sz);
+            char* p = map_pages(len);
+            chunk c = { len, 0, 1 };
+            chunks_[p] = c;
+            return p;
+        }
+
+        if (current_) {
+            chunk& c = chunks_[current_];
+            size_t off = (c.used + align - 1) & ~(align - 1);
+            if (off + sz <= c.len) {
+                c.used = off + sz;
+                c.live++;
+                return current_ + off;
+            }
+            // The old chunk is released once its blocks are freed.
+            if (c.live == 0) unmap_chunk(chunks_.find(current_));
+        }
+
+        current_ = map_pages(page_size_);
+        chunk c = { page_size_, sz, 1 };
+        chunks_[current_] = c;
+        return current_;
+    }
+
+    virtual void
+    deallocate(void* p, size_t)
+    {
+        if (!p) return;
+        lock l(&mutex_);
+
+        std::map<char*, chunk>::iterator it = chunks_.upper_bound((char*)p);
+        if (it == chunks_.begin()) return; // Not ours.
+        --it;
+        if (--it->second.live == 0 && it->first != current_) unmap_chunk(it);
+    }
+
+    /**
+     * Bytes mapped with hugetlbfs pages, and with transparent huge
+     * pages requested, since construction.
+     */
+    size_t hugetlb_bytes() const { return hugetlb_bytes_; }
+    size_t thp_bytes() const { return thp_bytes_; }
+    size_t page_size() const { return page_size_; }
+};
+
+}
+
+#endif
@@ -0,0 +1,351 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "fastann.hpp"
+#include "dist_l2.hpp"
+#include "nn_kdtree.hpp"
+
+namespace fastann {
+
+namespace {
+
+/**
+ * File layout: this header, then each section starting on a
+ * section_align boundary at the offset recorded here:
+ *   points:     npoints*ndims Float, in the leaf order of tree 0
+ *   point order: npoints uint32, the caller's index of each point
+ *   roots:      ntrees uint32
+ *   nodes:      nnodes flat_node<DiscFloat>
+ *   leaf inds:  nleaf_inds uint32
+ * Nothing in the file is a pointer, so it maps at any address.
+ */
+struct kdtree_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t npoints;
+    uint32_t ndims;
+    uint32_t ntrees;
+    uint32_t node_size;
+    uint64_t points_offset;
+    uint64_t order_offset;
+    uint64_t roots_offset;
+    uint64_t nodes_offset;
+    uint64_t nnodes;
+    uint64_t leaf_inds_offset;
+    uint64_t nleaf_inds;
+};
+
+static const char kdtree_file_magic[8] = { 'F', 'A', 'N', 'N', 'K', 'D', 'T', '\0' };
+static const uint32_t kdtree_file_version = 1;
+static const uint64_t section_align = 64;
+
+template<class Float> struct file_dtype { };
+template<> struct file_dtype<unsigned char> { static const uint32_t value = 1; };
+template<> struct file_dtype<float> { static const uint32_t value = 2; };
+template<> struct file_dtype<double> { static const uint32_t value = 3; };
+
+uint64_t
+align_up(uint64_t off)
+{
+    return (off + section_align - 1) & ~(section_align - 1);
+}
+
+/**
+ * Whether \c count elements of \c elem bytes at \c offset lie within
+ * \c size bytes, without overflowing on a corrupt header.
+ */
+bool
+section_fits(uint64_t offset, uint64_t count, uint64_t elem, uint64_t size)
+{
+    return offset <= size && count <= (size - offset)/elem;
+}
+
+/**
+ * Whether every root, child, leaf range and point index is in bounds.
+ * Children always follow their parent (see kdtree_node::flatten), so
+ * descents end. Search does no checks of its own.
+ */
+template<class node_type>
+bool
+check_structure(const node_type* nodes, uint64_t nnodes, const uint32_t* leaf_inds, uint64_t nleaf_inds,
+                const uint32_t* roots, unsigned ntrees, unsigned npoints, unsigned ndims)
+{
+    for (unsigned t=0; t < ntrees; ++t) {
+        if (roots[t] >= nnodes) return false;
+    }
+    for (uint64_t i=0; i < nnodes; ++i) {
+        const node_type& node = nodes[i];
+        if (node.left == nn_kdtree_internal::flat_leaf) {
+            if (node.right > nleaf_inds || node.disc_dim > nleaf_inds - node.right) return false;
+        }
+        else if (node.left <= i || node.left >= nnodes || node.right <= i || node.right >= nnodes ||
+                 node.disc_dim >= ndims) {
+            return false;
+        }
+    }
+    for (uint64_t i=0; i < nleaf_inds; ++i) {
+        if (leaf_inds[i] >= npoints) return false;
+    }
+    return true;
+}
+
+bool
+write_section(FILE* fp, uint64_t offset, const void* data, size_t sz)
+{
+    if (fseeko(fp, (off_t)offset, SEEK_SET)) return false;
+    return sz == 0 || fwrite(data, 1, sz, fp) == sz;
+}
+
+template<class Float>
+class nn_obj_kdtree_mapped : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        knn_visitor<float_type, accum_float_type> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_, v);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        knn_visitor<float, float> v = { this, qus, N, K, argmins, mins, stats };
+        dispatch_dist_l2(dist_l2_mixed_best(ndims_), v);
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return &stats_; }
+    virtual void reset_stats() { stats_.clear(); }
+
+    /**
+     * The mapping, which is shared with every other process mapping
+     * the same file.
+     */
+    virtual memory_breakdown memory_usage() const { return mem_; }
+
+    virtual unsigned ndims() const { return ndims_; }
+    virtual unsigned npoints() const { return npoints_; }
+
+    nn_obj_kdtree_mapped(void* base, size_t size, const nn_kdtree_flat<Float>& kdt,
+                         const memory_breakdown& mem, unsigned N, unsigned D, unsigned nchecks)
+     : base_(base), size_(size), kdt_(kdt), mem_(mem), npoints_(N), ndims_(D), nchecks_(nchecks),
+       dist_(dist_l2_best<Float>(D))
+    { }
+
+    virtual ~nn_obj_kdtree_mapped() { munmap(base_, size_); }
+
+private:
+    /**
+     * search_knn_with for the distance dispatch_dist_l2 picks.
+     */
+    template<class Query, class DistT>
+    struct
+    knn_visitor
+    {
+        const nn_obj_kdtree_mapped* self;
+        const Query* qus;
+        unsigned N;
+        unsigned K;
+        unsigned* argmins;
+        DistT* mins;
+        search_stats* stats;
+
+        template<class Dist>
+        void operator()(Dist dist) const { self->search_knn_with(qus, dist, N, K, argmins, mins, stats); }
+    };
+
+    template<class Query, class Dist, class DistT>
+    void
+    search_knn_with(const Query* qus, Dist dist, unsigned N, unsigned K,
+                    unsigned* argmins, DistT* mins, search_stats* stats) const
+    {
+        std::vector< std::pair<unsigned, DistT> > nns(K);
+        batch_stats_scope batch(&stats_);
+        for (unsigned n=0; n < N; ++n) {
+            query_stats_scope st(stats ? &stats[n] : 0, batch.get());
+            kdt_.search(qus + (size_t)n*ndims_, dist, K, &nns[0], nchecks_, st.get());
+            for (unsigned k=0; k < K; ++k) {
+                argmins[(size_t)n*K + k] = nns[k].first;
+                mins[(size_t)n*K + k] = nns[k].second;
+            }
+        }
+    }
+
+    void* base_;
+    size_t size_;
+    nn_kdtree_flat<Float> kdt_;
+    memory_breakdown mem_;
+    unsigned npoints_;
+    unsigned ndims_;
+    unsigned nchecks_;
+    dist_l2_wrapper<Float> dist_;
+    mutable search_stats_summary stats_;
+};
+
+}
+
+template<class Float>
+bool
+nn_obj_write_kdtree(const char* path, const Float* pnts, unsigned N, unsigned D, unsigned ntrees)
+{
+    typedef typename nn_kdtree_internal::kdtree_types<Float>::DiscFloat DiscFloat;
+    typedef nn_kdtree_internal::flat_node<DiscFloat> node_type;
+
+    if (ntrees == 0) return false; // Nor would it map.
+    nn_kdtree<Float> kdt(pnts, N, D, ntrees, 42, true);
+
+    std::vector<node_type> nodes;
+    std::vector<uint32_t> leaf_inds;
+    std::vector<uint32_t> roots;
+    kdt.flatten(nodes, leaf_inds, roots);
+    std::vector<uint32_t> order(kdt.point_order(), kdt.point_order() + N);
+
+    kdtree_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kdtree_file_magic, sizeof(hdr.magic));
+    hdr.version = kdtree_file_version;
+    hdr.dtype = file_dtype<Float>::value;
+    hdr.npoints = N;
+    hdr.ndims = D;
+    hdr.ntrees = (uint32_t)roots.size();
+    hdr.node_size = sizeof(node_type);
+    hdr.points_offset = align_up(sizeof(hdr));
+    hdr.order_offset = align_up(hdr.points_offset + (uint64_t)N*D*sizeof(Float));
+    hdr.roots_offset = align_up(hdr.order_offset + order.size()*sizeof(uint32_t));
+    hdr.nodes_offset = align_up(hdr.roots_offset + roots.size()*sizeof(uint32_t));
+    hdr.nnodes = nodes.size();
+    hdr.leaf_inds_offset = align_up(hdr.nodes_offset + nodes.size()*sizeof(node_type));
+    hdr.nleaf_inds = leaf_inds.size();
+
+    // A unique name beside path, so concurrent writers don't share it.
+    std::string tmp_path = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0) return false;
+    FILE* fp = fchmod(fd, 0644) == 0 ? fdopen(fd, "wb") : 0;
+    if (!fp) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    bool ok = write_section(fp, 0, &hdr, sizeof(hdr)) &&
+              write_section(fp, hdr.points_offset, kdt.points(), (size_t)N*D*sizeof(Float)) &&
+              write_section(fp, hdr.order_offset, order.empty() ? 0 : &order[0], order.size()*sizeof(uint32_t)) &&
+              write_section(fp, hdr.roots_offset, roots.empty() ? 0 : &roots[0], roots.size()*sizeof(uint32_t)) &&
+              write_section(fp, hdr.nodes_offset, nodes.empty() ? 0 : &nodes[0], nodes.size()*sizeof(node_type)) &&
+              write_section(fp, hdr.leaf_inds_offset, leaf_inds.empty() ? 0 : &leaf_inds[0], leaf_inds.size()*sizeof(uint32_t));
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path)) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+template<class Float>
+nn_obj<Float>*
+nn_obj_map_kdtree(const char* path, unsigned nchecks)
+{
+    typedef typename nn_kdtree_internal::kdtree_types<Float>::DiscFloat DiscFloat;
+    typedef nn_kdtree_internal::flat_node<DiscFloat> node_type;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(kdtree_file_header)) { close(fd); return 0; }
+    size_t size = st.st_size;
+
+    void* base = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+
+    // The tree structure is checked once here, so that a truncated or
+    // corrupt file can't make searches read out of bounds. The points,
+    // usually most of the file, are not touched.
+    const kdtree_file_header& hdr = *(const kdtree_file_header*)base;
+    const char* cbase = (const char*)base;
+    bool ok = memcmp(hdr.magic, kdtree_file_magic, sizeof(hdr.magic)) == 0 &&
+              hdr.version == kdtree_file_version &&
+              hdr.dtype == file_dtype<Float>::value &&
+              hdr.node_size == sizeof(node_type) &&
+              hdr.ntrees > 0 && hdr.ndims > 0 &&
+              section_fits(hdr.points_offset, (uint64_t)hdr.npoints*hdr.ndims, sizeof(Float), size) &&
+              section_fits(hdr.order_offset, hdr.npoints, sizeof(uint32_t), size) &&
+              section_fits(hdr.roots_offset, hdr.ntrees, sizeof(uint32_t), size) &&
+              section_fits(hdr.nodes_offset, hdr.nnodes, sizeof(node_type), size) &&
+              section_fits(hdr.leaf_inds_offset, hdr.nleaf_inds, sizeof(uint32_t), size);
+    ok = ok && check_structure((const node_type*)(cbase + hdr.nodes_offset), hdr.nnodes,
+                               (const uint32_t*)(cbase + hdr.leaf_inds_offset), hdr.nleaf_inds,
+                               (const uint32_t*)(cbase + hdr.roots_offset), hdr.ntrees,
+                               hdr.npoints, hdr.ndims);
+    if (!ok) {
+        munmap(base, size);
+        return 0;
+    }
+
+    nn_kdtree_flat<Float> kdt((const node_type*)(cbase + hdr.nodes_offset),
+                              (const uint32_t*)(cbase + hdr.leaf_inds_offset),
+                              (const uint32_t*)(cbase + hdr.roots_offset), hdr.ntrees,
+                              (const Float*)(cbase + hdr.points_offset),
+                              (const uint32_t*)(cbase + hdr.order_offset),
+                              hdr.npoints, hdr.ndims);
+
+    memory_breakdown mem;
+    mem.nodes = hdr.nnodes*sizeof(node_type);
+    mem.leaf_indices = hdr.nleaf_inds*sizeof(uint32_t);
+    mem.points = (size_t)hdr.npoints*hdr.ndims*sizeof(Float);
+    mem.aux = size - mem.nodes - mem.leaf_indices - mem.points; // Header, order, roots, padding.
+
+    return new nn_obj_kdtree_mapped<Float>(base, size, kdt, mem, hdr.npoints, hdr.ndims, nchecks);
+}
+
+template
+bool
+nn_obj_write_kdtree(const char* path, const unsigned char* pnts, unsigned N, unsigned D, unsigned ntrees);
+template
+bool
+nn_obj_write_kdtree(const char* path, const float* pnts, unsigned N, unsigned D, unsigned ntrees);
+template
+bool
+nn_obj_write_kdtree(const char* path, const double* pnts, unsigned N, unsigned D, unsigned ntrees);
+
+template
+nn_obj<unsigned char>*
+nn_obj_map_kdtree(const char* path, unsigned nchecks);
+template
+nn_obj<float>*
+nn_obj_map_kdtree(const char* path, unsigned nchecks);
+template
+nn_obj<double>*
+nn_obj_map_kdtree(const char* path, unsigned nchecks);
+
+}
@@ -0,0 +1,245 @@
+/**
+ * A handle on an nn_obj that can be replaced while it is being
+ * searched. Readers announce themselves in an epoch slot instead of
+ * taking a lock, a new index is published with one atomic exchange
+ * (optionally after being built on a background thread), and an old
+ * index is deleted once no reader that could have seen it remains.
+ */
+#ifndef __FASTANN_MANAGED_INDEX_HPP
+#define __FASTANN_MANAGED_INDEX_HPP
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "epoch.hpp"
+#include "fastann.hpp"
+
+namespace fastann {
+
+template<class Float>
+class
+managed_index : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    /**
+     * Builds the replacement index on the background thread; may
+     * return 0 or throw to abandon the rebuild.
+     */
+    typedef nn_obj<Float>* (*builder_func)(void* arg);
+
+private:
+    nn_obj<Float>* current_;
+    epoch_domain epoch_;
+
+    pthread_t rebuild_thread_;
+    bool rebuilding_;
+    builder_func build_;
+    void* build_arg_;
+    int build_status_;
+
+    managed_index(const managed_index&);
+    managed_index& operator=(const managed_index&);
+
+    static void
+    delete_index(void* p, void*, size_t)
+    {
+        delete (nn_obj<Float>*)p;
+    }
+
+    static void*
+    rebuild_main(void* arg)
+    {
+        managed_index* mi = (managed_index*)arg;
+        nn_obj<Float>* nno = 0;
+        try {
+            nno = mi->build_(mi->build_arg_);
+        }
+        catch (...) {
+            nno = 0;
+        }
+        mi->build_status_ = nno ? 0 : -1;
+        if (nno) mi->publish(nno);
+
+        // Free the old index as soon as its last reader leaves.
+        while (!mi->reclaim()) usleep(1000);
+        return 0;
+    }
+
+public:
+    /**
+     * Takes ownership of \c initial, which may be 0 until the first
+     * publish (searching an empty handle throws).
+     */
+    explicit managed_index(nn_obj<Float>* initial = 0)
+     : current_(initial), rebuilding_(false), build_(0), build_arg_(0), build_status_(0)
+    { }
+
+    /**
+     * Waits for a running rebuild and for every reader to leave.
+     */
+    virtual ~managed_index()
+    {
+        wait_rebuild();
+        while (!reclaim()) usleep(1000);
+        delete current_;
+    }
+
+    /**
+     * Keeps the current index alive for as long as it exists. Entering
+     * and leaving are a few atomic operations and never wait on a
+     * publisher.
+     */
+    class
+    reader
+    {
+        epoch_domain::guard guard_;
+        const nn_obj<Float>* nno_;
+
+        reader(const reader&);
+        reader& operator=(const reader&);
+
+    public:
+        explicit reader(const managed_index& mi)
+         : guard_(mi.epoch_), nno_(*(nn_obj<Float>* volatile*)&mi.current_)
+        { }
+
+        const nn_obj<Float>* get() const { return nno_; }
+        const nn_obj<Float>* operator->() const { return nno_; }
+    };
+
+    /**
+     * Makes \c nno (owned from now on) the index new readers see.
+     * Readers already inside the old index finish with it undisturbed;
+     * it is deleted by a later reclaim().
+     */
+    void
+    publish(nn_obj<Float>* nno)
+    {
+        __sync_synchronize();
+        nn_obj<Float>* old = __sync_lock_test_and_set(&current_, nno);
+        if (old) epoch_.retire(old, &delete_index, 0);
+        reclaim();
+    }
+
+    /**
+     * Deletes every retired index that no reader can still be using.
+     * Returns true if none are left.
+     */
+    bool reclaim() { return epoch_.reclaim(); }
+
+    /**
+     * Runs \c build(arg) on a new thread and publishes its result.
+     * Returns -1 if a rebuild is already running.
+     */
+    int
+    start_rebuild(builder_func build, void* arg)
+    {
+        if (rebuilding_) return -1;
+        build_ = build;
+        build_arg_ = arg;
+        rebuilding_ = true;
+        if (pthread_create(&rebuild_thread_, 0, &rebuild_main, this)) {
+            rebuilding_ = false;
+            return -1;
+        }
+        return 0;
+    }
+
+    /**
+     * Waits for the rebuild started last, returning 0 if it published
+     * an index and -1 if it failed (or none was started).
+     */
+    int
+    wait_rebuild()
+    {
+        if (!rebuilding_) return build_ ? build_status_ : -1;
+        pthread_join(rebuild_thread_, 0);
+        rebuilding_ = false;
+        return build_status_;
+    }
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        reader r(*this);
+        if (!r.get()) throw 0;
+        r->search_nn(qus, N, argmins, mins);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        reader r(*this);
+        if (!r.get()) throw 0;
+        r->search_knn(qus, N, K, argmins, mins);
+    }
+
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        reader r(*this);
+        if (!r.get()) throw 0;
+        r->search_knn_stats(qus, N, K, argmins, mins, stats);
+    }
+
+    /**
+     * Overrides nn_obj<unsigned char>::search_knn_float; for the other
+     * types it is never instantiated.
+     */
+    void search_knn_float(const float* qus, unsigned N, unsigned K,
+                          unsigned* argmins, float* mins, search_stats* stats) const
+    {
+        reader r(*this);
+        if (!r.get()) throw 0;
+        r->search_knn_float(qus, N, K, argmins, mins, stats);
+    }
+
+    /**
+     * The current index's counters, or 0 if it keeps none. They belong
+     * to that index: a publish starts afresh with the new one's, and the
+     * pointer stays valid only until the old index is reclaimed.
+     */
+    virtual const search_stats_summary*
+    stats_summary() const
+    {
+        reader r(*this);
+        return r.get() ? r->stats_summary() : 0;
+    }
+
+    virtual void
+    reset_stats()
+    {
+        reader r(*this);
+        if (r.get()) const_cast<nn_obj<Float>*>(r.get())->reset_stats();
+    }
+
+    /**
+     * Appends to the current index, if it can take points while being
+     * searched (see nn_obj::add_points). They are not carried over to
+     * an index published later.
+     */
+    virtual void
+    add_points(const float_type* pnts, unsigned N)
+    {
+        reader r(*this);
+        if (!r.get()) throw 0;
+        const_cast<nn_obj<Float>*>(r.get())->add_points(pnts, N);
+    }
+
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        reader r(*this);
+        return r.get() ? r->memory_usage() : memory_breakdown();
+    }
+
+    virtual unsigned ndims() const { reader r(*this); return r.get() ? r->ndims() : 0; }
+    virtual unsigned npoints() const { reader r(*this); return r.get() ? r->npoints() : 0; }
+};
+
+}
+
+#endif
@@ -2,13 +2,19 @@
 #define __NN_KDTREE_HPP
 
 #include <cassert>
+#include <pthread.h>
+#include <stdint.h>
 #include <algorithm>
 #include <queue>
 #include <vector>
 
 #include "randomkit.h"
 
+#include "allocator.hpp"
 #include "dist_l2_funcs.hpp"
+#include "epoch.hpp"
+#include "point_store.hpp"
+#include "search_stats.hpp"
 
 namespace fastann {
 
@@ -18,14 +24,91 @@ static const unsigned leaf_max_points = 14;
 static const unsigned varest_max_points = 128;
 static const unsigned varest_max_randsz = 5;
 
-template<class DistFloat>
+template<class DistFloat, class Index = unsigned>
 struct second_cmp_functor {
     bool
-    operator() (const std::pair<unsigned, DistFloat>& lhs, const std::pair<unsigned, DistFloat>& rhs) const
+    operator() (const std::pair<Index, DistFloat>& lhs, const std::pair<Index, DistFloat>& rhs) const
     { return lhs.second < rhs.second; }
 };
 
-template<class Float>
+/**
+ * A node of a kd-tree flattened into an array, with children referred
+ * to by array index rather than pointer so that the array can be
+ * written to a file and mapped at any address. For leaves \c left is
+ * flat_leaf, \c right is the offset of the first point index and
+ * \c disc_dim is the number of points.
+ */
+static const uint32_t flat_leaf = 0xffffffffu;
+
+template<class DiscFloat>
+struct flat_node {
+    uint32_t left;
+    uint32_t right;
+    uint32_t disc_dim;
+    DiscFloat disc;
+};
+
+/**
+ * The points a search has already computed distances to, as an open
+ * addressing hash set, so that it costs memory in proportion to the
+ * points checked (about nchecks) rather than to the points in the
+ * forest. It starts with room for \c expected and doubles when half
+ * full. ~Index(0) marks a free slot, so it can't be a point.
+ */
+template<class Index>
+class
+visited_set
+{
+    std::vector<Index> slots_;
+    size_t size_;
+    unsigned bits_;
+
+    size_t
+    slot(Index idx) const
+    {
+        return (size_t)(((uint64_t)idx*0x9e3779b97f4a7c15ull) >> (64 - bits_));
+    }
+
+    void
+    grow()
+    {
+        std::vector<Index> old(size_t(2) << bits_, ~Index(0));
+        old.swap(slots_);
+        ++bits_;
+        for (size_t i=0; i < old.size(); ++i) {
+            if (old[i] == ~Index(0)) continue;
+            size_t s = slot(old[i]);
+            while (slots_[s] != ~Index(0)) s = (s + 1) & (slots_.size() - 1);
+            slots_[s] = old[i];
+        }
+    }
+
+public:
+    explicit visited_set(size_t expected) : size_(0), bits_(4)
+    {
+        while ((size_t(1) << bits_) < 2*expected) ++bits_;
+        slots_.assign(size_t(1) << bits_, ~Index(0));
+    }
+
+    /**
+     * Adds \c idx, returning false if it was already there.
+     */
+    bool
+    insert(Index idx)
+    {
+        size_t mask = slots_.size() - 1;
+        for (size_t s=slot(idx); ; s = (s + 1) & mask) {
+            if (slots_[s] == idx) return false;
+            if (slots_[s] == ~Index(0)) {
+                slots_[s] = idx;
+                if (2*++size_ > slots_.size()) grow();
+                return true;
+            }
+        }
+    }
+};
+
+template<class Float, class Index>
 class kdtree_node;
 
 template<class Float>
@@ -44,18 +127,22 @@ public:
     typedef unsigned DistFloat;
 };
 
-template<class Float>
+/**
+ * \c Index is the type of the point indices kept in leaves (see
+ * nn_kdtree).
+ */
+template<class Float, class Index = unsigned>
 class
 kdtree_node
 {
-    typedef kdtree_node<Float> this_type;
+    typedef kdtree_node<Float, Index> this_type;
 
 public:
     typedef typename kdtree_types<Float>::DiscFloat DiscFloat;
     typedef typename kdtree_types<Float>::DistFloat DistFloat;
-    typedef std::priority_queue< std::pair<DiscFloat, kdtree_node<Float>*>,
-                                 std::vector< std::pair<DiscFloat, kdtree_node<Float>*> >,
-                                 std::greater< std::pair<DiscFloat, kdtree_node<Float>*> > > BPQ;
+    typedef std::priority_queue< std::pair<DiscFloat, this_type*>,
+                                 std::vector< std::pair<DiscFloat, this_type*> >,
+                                 std::greater< std::pair<DiscFloat, this_type*> > > BPQ;
 
 public:
     struct internal_node_data_ {
@@ -65,7 +152,7 @@ public:
     };
     struct leaf_node_data_ {
         unsigned num_points_;
-        unsigned indices_[leaf_max_points];
+        Index indices_[leaf_max_points];
     };
     /**
      * left_ == 0 iff this node is a leaf.
@@ -80,16 +167,17 @@ public:
     inline bool is_leaf() const { return left_==0; }
 
     std::pair<unsigned, DiscFloat>
-    choose_split(const Float* pnts, const unsigned* inds, unsigned N, unsigned D, rk_state* state)
+    choose_split(const Float* pnts, const Index* inds, size_t N, unsigned D, rk_state* state)
     {
         // Find mean & variance of each dimension.
         std::vector<DiscFloat> sum_x(D, DiscFloat(0));
         std::vector<DiscFloat> sum_xx(D, DiscFloat(0));
-        unsigned count = std::min(N, varest_max_points);
+        unsigned count = (unsigned)std::min(N, (size_t)varest_max_points);
         for (unsigned n=0; n<count; ++n) {
+            const Float* pnt = pnts + (size_t)inds[n]*D;
             for (unsigned d=0; d<D; ++d) {
-                sum_x[d]  += pnts[inds[n]*D + d];
-                sum_xx[d] += (pnts[inds[n]*D + d]*pnts[inds[n]*D + d]);
+                sum_x[d]  += pnt[d];
+                sum_xx[d] += (pnt[d]*pnt[d]);
             }
         }
 
@@ -111,7 +199,8 @@ public:
     }
 
     void
-    split_points(const Float* pnts, unsigned* inds, unsigned N, unsigned D, rk_state* state)
+    split_points(const Float* pnts, Index* inds, size_t N, unsigned D, rk_state* state,
+                 allocator& alloc)
     {
         std::pair<unsigned, DiscFloat> spl = choose_split(pnts, inds, N, D, state);
 
@@ -121,7 +210,7 @@ public:
         size_t l = 0;
         size_t r = N;
         while (l!=r) {
-          if (pnts[inds[l]*D + internal_node_data.disc_dim_] < internal_node_data.disc_) l++;
+          if (pnts[(size_t)inds[l]*D + internal_node_data.disc_dim_] < internal_node_data.disc_) l++;
           else {
             r--;
             std::swap(inds[l], inds[r]);
@@ -131,166 +220,677 @@ public:
         // If either partition is empty -> vectors identical!
         if (l==0 || l==N) { l = N/2; } // The vectors are identical, so keep nlogn performance.
 
-        size_t left_sz = sizeof(this_type);
-        size_t right_sz = sizeof(this_type);
-        if (l > leaf_max_points) { // The left node will be internal
-            left_sz = sizeof(void*) + sizeof(internal_node_data);
+        left_ = (this_type*)alloc.allocate(alloc_size(l), alignof_node);
+        try {
+            internal_node_data.right_ = (this_type*)alloc.allocate(alloc_size(N-l), alignof_node);
         }
-        if ((N-l) > leaf_max_points) { // The right node will be internal
-            right_sz = sizeof(void*) + sizeof(internal_node_data);
+        catch (...) {
+            alloc.deallocate(left_, alloc_size(l));
+            left_ = 0;
+            throw;
         }
 
-        left_ = (this_type*)malloc(left_sz);
-        internal_node_data.right_ = (this_type*)malloc(right_sz);
-
-        new (left_) this_type(pnts, inds, l, D, state);
-        new (internal_node_data.right_) this_type(pnts, &inds[l], N-l, D, state);
+        // A child that throws has already freed its own subtree.
+        bool left_built = false;
+        try {
+            new (left_) this_type(pnts, inds, l, D, state, alloc);
+            left_built = true;
+            new (internal_node_data.right_) this_type(pnts, &inds[l], N-l, D, state, alloc);
+        }
+        catch (...) {
+            if (left_built) left_->destroy(alloc);
+            alloc.deallocate(left_, alloc_size(l));
+            alloc.deallocate(internal_node_data.right_, alloc_size(N-l));
+            left_ = 0;
+            throw;
+        }
     }
 
 public:
+    static const size_t alignof_node = sizeof(void*);
+
+    /**
+     * The bytes allocated for a node over \c N points: internal nodes
+     * don't need the leaf's index array.
+     */
+    static size_t
+    alloc_size(size_t N)
+    {
+        if (N > leaf_max_points) return sizeof(void*) + sizeof(internal_node_data_);
+        return sizeof(this_type);
+    }
+
     kdtree_node() : left_(0)/*, right_(0)*/ { }
 
-    kdtree_node(const Float* pnts, unsigned* inds, unsigned N, unsigned D, rk_state* state)
+    /**
+     * Children are allocated from \c alloc; call destroy() with the
+     * same allocator to free them.
+     */
+    kdtree_node(const Float* pnts, Index* inds, size_t N, unsigned D, rk_state* state,
+                allocator& alloc)
      : left_(0)/*, right_(0)*/
     {
         if (N > leaf_max_points) { // Internal node
-            split_points(pnts, inds, N, D, state);
+            split_points(pnts, inds, N, D, state, alloc);
         }
         else {
-            leaf_node_data.num_points_ = N;
+            leaf_node_data.num_points_ = (unsigned)N;
             std::copy(inds, inds + N, leaf_node_data.indices_);
         }
     }
 
-    ~kdtree_node()
+    /**
+     * Frees every node below this one.
+     */
+    void
+    destroy(allocator& alloc)
     {
         if (!is_leaf()) {
-            left_->~kdtree_node();
-            internal_node_data.right_->~kdtree_node();
-            free(left_);
-            free(internal_node_data.right_);
+            this_type* children[2] = { left_, internal_node_data.right_ };
+            for (unsigned c=0; c < 2; ++c) {
+                size_t sz = children[c]->is_leaf() ? sizeof(this_type) : alloc_size(leaf_max_points + 1);
+                children[c]->destroy(alloc);
+                alloc.deallocate(children[c], sz);
+            }
+            left_ = 0;
+        }
+    }
+
+    /**
+     * Adds the bytes allocated for this subtree to \c mem.
+     */
+    void
+    memory_usage(memory_breakdown& mem) const
+    {
+        if (is_leaf()) {
+            mem.nodes += sizeof(this_type) - sizeof(leaf_node_data.indices_);
+            mem.leaf_indices += sizeof(leaf_node_data.indices_);
+        }
+        else {
+            mem.nodes += alloc_size(leaf_max_points + 1);
+            left_->memory_usage(mem);
+            internal_node_data.right_->memory_usage(mem);
+        }
+    }
+
+    /**
+     * Appends the indices of every leaf below this node, left to right.
+     */
+    void
+    leaf_order(std::vector<Index>& order) const
+    {
+        if (is_leaf()) {
+            order.insert(order.end(), leaf_node_data.indices_,
+                         leaf_node_data.indices_ + leaf_node_data.num_points_);
+        }
+        else {
+            left_->leaf_order(order);
+            internal_node_data.right_->leaf_order(order);
+        }
+    }
+
+    /**
+     * Appends this subtree to \c nodes in pre-order (with leaf indices
+     * to \c leaf_inds), returning the index of this node.
+     */
+    uint32_t
+    flatten(std::vector< flat_node<DiscFloat> >& nodes, std::vector<uint32_t>& leaf_inds) const
+    {
+        uint32_t me = (uint32_t)nodes.size();
+        nodes.push_back(flat_node<DiscFloat>());
+        if (is_leaf()) {
+            nodes[me].left = flat_leaf;
+            nodes[me].right = (uint32_t)leaf_inds.size();
+            nodes[me].disc_dim = leaf_node_data.num_points_;
+            nodes[me].disc = DiscFloat(0);
+            leaf_inds.insert(leaf_inds.end(), leaf_node_data.indices_,
+                             leaf_node_data.indices_ + leaf_node_data.num_points_);
         }
+        else {
+            uint32_t l = left_->flatten(nodes, leaf_inds);
+            uint32_t r = internal_node_data.right_->flatten(nodes, leaf_inds);
+            nodes[me].left = l;
+            nodes[me].right = r;
+            nodes[me].disc_dim = internal_node_data.disc_dim_;
+            nodes[me].disc = internal_node_data.disc_;
+        }
+        return me;
     }
 
+    /**
+     * Rewrites every leaf index \c i below this node as \c new_of_old[i].
+     */
     void
-    search(const Float* qu,
+    remap_indices(const std::vector<Index>& new_of_old)
+    {
+        if (is_leaf()) {
+            for (unsigned i=0; i < leaf_node_data.num_points_; ++i) {
+                leaf_node_data.indices_[i] = new_of_old[leaf_node_data.indices_[i]];
+            }
+        }
+        else {
+            left_->remap_indices(new_of_old);
+            internal_node_data.right_->remap_indices(new_of_old);
+        }
+    }
+
+    /**
+     * \c Query and \c Dist are Float and dist_l2_wrapper<Float>, or
+     * for float queries against unsigned char points float and
+     * dist_l2_mixed_wrapper; \c DistT is the distance type of \c Dist.
+     */
+    template<class Query, class Dist, class DistT>
+    __attribute__ ((noinline)) void
+    search(const Query* qu,
            BPQ& pri_branch,
-           dist_l2_wrapper<Float> dist,
-           std::vector< std::pair<unsigned, DistFloat> >& nns,
-           std::vector< bool >& seen,
+           Dist dist,
+           std::vector< std::pair<Index, DistT> >& nns,
+           visited_set<Index>& seen,
+           Index N,
            const Float* pnts,
            unsigned D,
-           DiscFloat mindsq) __attribute__ ((noinline))
+           DiscFloat mindsq,
+           search_stats* stats)
     {
         this_type* cur = this;
         this_type* follow = 0;
         this_type* other = 0;
 
+        // Children and leaf counts are loaded with acquire, as add_points
+        // may be publishing new ones; on x86 this costs nothing.
         while (!cur->is_leaf()) { // Follow best bin first until we hit a leaf
             DiscFloat diff = qu[cur->internal_node_data.disc_dim_] - cur->internal_node_data.disc_;
 
             if (diff < 0) {
-                follow = cur->left_;
-                other = cur->internal_node_data.right_;
+                follow = __atomic_load_n(&cur->left_, __ATOMIC_ACQUIRE);
+                other = __atomic_load_n(&cur->internal_node_data.right_, __ATOMIC_ACQUIRE);
             }
             else {
-                follow = cur->internal_node_data.right_;
-                other = cur->left_;
+                follow = __atomic_load_n(&cur->internal_node_data.right_, __ATOMIC_ACQUIRE);
+                other = __atomic_load_n(&cur->left_, __ATOMIC_ACQUIRE);
             }
 
             pri_branch.push(std::make_pair(mindsq + diff*diff, other));
+            FASTANN_STAT_ADD(stats, npushes, 1);
             cur = follow;
         }
-
-        unsigned* cur_inds = cur->leaf_node_data.indices_;
-        unsigned ncur_inds = cur->leaf_node_data.num_points_;
-        
-        unsigned i;
-        for (i = 0; i < ncur_inds-1; ++i) {
-            //_mm_prefetch(&pnts[cur_inds[i+1]*D], _MM_HINT_T2);
-            //_mm_prefetch(&pnts[cur_inds[i+1]*D + 64], _MM_HINT_NTA);
-            if (!seen[cur_inds[i]]) {                
-                DistFloat dsq;
-                dist.func(qu, &pnts[cur_inds[i]*D], 1, D, &dsq);
+        FASTANN_STAT_MAX(stats, max_heap, pri_branch.size());
+        FASTANN_STAT_ADD(stats, nleaves, 1);
+
+        Index* cur_inds = cur->leaf_node_data.indices_;
+        unsigned ncur_inds = __atomic_load_n(&cur->leaf_node_data.num_points_, __ATOMIC_ACQUIRE);
+
+        // Points added after the search started (index N or more) are skipped.
+        for (unsigned i = 0; i < ncur_inds; ++i) {
+            if (cur_inds[i] >= N) continue;
+            if (seen.insert(cur_inds[i])) {
+                DistT dsq;
+                dist.func(qu, &pnts[(size_t)cur_inds[i]*D], 1, D, &dsq);
                 nns.push_back(std::make_pair(cur_inds[i], dsq));
-
-                seen[cur_inds[i]] = true;
             }
+            else FASTANN_STAT_ADD(stats, nseen, 1);
+        }
+    }
+
+    /**
+     * Adds point \c idx of \c pnts to the subtree hanging from \c link,
+     * while readers may be searching it. A leaf with room takes it in
+     * place; a full leaf is replaced by a new subtree over its points
+     * and \c idx, and handed to \c ep to be freed once no reader can
+     * still be in it.
+     */
+    static void
+    insert(this_type** link, const Float* pnts, Index idx, unsigned D, rk_state* state,
+           allocator& alloc, epoch_domain& ep)
+    {
+        this_type* cur = *link;
+        while (!cur->is_leaf()) { // Same side as split_points sends it.
+            if (pnts[(size_t)idx*D + cur->internal_node_data.disc_dim_] < cur->internal_node_data.disc_)
+                link = &cur->left_;
+            else
+                link = &cur->internal_node_data.right_;
+            cur = *link;
+        }
+
+        unsigned n = cur->leaf_node_data.num_points_;
+        if (n < leaf_max_points) {
+            cur->leaf_node_data.indices_[n] = idx;
+            __atomic_store_n(&cur->leaf_node_data.num_points_, n + 1, __ATOMIC_RELEASE);
+            return;
+        }
+
+        Index inds[leaf_max_points + 1];
+        std::copy(cur->leaf_node_data.indices_, cur->leaf_node_data.indices_ + n, inds);
+        inds[n] = idx;
+
+        this_type* sub = (this_type*)alloc.allocate(alloc_size(n + 1), alignof_node);
+        try {
+            new (sub) this_type(pnts, inds, n + 1, D, state, alloc);
         }
-        if (!seen[cur_inds[i]]) {                
-            DistFloat dsq;
-            dist.func(qu, &pnts[cur_inds[i]*D], 1, D, &dsq);
-            nns.push_back(std::make_pair(cur_inds[i], dsq));
+        catch (...) {
+            alloc.deallocate(sub, alloc_size(n + 1));
+            throw;
         }
+        __atomic_store_n(link, sub, __ATOMIC_RELEASE);
+        ep.retire(cur, alloc, sizeof(this_type));
     }
 };
 
 }
 
-template<class Float>
+/**
+ * A forest of randomized kd-trees. Points are numbered with \c Index:
+ * the default unsigned keeps leaves compact for up to 2^32 - 1 points,
+ * and uint64_t allows more at the cost of larger leaves.
+ */
+template<class Float, class Index = unsigned>
 class
 nn_kdtree
 {
-    typedef nn_kdtree_internal::kdtree_node<Float> node_type;
+    typedef nn_kdtree_internal::kdtree_node<Float, Index> node_type;
     typedef typename node_type::DiscFloat DiscFloat;
     typedef typename node_type::DistFloat DistFloat;
     typedef typename node_type::BPQ BPQ;
 
     std::vector< node_type* > trees_;
-    unsigned N_;
+    Index N_;
     unsigned D_;
-    const Float* pnts_;
     rk_state state_;
 
+    allocator* alloc_;
+    append_store<Float> store_;
+    append_store<Index> old_of_new_; // Empty unless the points are owned.
+    bool owned_;
+
+    // Readers never lock; add_points takes write_mutex_ and retires what
+    // it unlinks (full leaves, outgrown point buffers) to epoch_.
+    epoch_domain epoch_;
+    mutable pthread_mutex_t write_mutex_;
+
+    nn_kdtree(const nn_kdtree&);
+    nn_kdtree& operator=(const nn_kdtree&);
+
+    struct
+    write_lock
+    {
+        pthread_mutex_t* m;
+        explicit write_lock(pthread_mutex_t* mm) : m(mm) { pthread_mutex_lock(m); }
+        ~write_lock() { pthread_mutex_unlock(m); }
+    };
+
+    /**
+     * Copies the points into store_ in the leaf order of the first
+     * tree, so that points sharing a leaf share cache lines and pages.
+     * Every tree is renumbered to index into the copy.
+     */
+    void
+    take_points(const Float* pnts)
+    {
+        std::vector<Index> order;
+        order.reserve(N_);
+        trees_[0]->leaf_order(order);
+
+        std::vector<Index> new_of_old(N_);
+        for (Index n=0; n < N_; ++n) new_of_old[order[n]] = n;
+
+        for (size_t t=0; t<trees_.size(); ++t) {
+            trees_[t]->remap_indices(new_of_old);
+        }
+
+        store_.assign(pnts, N_, &order[0]);
+        old_of_new_.assign(&order[0], N_);
+        owned_ = true;
+    }
+
+    void
+    clear()
+    {
+        for (size_t t=0; t<trees_.size(); ++t) {
+            size_t sz = trees_[t]->is_leaf() ? sizeof(node_type)
+                                             : node_type::alloc_size(nn_kdtree_internal::leaf_max_points + 1);
+            trees_[t]->destroy(*alloc_);
+            alloc_->deallocate(trees_[t], sz);
+        }
+        trees_.clear();
+    }
+
+    /**
+     * A new[] style scratch array from the allocator, so that it counts
+     * towards the peak of the build.
+     */
+    struct
+    scratch_inds
+    {
+        allocator& alloc;
+        size_t N;
+        Index* inds;
+
+        scratch_inds(allocator& a, size_t n)
+         : alloc(a), N(n), inds((Index*)a.allocate(n*sizeof(Index), sizeof(Index)))
+        { }
+        ~scratch_inds() { alloc.deallocate(inds, N*sizeof(Index)); }
+    };
+
 public:
-    nn_kdtree(const Float* pnts, unsigned N, unsigned D, unsigned ntrees = 8, unsigned seed=42)
-     : N_(N), D_(D), pnts_(pnts)
+    /**
+     * If \c copy_points is set the tree keeps its own (reordered) copy
+     * of \c pnts, otherwise \c pnts must outlive the tree. Nodes, the
+     * copy and the build's scratch space come from \c alloc, which
+     * must outlive the tree.
+     */
+    nn_kdtree(const Float* pnts, Index N, unsigned D, unsigned ntrees = 8, unsigned seed=42,
+              bool copy_points=false, allocator& alloc=default_allocator())
+     : N_(N), D_(D), alloc_(&alloc), store_(alloc, D), old_of_new_(alloc, 1), owned_(false)
     {
         rk_seed(seed, &state_);
+        pthread_mutex_init(&write_mutex_, 0);
+        store_.borrow(pnts, N);
+
+        try {
+            // Create inds.
+            scratch_inds inds(alloc, N);
+            for (size_t n=0; n<N; ++n) inds.inds[n] = n;
+
+            // Create trees.
+            trees_.reserve(ntrees);
+            for (unsigned t=0; t<ntrees; ++t) {
+                node_type* root = (node_type*)alloc.allocate(node_type::alloc_size(N), node_type::alignof_node);
+                trees_.push_back(root);
+                try {
+                    new (root) node_type(pnts, inds.inds, N, D, &state_, alloc);
+                }
+                catch (...) {
+                    trees_.pop_back();
+                    alloc.deallocate(root, node_type::alloc_size(N));
+                    throw;
+                }
+            }
+
+            if (copy_points && !trees_.empty()) take_points(pnts);
+        }
+        catch (...) {
+            clear();
+            pthread_mutex_destroy(&write_mutex_);
+            throw;
+        }
+    }
 
-        // Create inds.
-        std::vector<unsigned> inds(N);
-        for (size_t n=0; n<N; ++n) inds[n] = n;
+    /**
+     * An estimate of memory_usage() for a forest over \c N points
+     * built with these arguments, without building it. The build needs
+     * a further N sizeof(Index) bytes of scratch space on top.
+     */
+    static memory_breakdown
+    estimate_memory(Index N, unsigned D, unsigned ntrees, bool copy_points)
+    {
+        using nn_kdtree_internal::leaf_max_points;
 
-        // Create trees.
-        for (unsigned t=0; t<ntrees; ++t) {
-            trees_.push_back(new node_type(pnts, &inds[0], N, D, &state_));
+        memory_breakdown mem;
+        if (N <= leaf_max_points) {
+            node_type leaf;
+            leaf.memory_usage(mem);
         }
+        else {
+            // Mean splits leave leaves about two thirds full.
+            size_t nleaves = ((size_t)N*3 + 2*leaf_max_points - 1)/(2*leaf_max_points);
+            mem.nodes = (nleaves - 1)*node_type::alloc_size(leaf_max_points + 1)
+                      + nleaves*(sizeof(node_type) - sizeof(Index)*leaf_max_points);
+            mem.leaf_indices = nleaves*sizeof(Index)*leaf_max_points;
+        }
+        mem.nodes *= ntrees;
+        mem.leaf_indices *= ntrees;
+        mem.aux = ntrees*sizeof(node_type*);
+        if (copy_points && ntrees) {
+            mem.points = (size_t)N*D*sizeof(Float);
+            mem.aux += (size_t)N*sizeof(Index);
+        }
+        return mem;
     }
 
-    ~nn_kdtree()
+    /**
+     * The bytes this forest has allocated. Borrowed points aren't
+     * counted.
+     */
+    memory_breakdown
+    memory_usage() const
+    {
+        write_lock l(&write_mutex_);
+        memory_breakdown mem;
+        for (size_t t=0; t<trees_.size(); ++t) trees_[t]->memory_usage(mem);
+        mem.points = store_.size_bytes();
+        mem.aux = old_of_new_.size_bytes() + trees_.capacity()*sizeof(node_type*);
+        return mem;
+    }
+
+    /**
+     * Adds \c N points, numbered on from npoints(), while other threads
+     * keep searching; concurrent calls are serialized. The rows are
+     * copied (a borrowed forest copies its original points too, the
+     * first time), then made visible, then inserted into every tree,
+     * so a search that starts part way through may find a new point in
+     * some trees only. Throws std::bad_alloc if out of memory, in which
+     * case points already made visible stay.
+     */
+    void
+    add_points(const Float* pnts, Index N)
+    {
+        write_lock l(&write_mutex_);
+        Index first = N_;
+
+        store_.reserve(first + N, epoch_);
+        if (owned_) old_of_new_.reserve(first + N, epoch_);
+
+        store_.append(pnts, N, epoch_);
+        if (owned_) {
+            for (Index n=0; n < N; ++n) {
+                Index id = first + n;
+                old_of_new_.append(&id, 1, epoch_);
+            }
+        }
+        __atomic_store_n(&N_, first + N, __ATOMIC_RELEASE);
+
+        const Float* rows = store_.data();
+        for (Index n=0; n < N; ++n) {
+            for (size_t t=0; t<trees_.size(); ++t) {
+                node_type::insert(&trees_[t], rows, first + n, D_, &state_, *alloc_, epoch_);
+            }
+        }
+        epoch_.reclaim();
+    }
+
+    /**
+     * Appends every tree to \c nodes/leaf_inds (see flat_node), with
+     * the root of each in \c roots.
+     */
+    void
+    flatten(std::vector< nn_kdtree_internal::flat_node<DiscFloat> >& nodes,
+            std::vector<uint32_t>& leaf_inds, std::vector<uint32_t>& roots) const
     {
         for (size_t t=0; t<trees_.size(); ++t) {
-            delete trees_[t];
+            roots.push_back(trees_[t]->flatten(nodes, leaf_inds));
         }
     }
 
+    const Float* points() const { return store_.data(); }
+    Index npoints() const { return __atomic_load_n(&N_, __ATOMIC_ACQUIRE); }
+    unsigned ndims() const { return D_; }
+    unsigned ntrees() const { return (unsigned)trees_.size(); }
+
+    /**
+     * For an owning tree, the caller's index of each stored point; 0
+     * if the points are borrowed.
+     */
+    const Index* point_order() const { return owned_ ? old_of_new_.data() : 0; }
+
+    ~nn_kdtree()
+    {
+        clear();
+        pthread_mutex_destroy(&write_mutex_);
+    }
+
+    /**
+     * \c stats, if given, is incremented (only in FASTANN_STATS builds).
+     * \c dist is a dist_l2_wrapper<Float>, or dist_l2_mixed_wrapper
+     * for float queries against unsigned char points. Scratch grows with
+     * \c nchecks (about 4*nchecks Index slots for the points seen), not
+     * with npoints(), so the forest's size is limited only by \c Index.
+     */
+    template<class Query, class Dist, class DistT>
     void
-    search(const Float* qu, dist_l2_wrapper<Float> dist, unsigned numnn, std::pair<unsigned, DistFloat>* ret_nns, unsigned nchecks) const
+    search(const Query* qu, Dist dist, unsigned numnn, std::pair<Index, DistT>* ret_nns, unsigned nchecks,
+           search_stats* stats = 0) const
     {
         if (nchecks < numnn) { nchecks = numnn; }
         BPQ pri_branch;
 
-        std::vector< std::pair<unsigned, DistFloat> > nns;
-        std::vector<bool> seen(N_, false);
+        // Whatever add_points unlinks meanwhile is kept until we leave.
+        epoch_domain::guard g(epoch_);
+        Index N = npoints();
+        const Float* pnts = store_.data();
+        const Index* order = point_order();
+
+        std::vector< std::pair<Index, DistT> > nns;
+        // A leaf may overshoot nchecks, and each tree's first descent reads one.
+        nn_kdtree_internal::visited_set<Index> seen(nchecks + (trees_.size() + 1)*nn_kdtree_internal::leaf_max_points);
 
         // Search each tree at least once.
         for (size_t t=0; t<trees_.size(); ++t) {
-            trees_[t]->search(qu, pri_branch, dist, nns, seen, pnts_, D_, DiscFloat());
+            node_type* root = __atomic_load_n(&trees_[t], __ATOMIC_ACQUIRE);
+            root->search(qu, pri_branch, dist, nns, seen, N, pnts, D_, DiscFloat(), stats);
         }
+        FASTANN_STAT_ADD(stats, ntrees, trees_.size());
 
         // Continue search until we've performed enough distances
-        nn_kdtree_internal::second_cmp_functor<DistFloat> cmp;
-        while (nns.size() < nchecks) {
+        nn_kdtree_internal::second_cmp_functor<DistT, Index> cmp;
+        while (nns.size() < nchecks && !pri_branch.empty()) {
             std::pair<DiscFloat, node_type* > pr = pri_branch.top();
             pri_branch.pop();
+            FASTANN_STAT_ADD(stats, npops, 1);
 
-            pr.second->search(qu, pri_branch, dist, nns, seen, pnts_, D_, pr.first);
+            pr.second->search(qu, pri_branch, dist, nns, seen, N, pnts, D_, pr.first, stats);
         }
+        FASTANN_STAT_ADD(stats, ndists, nns.size());
 
+        if (numnn > nns.size()) { numnn = nns.size(); } // Only if numnn > N.
         std::partial_sort(nns.begin(), nns.begin() + numnn, nns.end(), cmp);
 
-        std::copy(nns.begin(), nns.begin() + std::min(numnn, nchecks), ret_nns);
+        std::copy(nns.begin(), nns.begin() + numnn, ret_nns);
+
+        if (order) {
+            for (unsigned i=0; i < numnn; ++i) ret_nns[i].first = order[ret_nns[i].first];
+        }
+    }
+};
+
+/**
+ * Searches a kd-forest held in flat arrays (see flat_node), for
+ * example one mapped read-only from a file. Nothing is owned.
+ */
+template<class Float>
+class
+nn_kdtree_flat
+{
+    typedef typename nn_kdtree_internal::kdtree_types<Float>::DiscFloat DiscFloat;
+    typedef typename nn_kdtree_internal::kdtree_types<Float>::DistFloat DistFloat;
+    typedef nn_kdtree_internal::flat_node<DiscFloat> node_type;
+    typedef std::pair<DiscFloat, uint32_t> branch_type;
+    typedef std::priority_queue< branch_type, std::vector<branch_type>, std::greater<branch_type> > BPQ;
+
+    const node_type* nodes_;
+    const uint32_t* leaf_inds_;
+    const uint32_t* roots_;
+    unsigned ntrees_;
+    const Float* pnts_;
+    const uint32_t* old_of_new_;
+    unsigned N_;
+    unsigned D_;
+
+    template<class Query, class Dist, class DistT>
+    void
+    search_from(uint32_t cur, const Query* qu, BPQ& pri_branch, Dist dist,
+                std::vector< std::pair<unsigned, DistT> >& nns, std::vector<bool>& seen,
+                DiscFloat mindsq, search_stats* stats) const
+    {
+        while (nodes_[cur].left != nn_kdtree_internal::flat_leaf) { // Best bin first down to a leaf
+            const node_type& node = nodes_[cur];
+            DiscFloat diff = qu[node.disc_dim] - node.disc;
+
+            if (diff < 0) {
+                pri_branch.push(std::make_pair(mindsq + diff*diff, node.right));
+                cur = node.left;
+            }
+            else {
+                pri_branch.push(std::make_pair(mindsq + diff*diff, node.left));
+                cur = node.right;
+            }
+            FASTANN_STAT_ADD(stats, npushes, 1);
+        }
+        FASTANN_STAT_MAX(stats, max_heap, pri_branch.size());
+        FASTANN_STAT_ADD(stats, nleaves, 1);
+
+        const uint32_t* cur_inds = leaf_inds_ + nodes_[cur].right;
+        uint32_t ncur_inds = nodes_[cur].disc_dim;
+        for (uint32_t i = 0; i < ncur_inds; ++i) {
+            if (!seen[cur_inds[i]]) {
+                DistT dsq;
+                dist.func(qu, &pnts_[(size_t)cur_inds[i]*D_], 1, D_, &dsq);
+                nns.push_back(std::make_pair(cur_inds[i], dsq));
+
+                seen[cur_inds[i]] = true;
+            }
+            else FASTANN_STAT_ADD(stats, nseen, 1);
+        }
+    }
+
+public:
+    /**
+     * \c old_of_new, if not null, maps the index of each point in
+     * \c pnts back to the index to report.
+     */
+    nn_kdtree_flat(const node_type* nodes, const uint32_t* leaf_inds,
+                   const uint32_t* roots, unsigned ntrees,
+                   const Float* pnts, const uint32_t* old_of_new, unsigned N, unsigned D)
+     : nodes_(nodes), leaf_inds_(leaf_inds), roots_(roots), ntrees_(ntrees),
+       pnts_(pnts), old_of_new_(old_of_new), N_(N), D_(D)
+    { }
+
+    /**
+     * As nn_kdtree::search.
+     */
+    template<class Query, class Dist, class DistT>
+    void
+    search(const Query* qu, Dist dist, unsigned numnn, std::pair<unsigned, DistT>* ret_nns, unsigned nchecks,
+           search_stats* stats = 0) const
+    {
+        if (nchecks < numnn) { nchecks = numnn; }
+        BPQ pri_branch;
+
+        std::vector< std::pair<unsigned, DistT> > nns;
+        std::vector<bool> seen(N_, false);
+
+        for (unsigned t=0; t<ntrees_; ++t) {
+            search_from(roots_[t], qu, pri_branch, dist, nns, seen, DiscFloat(), stats);
+        }
+        FASTANN_STAT_ADD(stats, ntrees, ntrees_);
+
+        while (nns.size() < nchecks && !pri_branch.empty()) {
+            branch_type pr = pri_branch.top();
+            pri_branch.pop();
+            FASTANN_STAT_ADD(stats, npops, 1);
+
+            search_from(pr.second, qu, pri_branch, dist, nns, seen, pr.first, stats);
+        }
+        FASTANN_STAT_ADD(stats, ndists, nns.size());
+
+        nn_kdtree_internal::second_cmp_functor<DistT> cmp;
+        if (numnn > nns.size()) { numnn = nns.size(); }
+        std::partial_sort(nns.begin(), nns.begin() + numnn, nns.end(), cmp);
+
+        std::copy(nns.begin(), nns.begin() + numnn, ret_nns);
+
+        if (old_of_new_) {
+            for (unsigned i=0; i < numnn; ++i) ret_nns[i].first = old_of_new_[ret_nns[i].first];
+        }
     }
 };
 
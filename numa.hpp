@@ -0,0 +1,195 @@
+/**
+ * NUMA topology and placement without a libnuma dependency: the node
+ * of every CPU is read from sysfs, threads are pinned with
+ * pthread_setaffinity_np and memory is interleaved with the mbind
+ * system call. On machines (or kernels) without NUMA everything is a
+ * single node and placement calls do nothing.
+ */
+#ifndef __FASTANN_NUMA_HPP
+#define __FASTANN_NUMA_HPP
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace fastann {
+
+class
+numa_topology
+{
+    std::vector< std::vector<unsigned> > cpus_; // By node.
+    std::vector<unsigned> ids_; // The kernel's number for each node.
+    std::vector<int> node_of_cpu_;
+
+    /**
+     * Parses a sysfs cpulist such as "0-3,8-11".
+     */
+    static std::vector<unsigned>
+    parse_cpulist(const char* s)
+    {
+        std::vector<unsigned> ret;
+        while (*s >= '0' && *s <= '9') {
+            char* end;
+            unsigned lo = (unsigned)strtoul(s, &end, 10), hi = lo;
+            if (*end == '-') hi = (unsigned)strtoul(end + 1, &end, 10);
+            for (unsigned c=lo; c <= hi; ++c) ret.push_back(c);
+            s = *end == ',' ? end + 1 : end;
+        }
+        return ret;
+    }
+
+    /**
+     * Reads the first line of \c path into \c buf, returning false if
+     * it can't be read.
+     */
+    static bool
+    read_line(const char* path, char* buf, size_t size)
+    {
+        FILE* fp = fopen(path, "r");
+        if (!fp) return false;
+        bool ok = fgets(buf, (int)size, fp) != 0;
+        fclose(fp);
+        return ok;
+    }
+
+    /**
+     * Nodes are numbered densely here; the kernel's numbers, which may
+     * have gaps, come from the online node list. Nodes without CPUs
+     * (memory only) are left out, as no thread can run there.
+     */
+    numa_topology()
+    {
+        char buf[4096];
+        std::vector<unsigned> online;
+        if (read_line("/sys/devices/system/node/online", buf, sizeof(buf))) online = parse_cpulist(buf);
+        for (size_t i=0; i < online.size(); ++i) {
+            char path[96];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", online[i]);
+            if (!read_line(path, buf, sizeof(buf))) continue;
+            std::vector<unsigned> cpus = parse_cpulist(buf);
+            if (cpus.empty()) continue;
+            cpus_.push_back(cpus);
+            ids_.push_back(online[i]);
+        }
+
+        if (cpus_.empty()) {
+            long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+            cpus_.resize(1);
+            ids_.assign(1, 0);
+            for (long c=0; c < (ncpus > 0 ? ncpus : 1); ++c) cpus_[0].push_back((unsigned)c);
+        }
+
+        for (size_t n=0; n < cpus_.size(); ++n) {
+            for (size_t i=0; i < cpus_[n].size(); ++i) {
+                unsigned c = cpus_[n][i];
+                if (c >= node_of_cpu_.size()) node_of_cpu_.resize(c + 1, 0);
+                node_of_cpu_[c] = (int)n;
+            }
+        }
+    }
+
+public:
+    /**
+     * The machine's topology, read once.
+     */
+    static const numa_topology&
+    get()
+    {
+        static numa_topology topo;
+        return topo;
+    }
+
+    unsigned nnodes() const { return (unsigned)cpus_.size(); }
+    const std::vector<unsigned>& cpus(unsigned node) const { return cpus_[node]; }
+    unsigned kernel_id(unsigned node) const { return ids_[node]; }
+
+    unsigned
+    node_of_cpu(int cpu) const
+    {
+        return cpu >= 0 && (size_t)cpu < node_of_cpu_.size() ? (unsigned)node_of_cpu_[cpu] : 0;
+    }
+
+    /**
+     * The node the calling thread is running on right now.
+     */
+    unsigned
+    current_node() const
+    {
+        return nnodes() > 1 ? node_of_cpu(sched_getcpu()) : 0;
+    }
+
+    /**
+     * The \c i th CPU taking nodes in turn (node 0's first CPU, node
+     * 1's first CPU, ...), so that consecutive workers alternate
+     * between nodes.
+     */
+    unsigned
+    spread_cpu(unsigned i) const
+    {
+        unsigned node = i % nnodes();
+        const std::vector<unsigned>& c = cpus_[node];
+        return c.empty() ? 0 : c[(i/nnodes()) % c.size()];
+    }
+};
+
+/**
+ * Restricts \c thread to the CPUs of \c node. Returns false if the
+ * kernel refused.
+ */
+inline bool
+numa_pin_to_node(pthread_t thread, unsigned node)
+{
+    const numa_topology& topo = numa_topology::get();
+    if (node >= topo.nnodes()) return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    const std::vector<unsigned>& cpus = topo.cpus(node);
+    for (size_t i=0; i < cpus.size(); ++i) CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+inline bool
+numa_pin_to_cpu(pthread_t thread, unsigned cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+/**
+ * Spreads the pages of [addr, addr + len) round robin over every node.
+ * \c addr must be page aligned. Pages already touched keep their place.
+ */
+inline bool
+numa_interleave(void* addr, size_t len)
+{
+    const numa_topology& topo = numa_topology::get();
+#ifdef __NR_mbind
+    if (topo.nnodes() < 2) return true;
+
+    static const int mpol_interleave = 3; // MPOL_INTERLEAVE from numaif.h
+    static const size_t bits = 8*sizeof(unsigned long);
+    unsigned max_id = 0;
+    for (unsigned n=0; n < topo.nnodes(); ++n) max_id = std::max(max_id, topo.kernel_id(n));
+    std::vector<unsigned long> mask(max_id/bits + 1, 0);
+    for (unsigned n=0; n < topo.nnodes(); ++n) {
+        mask[topo.kernel_id(n)/bits] |= 1ul << (topo.kernel_id(n) % bits);
+    }
+    return syscall(__NR_mbind, addr, len, mpol_interleave, &mask[0],
+                   (unsigned long)(mask.size()*bits + 1), 0) == 0; // The kernel drops one bit.
+#else
+    return topo.nnodes() < 2;
+#endif
+}
+
+}
+
+#endif
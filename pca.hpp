@@ -0,0 +1,427 @@
+/**
+ * Principal component analysis for reducing points to fewer dimensions
+ * before indexing them: kd-trees do far better at D=64 than at D=960.
+ * The covariance of a sample is accumulated in blocks of centred rows
+ * with SSE2, the leading eigenvectors are found by subspace iteration,
+ * and points are projected a block at a time, four components per
+ * pass over each row.
+ */
+#ifndef __FASTANN_PCA_HPP
+#define __FASTANN_PCA_HPP
+
+#include <emmintrin.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "randomkit.h"
+#include "thread_pool.hpp"
+
+namespace fastann {
+
+namespace pca_internal {
+
+static const unsigned block_rows = 64; // Sample rows per covariance update.
+static const unsigned project_rows = 256; // Rows per projection task.
+
+inline double
+dot_pd(const double* a, const double* b, unsigned n)
+{
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    unsigned i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double tmp[2];
+    _mm_storeu_pd(tmp, _mm_add_pd(acc0, acc1));
+    double sum = tmp[0] + tmp[1];
+    for (; i < n; ++i) sum += a[i]*b[i];
+    return sum;
+}
+
+inline float
+hsum_ps(__m128 v)
+{
+    float tmp[4];
+    _mm_storeu_ps(tmp, v);
+    return (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+}
+
+/**
+ * Cyclic Jacobi eigendecomposition of the symmetric \c m x \c m matrix
+ * \c a (destroyed). Eigenvalues go to \c evals and eigenvectors to the
+ * columns of \c v.
+ */
+inline void
+jacobi_eigen(std::vector<double>& a, unsigned m, std::vector<double>& evals, std::vector<double>& v)
+{
+    v.assign((size_t)m*m, 0.0);
+    for (unsigned i=0; i < m; ++i) v[(size_t)i*m + i] = 1.0;
+
+    for (unsigned sweep=0; sweep < 64; ++sweep) {
+        double off = 0, diag = 0;
+        for (unsigned i=0; i < m; ++i) {
+            diag += a[(size_t)i*m + i]*a[(size_t)i*m + i];
+            for (unsigned j=i+1; j < m; ++j) off += a[(size_t)i*m + j]*a[(size_t)i*m + j];
+        }
+        if (off <= 1e-24*diag) break;
+
+        for (unsigned p=0; p < m; ++p) {
+            for (unsigned q=p+1; q < m; ++q) {
+                double apq = a[(size_t)p*m + q];
+                if (apq == 0) continue;
+                double theta = (a[(size_t)q*m + q] - a[(size_t)p*m + p])/(2*apq);
+                double t = (theta >= 0 ? 1.0 : -1.0)/(fabs(theta) + sqrt(theta*theta + 1));
+                double c = 1/sqrt(t*t + 1), s = t*c;
+                for (unsigned k=0; k < m; ++k) { // a = a J
+                    double akp = a[(size_t)k*m + p], akq = a[(size_t)k*m + q];
+                    a[(size_t)k*m + p] = c*akp - s*akq;
+                    a[(size_t)k*m + q] = s*akp + c*akq;
+                }
+                for (unsigned k=0; k < m; ++k) { // a = J^T a
+                    double apk = a[(size_t)p*m + k], aqk = a[(size_t)q*m + k];
+                    a[(size_t)p*m + k] = c*apk - s*aqk;
+                    a[(size_t)q*m + k] = s*apk + c*aqk;
+                }
+                for (unsigned k=0; k < m; ++k) {
+                    double vkp = v[(size_t)k*m + p], vkq = v[(size_t)k*m + q];
+                    v[(size_t)k*m + p] = c*vkp - s*vkq;
+                    v[(size_t)k*m + q] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+
+    evals.resize(m);
+    for (unsigned i=0; i < m; ++i) evals[i] = a[(size_t)i*m + i];
+}
+
+/**
+ * Orthonormalizes the \c m columns of the \c D x \c m matrix \c q in
+ * place (modified Gram-Schmidt). A column that vanishes is replaced by
+ * a random one.
+ */
+inline void
+orthonormalize(std::vector<double>& q, unsigned D, unsigned m, rk_state* state)
+{
+    std::vector<double> col(D);
+    for (unsigned j=0; j < m; ++j) {
+        for (unsigned attempt=0; ; ++attempt) {
+            for (unsigned d=0; d < D; ++d) col[d] = q[(size_t)d*m + j];
+            for (unsigned k=0; k < j; ++k) {
+                double r = 0;
+                for (unsigned d=0; d < D; ++d) r += q[(size_t)d*m + k]*col[d];
+                for (unsigned d=0; d < D; ++d) col[d] -= r*q[(size_t)d*m + k];
+            }
+            double norm = 0;
+            for (unsigned d=0; d < D; ++d) norm += col[d]*col[d];
+            norm = sqrt(norm);
+            if (norm > 1e-10 || attempt == 4) {
+                for (unsigned d=0; d < D; ++d) q[(size_t)d*m + j] = norm > 0 ? col[d]/norm : 0;
+                break;
+            }
+            for (unsigned d=0; d < D; ++d) q[(size_t)d*m + j] = rk_gauss(state);
+        }
+    }
+}
+
+struct covariance_ctx
+{
+    const double* bt; // D x nrows, a block of centred rows transposed.
+    unsigned nrows;
+    unsigned D;
+    double* cov;      // Upper triangle accumulated.
+};
+
+inline void
+covariance_range(void* arg, size_t begin, size_t end)
+{
+    covariance_ctx* ctx = (covariance_ctx*)arg;
+    for (size_t i=begin; i < end; ++i) {
+        const double* bi = ctx->bt + i*ctx->nrows;
+        double* ci = ctx->cov + i*ctx->D;
+        for (unsigned j=(unsigned)i; j < ctx->D; ++j) ci[j] += dot_pd(bi, ctx->bt + (size_t)j*ctx->nrows, ctx->nrows);
+    }
+}
+
+struct multiply_ctx
+{
+    const double* cov; // D x D
+    const double* q;   // D x m
+    double* z;         // D x m
+    unsigned D, m;
+};
+
+inline void
+multiply_range(void* arg, size_t begin, size_t end)
+{
+    multiply_ctx* ctx = (multiply_ctx*)arg;
+    std::vector<double> col(ctx->D);
+    for (size_t j=begin; j < end; ++j) {
+        for (unsigned d=0; d < ctx->D; ++d) col[d] = ctx->q[(size_t)d*ctx->m + j];
+        for (unsigned i=0; i < ctx->D; ++i) {
+            ctx->z[(size_t)i*ctx->m + j] = dot_pd(ctx->cov + (size_t)i*ctx->D, &col[0], ctx->D);
+        }
+    }
+}
+
+template<class Float>
+struct project_ctx;
+
+}
+
+/**
+ * A learned projection onto the leading \c d principal components of
+ * \c D dimensional points. Projected points are float whatever the
+ * input type.
+ */
+template<class Float>
+class
+pca
+{
+    unsigned D_, d_;
+    std::vector<float> mean_;
+    std::vector<float> components_; // d x D, row-major, by decreasing variance.
+    std::vector<float> bias_;       // components_ times mean_.
+    std::vector<double> variances_;
+    double total_variance_;
+
+    friend struct pca_internal::project_ctx<Float>;
+
+public:
+    pca() : D_(0), d_(0), total_variance_(0) { }
+
+    /**
+     * Learns the projection from \c nsample of the \c N points in
+     * \c pnts (evenly spaced from a random start; 0 for a default of
+     * max(10000, 10D)).
+     */
+    void
+    train(const Float* pnts, unsigned N, unsigned D, unsigned d, unsigned nsample = 0, unsigned seed = 42)
+    {
+        using namespace pca_internal;
+
+        if (d > D) d = D;
+        D_ = D;
+        d_ = d;
+        rk_state state;
+        rk_seed(seed, &state);
+
+        if (nsample == 0) nsample = std::max(10000u, 10*D);
+        if (nsample > N) nsample = N;
+        size_t step = nsample ? N/nsample : 1;
+        size_t start = step > 1 ? rk_interval(step - 1, &state) : 0;
+
+        std::vector<double> mean(D, 0.0);
+        for (unsigned s=0; s < nsample; ++s) {
+            const Float* row = pnts + (start + s*step)*D;
+            for (unsigned k=0; k < D; ++k) mean[k] += row[k];
+        }
+        for (unsigned k=0; k < D; ++k) mean[k] /= nsample ? nsample : 1;
+
+        // Upper triangle of the covariance, a block of centred rows at
+        // a time, with the rows of C shared out over the pool.
+        std::vector<double> cov((size_t)D*D, 0.0);
+        std::vector<double> bt((size_t)D*block_rows);
+        for (unsigned s0=0; s0 < nsample; s0 += block_rows) {
+            unsigned nrows = std::min(block_rows, nsample - s0);
+            for (unsigned r=0; r < nrows; ++r) {
+                const Float* row = pnts + (start + (size_t)(s0 + r)*step)*D;
+                for (unsigned k=0; k < D; ++k) bt[(size_t)k*nrows + r] = row[k] - mean[k];
+            }
+            covariance_ctx ctx = { &bt[0], nrows, D, &cov[0] };
+            parallel_for(thread_pool::global(), D, 8, &covariance_range, &ctx);
+        }
+        total_variance_ = 0;
+        for (unsigned i=0; i < D; ++i) {
+            for (unsigned j=i; j < D; ++j) {
+                cov[(size_t)i*D + j] /= nsample > 1 ? nsample - 1 : 1;
+                cov[(size_t)j*D + i] = cov[(size_t)i*D + j];
+            }
+            total_variance_ += cov[(size_t)i*D + i];
+        }
+
+        // Subspace iteration on a few more columns than needed, then
+        // Rayleigh-Ritz to separate the components within the subspace.
+        unsigned m = std::min(D, d + std::min(10u, d));
+        std::vector<double> q((size_t)D*m), z((size_t)D*m);
+        for (size_t i=0; i < q.size(); ++i) q[i] = rk_gauss(&state);
+        orthonormalize(q, D, m, &state);
+        for (unsigned it=0; it < (m == D ? 1 : 40); ++it) {
+            multiply_ctx ctx = { &cov[0], &q[0], &z[0], D, m };
+            parallel_for(thread_pool::global(), m, 1, &multiply_range, &ctx);
+            q.swap(z);
+            orthonormalize(q, D, m, &state);
+        }
+
+        multiply_ctx ctx = { &cov[0], &q[0], &z[0], D, m };
+        parallel_for(thread_pool::global(), m, 1, &multiply_range, &ctx);
+        std::vector<double> t((size_t)m*m, 0.0), evals, v;
+        for (unsigned a=0; a < m; ++a) {
+            for (unsigned b=0; b < m; ++b) {
+                double sum = 0;
+                for (unsigned k=0; k < D; ++k) sum += q[(size_t)k*m + a]*z[(size_t)k*m + b];
+                t[(size_t)a*m + b] = sum;
+            }
+        }
+        jacobi_eigen(t, m, evals, v);
+
+        std::vector< std::pair<double, unsigned> > order(m);
+        for (unsigned a=0; a < m; ++a) order[a] = std::make_pair(-evals[a], a);
+        std::sort(order.begin(), order.end());
+
+        mean_.assign(mean.begin(), mean.end());
+        components_.assign((size_t)d*D, 0.0f);
+        bias_.assign(d, 0.0f);
+        variances_.resize(d);
+        for (unsigned j=0; j < d; ++j) {
+            unsigned a = order[j].second;
+            variances_[j] = evals[a];
+            double b = 0;
+            for (unsigned k=0; k < D; ++k) {
+                double c = 0;
+                for (unsigned i=0; i < m; ++i) c += q[(size_t)k*m + i]*v[(size_t)i*m + a];
+                components_[(size_t)j*D + k] = (float)c;
+                b += c*mean[k];
+            }
+            bias_[j] = (float)b;
+        }
+    }
+
+    /**
+     * Writes the \c d coordinates of one point to \c out. \c tmp must
+     * have room for D floats when Float isn't float.
+     */
+    void
+    project_one(const Float* x, float* out, float* tmp) const
+    {
+        const float* xf = to_float(x, tmp);
+        unsigned j = 0;
+        for (; j + 4 <= d_; j += 4) { // Four components per pass over x.
+            const float* w0 = &components_[(size_t)j*D_];
+            const float* w1 = w0 + D_;
+            const float* w2 = w1 + D_;
+            const float* w3 = w2 + D_;
+            __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+            unsigned k = 0;
+            for (; k + 4 <= D_; k += 4) {
+                __m128 xv = _mm_loadu_ps(xf + k);
+                a0 = _mm_add_ps(a0, _mm_mul_ps(xv, _mm_loadu_ps(w0 + k)));
+                a1 = _mm_add_ps(a1, _mm_mul_ps(xv, _mm_loadu_ps(w1 + k)));
+                a2 = _mm_add_ps(a2, _mm_mul_ps(xv, _mm_loadu_ps(w2 + k)));
+                a3 = _mm_add_ps(a3, _mm_mul_ps(xv, _mm_loadu_ps(w3 + k)));
+            }
+            float s0 = pca_internal::hsum_ps(a0), s1 = pca_internal::hsum_ps(a1);
+            float s2 = pca_internal::hsum_ps(a2), s3 = pca_internal::hsum_ps(a3);
+            for (; k < D_; ++k) {
+                s0 += xf[k]*w0[k];
+                s1 += xf[k]*w1[k];
+                s2 += xf[k]*w2[k];
+                s3 += xf[k]*w3[k];
+            }
+            out[j] = s0 - bias_[j];
+            out[j+1] = s1 - bias_[j+1];
+            out[j+2] = s2 - bias_[j+2];
+            out[j+3] = s3 - bias_[j+3];
+        }
+        for (; j < d_; ++j) {
+            const float* w = &components_[(size_t)j*D_];
+            __m128 a = _mm_setzero_ps();
+            unsigned k = 0;
+            for (; k + 4 <= D_; k += 4) a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(xf + k), _mm_loadu_ps(w + k)));
+            float s = pca_internal::hsum_ps(a);
+            for (; k < D_; ++k) s += xf[k]*w[k];
+            out[j] = s - bias_[j];
+        }
+    }
+
+    /**
+     * Projects \c N points into \c out (N x d), in blocks of rows on
+     * the library's thread pool.
+     */
+    void project(const Float* pnts, size_t N, float* out) const;
+
+    unsigned input_dims() const { return D_; }
+    unsigned output_dims() const { return d_; }
+    const std::vector<float>& mean() const { return mean_; }
+    const std::vector<float>& components() const { return components_; }
+
+    /**
+     * The variance of the sample along each component kept, and the
+     * fraction of the total those account for.
+     */
+    const std::vector<double>& variances() const { return variances_; }
+
+    double
+    explained_variance() const
+    {
+        double kept = 0;
+        for (size_t j=0; j < variances_.size(); ++j) kept += variances_[j];
+        return total_variance_ > 0 ? kept/total_variance_ : 1.0;
+    }
+
+    size_t
+    size_bytes() const
+    {
+        return (mean_.size() + components_.size() + bias_.size())*sizeof(float) +
+               variances_.size()*sizeof(double);
+    }
+
+private:
+    const float*
+    to_float(const Float* x, float* tmp) const
+    {
+        for (unsigned k=0; k < D_; ++k) tmp[k] = (float)x[k];
+        return tmp;
+    }
+};
+
+template<>
+inline const float*
+pca<float>::to_float(const float* x, float*) const
+{
+    return x;
+}
+
+namespace pca_internal {
+
+template<class Float>
+struct project_ctx
+{
+    const pca<Float>* model;
+    const Float* pnts;
+    size_t N;
+    float* out;
+
+    static void
+    range(void* arg, size_t begin, size_t end)
+    {
+        project_ctx* ctx = (project_ctx*)arg;
+        const pca<Float>& p = *ctx->model;
+        std::vector<float> tmp(p.D_);
+        for (size_t b=begin; b < end; ++b) {
+            size_t n1 = std::min(ctx->N, (b + 1)*project_rows);
+            for (size_t n=b*project_rows; n < n1; ++n) {
+                p.project_one(ctx->pnts + n*p.D_, ctx->out + n*p.d_, &tmp[0]);
+            }
+        }
+    }
+};
+
+}
+
+template<class Float>
+void
+pca<Float>::project(const Float* pnts, size_t N, float* out) const
+{
+    pca_internal::project_ctx<Float> ctx = { this, pnts, N, out };
+    size_t nblocks = (N + pca_internal::project_rows - 1)/pca_internal::project_rows;
+    parallel_for(thread_pool::global(), nblocks, 1, &pca_internal::project_ctx<Float>::range, &ctx);
+}
+
+}
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * Hardware performance counters for the benchmarks, read through
+ * perf_event_open around a region of code on the calling thread.
+ * Counters the kernel or CPU won't give us (no PMU in a VM,
+ * perf_event_paranoid too high, not Linux) read as unavailable rather
+ * than failing the benchmark.
+ */
+#ifndef __FASTANN_PERF_COUNTERS_HPP
+#define __FASTANN_PERF_COUNTERS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace fastann {
+
+class
+perf_counters
+{
+public:
+    enum counter {
+        cycles, instructions, l1d_misses, llc_misses, dtlb_misses, branch_misses,
+        ncounters
+    };
+
+    static const char*
+    name(unsigned c)
+    {
+        static const char* names[ncounters] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses"
+        };
+        return c < ncounters ? names[c] : "";
+    }
+
+private:
+    int fds_[ncounters];
+    double values_[ncounters];
+
+    perf_counters(const perf_counters&);
+    perf_counters& operator=(const perf_counters&);
+
+#ifdef __linux__
+    static int
+    open_counter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // The counters aren't grouped, so the kernel may multiplex them;
+        // the enabled and running times let us scale the counts back up.
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static uint64_t
+    cache_config(uint64_t cache, uint64_t result)
+    {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+    }
+#endif
+
+public:
+    perf_counters()
+    {
+        for (unsigned c=0; c < ncounters; ++c) {
+            fds_[c] = -1;
+            values_[c] = -1.0;
+        }
+#ifdef __linux__
+        fds_[cycles] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds_[instructions] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds_[l1d_misses] = open_counter(PERF_TYPE_HW_CACHE,
+            cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS));
+        fds_[llc_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds_[dtlb_misses] = open_counter(PERF_TYPE_HW_CACHE,
+            cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS));
+        fds_[branch_misses] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    }
+
+    ~perf_counters()
+    {
+        for (unsigned c=0; c < ncounters; ++c) {
+            if (fds_[c] >= 0) close(fds_[c]);
+        }
+    }
+
+    /**
+     * True if at least one counter could be opened.
+     */
+    bool
+    any_available() const
+    {
+        for (unsigned c=0; c < ncounters; ++c) {
+            if (fds_[c] >= 0) return true;
+        }
+        return false;
+    }
+
+    void
+    start()
+    {
+#ifdef __linux__
+        for (unsigned c=0; c < ncounters; ++c) {
+            if (fds_[c] < 0) continue;
+            ioctl(fds_[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds_[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /**
+     * Stops counting and latches the values for get().
+     */
+    void
+    stop()
+    {
+#ifdef __linux__
+        for (unsigned c=0; c < ncounters; ++c) {
+            if (fds_[c] >= 0) ioctl(fds_[c], PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (unsigned c=0; c < ncounters; ++c) {
+            values_[c] = -1.0;
+            uint64_t buf[3]; // value, time enabled, time running
+            if (fds_[c] < 0 || read(fds_[c], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) continue;
+            if (buf[2] == 0) continue; // Never got a hardware slot.
+            values_[c] = (double)buf[0]*((double)buf[1]/buf[2]);
+        }
+#endif
+    }
+
+    /**
+     * The count from the last start()/stop() pair, or a negative value
+     * if the counter is unavailable.
+     */
+    double
+    get(unsigned c) const
+    {
+        return c < ncounters ? values_[c] : -1.0;
+    }
+
+    /**
+     * The count divided by \c n (e.g. distances or queries), or a
+     * negative value if the counter is unavailable.
+     */
+    double
+    per(unsigned c, double n) const
+    {
+        double v = get(c);
+        return v < 0.0 || n <= 0.0 ? -1.0 : v/n;
+    }
+};
+
+}
+
+#endif
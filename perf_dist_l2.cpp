@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include "dist_l2_funcs.hpp"
+#include "perf_counters.hpp"
 #include "rand_point_gen.hpp"
 
 namespace fastann {
@@ -41,21 +42,39 @@ double
 time_routine(AccumFloat dummy,
              const Float* pnts,
              unsigned N, unsigned D,
-             Func func)
+             Func func, perf_counters* pc = 0)
 {
     AccumFloat* dm = new AccumFloat[N*N];
 
+    if (pc) pc->start();
     uint64_t t1 = rdtsc();
     compute_distance_matrix(func, pnts, N, D, dm);
     compute_distance_matrix(func, pnts, N, D, dm);
     compute_distance_matrix(func, pnts, N, D, dm);
     uint64_t t2 = rdtsc();
+    if (pc) pc->stop();
 
     delete[] dm;
 
     return ((double)(t2 - t1)/(3.0 * N * N * D));
 }
 
+/**
+ * Prints one row: rdtsc ticks per dimension and against the scalar
+ * baseline, then the hardware counters per distance computed.
+ */
+void
+print_row(int N, int D, const char* name, double dt, double bl, const perf_counters& pc)
+{
+    printf("%10d %10d %30s %10.2f %10.2f", N, D, name, dt, dt/bl);
+    for (unsigned c=0; c < perf_counters::ncounters; ++c) {
+        double v = pc.per(c, 3.0*N*N);
+        if (v < 0.0) printf(" %10s", "-");
+        else printf(" %10.2f", v);
+    }
+    printf("\n");
+}
+
 struct cl2func_name_pair
 {
     cl2func func;
@@ -75,7 +94,7 @@ struct dl2func_name_pair
 };
 
 void
-perf(int N, int D)
+perf(int N, int D, perf_counters& pc)
 {
     static const cl2func_name_pair cfuncs[] = {
         { &cl2s, "cl2s" },
@@ -106,7 +125,7 @@ perf(int N, int D)
     double* pnts_d;
 
     // Arrays of points
-    pnts_d = gen_unit_random<double>(N, D);
+    pnts_d = gen_unit_random<double>(N, D, 42);
     pnts_s = new float[N*D];
     pnts_uc = new unsigned char[N*D];
     
@@ -119,20 +138,20 @@ perf(int N, int D)
 
     // UC
     for (size_t i=0; i < sizeof(cfuncs)/sizeof(cl2func_name_pair); ++i) {
-        double dt = time_routine((unsigned)0, pnts_uc, N, D, cfuncs[i].func);
-        printf("%10d %10d %30s %10.2f %10.2f\n", N, D, cfuncs[i].name, dt, dt/uc_bl);
+        double dt = time_routine((unsigned)0, pnts_uc, N, D, cfuncs[i].func, &pc);
+        print_row(N, D, cfuncs[i].name, dt, uc_bl, pc);
     }
     
     // S
     for (size_t i=0; i < sizeof(sfuncs)/sizeof(sl2func_name_pair); ++i) {
-        double dt = time_routine(0.0f, pnts_s, N, D, sfuncs[i].func);
-        printf("%10d %10d %30s %10.2f %10.2f\n", N, D, sfuncs[i].name, dt, dt/s_bl);
+        double dt = time_routine(0.0f, pnts_s, N, D, sfuncs[i].func, &pc);
+        print_row(N, D, sfuncs[i].name, dt, s_bl, pc);
     }
     
     // D
     for (size_t i=0; i < sizeof(dfuncs)/sizeof(dl2func_name_pair); ++i) {
-        double dt = time_routine(0.0, pnts_d, N, D, dfuncs[i].func);
-        printf("%10d %10d %30s %10.2f %10.2f\n", N, D, dfuncs[i].name, dt, dt/d_bl);
+        double dt = time_routine(0.0, pnts_d, N, D, dfuncs[i].func, &pc);
+        print_row(N, D, dfuncs[i].name, dt, d_bl, pc);
     }
 
     delete[] pnts_d;
@@ -145,12 +164,21 @@ perf(int N, int D)
 int
 main()
 {
+    fastann::perf_counters pc;
+    if (!pc.any_available()) fprintf(stderr, "perf_dist_l2: no hardware counters (check perf_event_paranoid)\n");
+
+    printf("%10s %10s %30s %10s %10s", "N", "D", "routine", "tsc/dim", "vs scalar");
+    for (unsigned c=0; c < fastann::perf_counters::ncounters; ++c) {
+        printf(" %10.10s", fastann::perf_counters::name(c));
+    }
+    printf("\n");
+
     static const int N_D_pairs[][2] =
     {   {500, 16}, {500, 32}, {500, 64},
         {500, 128}, {500, 256} };
 
    for (size_t i=0; i < sizeof(N_D_pairs)/sizeof(int[2]); ++i) {
-       fastann::perf(N_D_pairs[i][0], N_D_pairs[i][1]);
+       fastann::perf(N_D_pairs[i][0], N_D_pairs[i][1], pc);
    }
 
    return 0;
@@ -0,0 +1,313 @@
+/**
+ * perf_kdtree: build and search microbenchmarks for nn_kdtree on the
+ * synthetic generators in rand_point_gen.hpp.
+ *
+ *   perf_kdtree [-g mixture,sift] [-N 10000,100000] [-D 32,128] [-t 1,4,8]
+ *               [-c 64,768] [-k 10] [-Q 1000] [-j 1,4] [-o out.json]
+ *               [-b baseline.json [-r 0.10]]
+ *
+ * Generators are unit, mixture, lowdim, heavy and dup (float) and sift
+ * (unsigned char, always 128 dimensional). Each JSON row, one per
+ * line, is keyed by "name" and reports build time, tree memory,
+ * single query latency percentiles and batch QPS per thread count.
+ * With -b every row is compared with the row of the same name in an
+ * earlier output; build time, p50 latency or QPS more than -r worse
+ * is reported and makes the exit status 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "fastann.hpp"
+#include "nn_kdtree.hpp"
+#include "rand_point_gen.hpp"
+
+namespace {
+
+using namespace fastann::bench;
+
+struct options
+{
+    std::vector<std::string> gens;
+    std::vector<unsigned> Ns, Ds, ntrees, nchecks, threads;
+    unsigned K, NQ;
+    std::string out_path, baseline_path;
+    double tolerance;
+};
+
+struct result
+{
+    std::string name;
+    std::string line; // The JSON row.
+    double build_s, p50_us, qps_1t;
+};
+
+/**
+ * Bytes held by the pointer based trees, and by the same forest in the
+ * flat layout used for mapped files.
+ */
+template<class Float>
+void
+tree_bytes(const Float* pnts, unsigned N, unsigned D, unsigned ntrees, size_t* tree, size_t* flat)
+{
+    typedef typename fastann::nn_kdtree_internal::kdtree_node<Float>::DiscFloat DiscFloat;
+
+    fastann::nn_kdtree<Float> kdt(pnts, N, D, ntrees);
+    std::vector< fastann::nn_kdtree_internal::flat_node<DiscFloat> > nodes;
+    std::vector<uint32_t> leaf_inds, roots;
+    kdt.flatten(nodes, leaf_inds, roots);
+
+    fastann::memory_breakdown mem = kdt.memory_usage();
+    *tree = mem.nodes + mem.leaf_indices;
+    *flat = nodes.size()*sizeof(nodes[0]) + leaf_inds.size()*sizeof(uint32_t);
+}
+
+template<class Float>
+void
+run_case(const options& opt, const char* gen, const Float* pnts, unsigned N, unsigned D,
+         const Float* qus, unsigned NQ, unsigned ntrees, std::vector<result>& results)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type accum_float_type;
+    unsigned K = opt.K;
+
+    size_t tree = 0, flat = 0;
+    tree_bytes(pnts, N, D, ntrees, &tree, &flat);
+
+    for (size_t c=0; c < opt.nchecks.size(); ++c) {
+        unsigned nchecks = opt.nchecks[c];
+
+        double t0 = now();
+        fastann::nn_obj<Float>* nno = fastann::nn_obj_build_kdtree(pnts, N, D, ntrees, nchecks);
+        double build_s = now() - t0;
+
+        std::vector<unsigned> argmins((size_t)NQ*K);
+        std::vector<accum_float_type> mins((size_t)NQ*K);
+        std::vector<double> lat(NQ);
+
+        t0 = now();
+        for (unsigned n=0; n < NQ; ++n) {
+            double tq = now();
+            nno->search_knn(qus + (size_t)n*D, 1, K, &argmins[(size_t)n*K], &mins[(size_t)n*K]);
+            lat[n] = now() - tq;
+        }
+        double qps_1t = NQ/(now() - t0);
+        std::sort(lat.begin(), lat.end());
+
+        char buf[512];
+        result r;
+        snprintf(buf, sizeof(buf), "%s/%u/%u/%u/%u", gen, N, D, ntrees, nchecks);
+        r.name = buf;
+        r.build_s = build_s;
+        r.p50_us = 1e6*lat[(size_t)(0.50*(NQ - 1))];
+        r.qps_1t = qps_1t;
+
+        snprintf(buf, sizeof(buf),
+                 "{\"name\": \"%s\", \"gen\": \"%s\", \"N\": %u, \"D\": %u, \"ntrees\": %u, \"nchecks\": %u, "
+                 "\"K\": %u, \"build_s\": %.6f, \"tree_bytes\": %lu, \"flat_bytes\": %lu, "
+                 "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"qps_1t\": %.2f, \"qps_mt\": {",
+                 r.name.c_str(), gen, N, D, ntrees, nchecks, K, build_s,
+                 (unsigned long)tree, (unsigned long)flat, r.p50_us,
+                 1e6*lat[(size_t)(0.90*(NQ - 1))], 1e6*lat[(size_t)(0.99*(NQ - 1))], qps_1t);
+        r.line = buf;
+
+        // Batch throughput, the queries split evenly over T threads.
+        for (size_t j=0; j < opt.threads.size(); ++j) {
+            unsigned T = std::max(1u, opt.threads[j]);
+            double qps = search_qps(nno, qus, NQ, D, K, T, &argmins[0], &mins[0]);
+            snprintf(buf, sizeof(buf), "%s\"%u\": %.2f", j ? ", " : "", T, qps);
+            r.line += buf;
+        }
+        r.line += "}}";
+
+        delete nno;
+
+        fprintf(stderr, "%-28s build %.3fs, p50 %.1fus, %.0f QPS\n",
+                r.name.c_str(), r.build_s, r.p50_us, r.qps_1t);
+        results.push_back(r);
+    }
+}
+
+/**
+ * Generates N + NQ rows with \c gen; the last NQ are the queries.
+ */
+float*
+generate(const std::string& gen, unsigned N, unsigned D, unsigned seed)
+{
+    if (gen == "unit") return fastann::gen_unit_random<float>(N, D, seed);
+    if (gen == "mixture") return fastann::gen_gaussian_mixture<float>(N, D, 100, 0.05, seed);
+    if (gen == "lowdim") return fastann::gen_low_intrinsic_dim<float>(N, D, 8, 0.01, seed);
+    if (gen == "heavy") return fastann::gen_heavy_tailed<float>(N, D, 2.0, seed);
+    if (gen == "dup") return fastann::gen_duplicate_heavy<float>(N, D, N/20 + 1, 0.001, seed);
+    return 0;
+}
+
+template<class Float>
+void
+run_gen(const options& opt, const char* gen, Float* all, unsigned N, unsigned D,
+        std::vector<result>& results)
+{
+    for (size_t t=0; t < opt.ntrees.size(); ++t) {
+        run_case(opt, gen, all, N, D, all + (size_t)N*D, opt.NQ, opt.ntrees[t], results);
+    }
+    delete[] all;
+}
+
+/**
+ * The number following "key": in a JSON row, or -1.
+ */
+double
+json_number(const std::string& line, const char* key)
+{
+    std::string k = std::string("\"") + key + "\": ";
+    size_t pos = line.find(k);
+    return pos == std::string::npos ? -1.0 : atof(line.c_str() + pos + k.size());
+}
+
+std::string
+json_name(const std::string& line)
+{
+    static const char key[] = "\"name\": \"";
+    size_t pos = line.find(key);
+    if (pos == std::string::npos) return "";
+    pos += sizeof(key) - 1;
+    return line.substr(pos, line.find('"', pos) - pos);
+}
+
+/**
+ * Returns the number of rows more than opt.tolerance worse than the
+ * baseline, or -1 if it can't be read.
+ */
+int
+compare_baseline(const options& opt, const std::vector<result>& results)
+{
+    FILE* fp = fopen(opt.baseline_path.c_str(), "r");
+    if (!fp) return -1;
+
+    std::map<std::string, std::string> base;
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), fp)) {
+        std::string line(buf);
+        std::string name = json_name(line);
+        if (!name.empty()) base[name] = line;
+    }
+    fclose(fp);
+
+    int nworse = 0;
+    double tol = opt.tolerance;
+    for (size_t i=0; i < results.size(); ++i) {
+        const result& r = results[i];
+        std::map<std::string, std::string>::const_iterator it = base.find(r.name);
+        if (it == base.end()) continue;
+
+        double b_build = json_number(it->second, "build_s");
+        double b_p50 = json_number(it->second, "p50_us");
+        double b_qps = json_number(it->second, "qps_1t");
+        bool worse = (b_build > 0.0 && r.build_s > b_build*(1.0 + tol))
+                  || (b_p50 > 0.0 && r.p50_us > b_p50*(1.0 + tol))
+                  || (b_qps > 0.0 && r.qps_1t < b_qps*(1.0 - tol));
+        fprintf(stderr, "%-28s build x%.2f, p50 x%.2f, QPS x%.2f%s\n", r.name.c_str(),
+                b_build > 0.0 ? r.build_s/b_build : 0.0, b_p50 > 0.0 ? r.p50_us/b_p50 : 0.0,
+                b_qps > 0.0 ? r.qps_1t/b_qps : 0.0, worse ? "  REGRESSED" : "");
+        nworse += worse;
+    }
+    return nworse;
+}
+
+void
+usage()
+{
+    fprintf(stderr, "usage: perf_kdtree [-g unit,mixture,lowdim,heavy,dup,sift] [-N n,...] [-D d,...]\n"
+                    "                   [-t ntrees,...] [-c nchecks,...] [-k K] [-Q nqueries]\n"
+                    "                   [-j threads,...] [-o out.json] [-b baseline.json [-r tolerance]]\n"
+                    "sift is always 128 dimensional and ignores -D.\n");
+    exit(2);
+}
+
+}
+
+int
+main(int argc, char** argv)
+{
+    options opt;
+    opt.gens = parse_names("mixture,sift");
+    opt.Ns = parse_list("10000,100000");
+    opt.Ds = parse_list("32,128");
+    opt.ntrees = parse_list("1,4,8");
+    opt.nchecks = parse_list("64,768");
+    opt.threads = parse_list("1,4");
+    opt.K = 10;
+    opt.NQ = 1000;
+    opt.tolerance = 0.10;
+
+    int c;
+    while ((c = getopt(argc, argv, "g:N:D:t:c:k:Q:j:o:b:r:")) != -1) {
+        switch (c) {
+            case 'g': opt.gens = parse_names(optarg); break;
+            case 'N': opt.Ns = parse_list(optarg); break;
+            case 'D': opt.Ds = parse_list(optarg); break;
+            case 't': opt.ntrees = parse_list(optarg); break;
+            case 'c': opt.nchecks = parse_list(optarg); break;
+            case 'k': opt.K = atoi(optarg); break;
+            case 'Q': opt.NQ = atoi(optarg); break;
+            case 'j': opt.threads = parse_list(optarg); break;
+            case 'o': opt.out_path = optarg; break;
+            case 'b': opt.baseline_path = optarg; break;
+            case 'r': opt.tolerance = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (opt.K == 0 || opt.NQ == 0) usage();
+
+    std::vector<result> results;
+    for (size_t g=0; g < opt.gens.size(); ++g) {
+        const std::string& gen = opt.gens[g];
+        for (size_t n=0; n < opt.Ns.size(); ++n) {
+            unsigned N = opt.Ns[n];
+            if (gen == "sift") {
+                if (n == 0 && (opt.Ds.size() != 1 || opt.Ds[0] != fastann::gen_sift_model::D)) {
+                    fprintf(stderr, "perf_kdtree: sift is %u dimensional, ignoring -D\n", fastann::gen_sift_model::D);
+                }
+                run_gen(opt, gen.c_str(), fastann::gen_sift_like(N + opt.NQ, 200, 42), N, fastann::gen_sift_model::D, results);
+                continue;
+            }
+            for (size_t d=0; d < opt.Ds.size(); ++d) {
+                float* all = generate(gen, N + opt.NQ, opt.Ds[d], 42);
+                if (!all) {
+                    fprintf(stderr, "perf_kdtree: unknown generator %s\n", gen.c_str());
+                    return 2;
+                }
+                run_gen(opt, gen.c_str(), all, N, opt.Ds[d], results);
+            }
+        }
+    }
+
+    FILE* fp = opt.out_path.empty() ? stdout : fopen(opt.out_path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "perf_kdtree: can't write %s\n", opt.out_path.c_str());
+        return 1;
+    }
+    fprintf(fp, "[\n");
+    for (size_t i=0; i < results.size(); ++i) {
+        fprintf(fp, "  %s%s\n", results[i].line.c_str(), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "]\n");
+    if (fp != stdout) fclose(fp);
+
+    if (!opt.baseline_path.empty()) {
+        int nworse = compare_baseline(opt, results);
+        if (nworse < 0) {
+            fprintf(stderr, "perf_kdtree: can't read baseline %s\n", opt.baseline_path.c_str());
+            return 1;
+        }
+        if (nworse) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * Storage for points owned by an index, as opposed to the borrowed
+ * \c const \c Float* that the caller must keep alive.
+ */
+#ifndef __FASTANN_POINT_STORE_HPP
+#define __FASTANN_POINT_STORE_HPP
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "allocator.hpp"
+#include "epoch.hpp"
+
+namespace fastann {
+
+template<class Float>
+class
+point_store
+{
+    allocator* alloc_;
+    Float* pnts_;
+    size_t npoints_;
+    unsigned ndims_;
+
+    point_store(const point_store&);
+    point_store& operator=(const point_store&);
+
+public:
+    static const size_t alignment = 64; // A cache line.
+
+    explicit point_store(allocator& alloc = default_allocator())
+     : alloc_(&alloc), pnts_(0), npoints_(0), ndims_(0)
+    { }
+
+    ~point_store() { clear(); }
+
+    /**
+     * Copies \c N points of dimension \c D from \c pnts. If \c order
+     * is given, row \c n of the store is row \c order[n] of \c pnts.
+     */
+    void
+    assign(const Float* pnts, unsigned N, unsigned D, const unsigned* order = 0)
+    {
+        clear();
+
+        size_t sz = (size_t)N*D*sizeof(Float);
+        pnts_ = (Float*)alloc_->allocate(sz, alignment);
+        npoints_ = N;
+        ndims_ = D;
+
+        if (!order) {
+            memcpy(pnts_, pnts, sz);
+        }
+        else {
+            for (size_t n=0; n < N; ++n) {
+                memcpy(pnts_ + n*D, pnts + (size_t)order[n]*D, D*sizeof(Float));
+            }
+        }
+    }
+
+    void
+    clear()
+    {
+        if (pnts_) alloc_->deallocate(pnts_, size_bytes());
+        pnts_ = 0;
+        npoints_ = 0;
+    }
+
+    const Float* data() const { return pnts_; }
+    size_t npoints() const { return npoints_; }
+    unsigned ndims() const { return ndims_; }
+    size_t size_bytes() const { return npoints_*ndims_*sizeof(Float); }
+};
+
+/**
+ * Rows that one writer appends to while readers use them. A full
+ * buffer is replaced by a copy twice the size and the old one retired
+ * to an epoch_domain, so a reader's data() stays valid while it is in
+ * the domain. The store may start out borrowing the caller's rows,
+ * which are left alone once the first append copies them.
+ */
+template<class T>
+class
+append_store
+{
+    allocator* alloc_;
+    T* data_;
+    size_t size_;     // Rows written.
+    size_t capacity_; // Rows that fit, 0 while borrowing.
+    unsigned width_;
+
+    append_store(const append_store&);
+    append_store& operator=(const append_store&);
+
+    size_t row_bytes() const { return width_*sizeof(T); }
+
+public:
+    static const size_t alignment = 64;
+
+    append_store(allocator& alloc, unsigned width)
+     : alloc_(&alloc), data_(0), size_(0), capacity_(0), width_(width)
+    { }
+
+    ~append_store()
+    {
+        if (capacity_) alloc_->deallocate(data_, capacity_*row_bytes());
+    }
+
+    /**
+     * Borrows \c N rows at \c rows until the first append. Only before
+     * any reader can see the store.
+     */
+    void
+    borrow(const T* rows, size_t N)
+    {
+        data_ = const_cast<T*>(rows);
+        size_ = N;
+    }
+
+    /**
+     * Copies \c N rows from \c rows, row \c n being row \c order[n] if
+     * \c order is given. Only before any reader can see the store.
+     */
+    template<class Index>
+    void
+    assign(const T* rows, size_t N, const Index* order)
+    {
+        T* data = (T*)alloc_->allocate(N*row_bytes(), alignment);
+        if (capacity_) alloc_->deallocate(data_, capacity_*row_bytes());
+        data_ = data;
+        size_ = capacity_ = N;
+
+        if (!order) {
+            memcpy(data_, rows, N*row_bytes());
+        }
+        else {
+            for (size_t n=0; n < N; ++n) {
+                memcpy(data_ + n*width_, rows + (size_t)order[n]*width_, row_bytes());
+            }
+        }
+    }
+
+    void assign(const T* rows, size_t N) { assign(rows, N, (const unsigned*)0); }
+
+    /**
+     * Makes room for \c N rows in all, so that appending up to there
+     * can't throw. Throws std::bad_alloc, leaving the store as it was.
+     */
+    void
+    reserve(size_t N, epoch_domain& ep)
+    {
+        if (N <= capacity_) return;
+        size_t cap = std::max(std::max(2*capacity_, N), (size_t)64);
+        T* data = (T*)alloc_->allocate(cap*row_bytes(), alignment);
+        if (size_) memcpy(data, data_, size_*row_bytes());
+        T* old = data_;
+        __atomic_store_n(&data_, data, __ATOMIC_RELEASE);
+        if (capacity_) ep.retire(old, *alloc_, capacity_*row_bytes());
+        capacity_ = cap;
+    }
+
+    /**
+     * Appends \c N rows. Readers only see them once the caller
+     * publishes a row count that covers them.
+     */
+    void
+    append(const T* rows, size_t N, epoch_domain& ep)
+    {
+        reserve(size_ + N, ep);
+        memcpy(data_ + size_*width_, rows, N*row_bytes());
+        size_ += N;
+    }
+
+    /**
+     * The rows as of now; safe from any thread.
+     */
+    const T* data() const { return __atomic_load_n(&data_, __ATOMIC_ACQUIRE); }
+
+    size_t size() const { return size_; }
+
+    /**
+     * The bytes held, 0 while borrowing.
+     */
+    size_t size_bytes() const { return capacity_*row_bytes(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,327 @@
+/**
+ * A cache of search results in front of any nn_obj, for traffic that
+ * repeats the same (or nearly the same) queries. Queries are keyed on
+ * their bytes or, with a tolerance, on the vector quantized to a grid
+ * of that spacing; a hit copies the stored answer and never reaches
+ * the index. Entries are evicted by CLOCK within lock striped shards.
+ */
+#ifndef __FASTANN_QUERY_CACHE_HPP
+#define __FASTANN_QUERY_CACHE_HPP
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "fastann.hpp"
+
+namespace fastann {
+
+/**
+ * Counted since construction or reset_cache_stats().
+ */
+struct query_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    double hit_rate() const { return hits + misses ? (double)hits/(hits + misses) : 0.0; }
+};
+
+template<class Float>
+class
+query_cache : public nn_obj<Float>
+{
+public:
+    typedef typename nn_obj<Float>::float_type float_type;
+    typedef typename nn_obj<Float>::accum_float_type accum_float_type;
+
+    static const unsigned nshards = 16;
+
+private:
+    struct entry
+    {
+        uint64_t hash;
+        bool used;
+        bool referenced; // Cleared as the clock hand passes, set on a hit.
+        std::vector<char> key;
+        std::vector<unsigned> argmins;
+        std::vector<accum_float_type> mins;
+    };
+
+    struct
+    shard
+    {
+        pthread_mutex_t mutex;
+        std::vector<entry> entries;
+        std::map<uint64_t, size_t> by_hash;
+        size_t hand;
+    };
+
+    nn_obj<Float>* nno_;
+    double tolerance_;
+    size_t key_bytes_;
+    mutable shard shards_[nshards];
+    mutable query_cache_stats stats_;
+    uint64_t generation_; // Bumped by clear(), so racing searches don't refill.
+
+    query_cache(const query_cache&);
+    query_cache& operator=(const query_cache&);
+
+    struct
+    lock
+    {
+        pthread_mutex_t* m;
+        explicit lock(pthread_mutex_t* mm) : m(mm) { pthread_mutex_lock(m); }
+        ~lock() { pthread_mutex_unlock(m); }
+    };
+
+    /**
+     * The bytes the query is looked up by: the query itself, or its
+     * grid cell.
+     */
+    void
+    make_key(const Float* qu, char* key) const
+    {
+        unsigned D = nno_->ndims();
+        if (tolerance_ <= 0) {
+            memcpy(key, qu, D*sizeof(Float));
+            return;
+        }
+        for (unsigned d=0; d < D; ++d) {
+            int32_t c = (int32_t)floor(qu[d]/tolerance_ + 0.5);
+            memcpy(key + d*sizeof(int32_t), &c, sizeof(c));
+        }
+    }
+
+    /**
+     * FNV-1a.
+     */
+    static uint64_t
+    hash_key(const char* key, size_t len)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (size_t i=0; i < len; ++i) {
+            h ^= (unsigned char)key[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    shard& shard_of(uint64_t h) const { return shards_[(h >> 32) % nshards]; }
+
+    /**
+     * Copies a cached answer with at least \c K neighbours.
+     */
+    bool
+    lookup(const char* key, uint64_t h, unsigned K, unsigned* argmins, accum_float_type* mins) const
+    {
+        shard& s = shard_of(h);
+        lock l(&s.mutex);
+        typename std::map<uint64_t, size_t>::const_iterator it = s.by_hash.find(h);
+        if (it == s.by_hash.end()) return false;
+        entry& e = s.entries[it->second];
+        if (e.argmins.size() < K || memcmp(&e.key[0], key, key_bytes_)) return false;
+        std::copy(e.argmins.begin(), e.argmins.begin() + K, argmins);
+        std::copy(e.mins.begin(), e.mins.begin() + K, mins);
+        e.referenced = true;
+        return true;
+    }
+
+    void
+    insert(const char* key, uint64_t h, unsigned K, const unsigned* argmins, const accum_float_type* mins,
+           uint64_t generation) const
+    {
+        shard& s = shard_of(h);
+        if (s.entries.empty()) return;
+        lock l(&s.mutex);
+        if (*(volatile uint64_t*)&generation_ != generation) return;
+
+        typename std::map<uint64_t, size_t>::iterator it = s.by_hash.find(h);
+        size_t victim;
+        if (it != s.by_hash.end()) {
+            victim = it->second; // Same key with fewer neighbours, or a collision.
+        }
+        else {
+            // Second chance: skip entries hit since the hand last passed.
+            while (s.entries[s.hand].used && s.entries[s.hand].referenced) {
+                s.entries[s.hand].referenced = false;
+                s.hand = (s.hand + 1) % s.entries.size();
+            }
+            victim = s.hand;
+            s.hand = (s.hand + 1) % s.entries.size();
+            if (s.entries[victim].used) {
+                s.by_hash.erase(s.entries[victim].hash);
+                __sync_fetch_and_add(&stats_.evictions, 1);
+            }
+            s.by_hash[h] = victim;
+        }
+
+        entry& e = s.entries[victim];
+        e.hash = h;
+        e.used = true;
+        e.referenced = false;
+        e.key.assign(key, key + key_bytes_);
+        e.argmins.assign(argmins, argmins + K);
+        e.mins.assign(mins, mins + K);
+    }
+
+public:
+    /**
+     * Takes ownership of \c nno and caches up to \c capacity answers.
+     * With \c tolerance 0 only queries identical to a cached one hit.
+     * Otherwise queries that round to the same multiples of
+     * \c tolerance in every dimension share an answer (and its
+     * distances, which were to the first of them); two queries closer
+     * than \c tolerance can still fall in neighbouring cells.
+     */
+    query_cache(nn_obj<Float>* nno, size_t capacity, double tolerance = 0)
+     : nno_(nno), tolerance_(tolerance),
+       key_bytes_(nno->ndims()*(tolerance > 0 ? sizeof(int32_t) : sizeof(Float))), generation_(0)
+    {
+        for (unsigned s=0; s < nshards; ++s) {
+            pthread_mutex_init(&shards_[s].mutex, 0);
+            shards_[s].entries.resize(capacity/nshards + (s < capacity % nshards));
+            for (size_t i=0; i < shards_[s].entries.size(); ++i) shards_[s].entries[i].used = false;
+            shards_[s].hand = 0;
+        }
+        reset_cache_stats();
+    }
+
+    virtual ~query_cache()
+    {
+        for (unsigned s=0; s < nshards; ++s) pthread_mutex_destroy(&shards_[s].mutex);
+        delete nno_;
+    }
+
+    /**
+     * Drops every cached answer, for when the index has changed.
+     */
+    void
+    clear()
+    {
+        __sync_fetch_and_add(&generation_, 1);
+        for (unsigned s=0; s < nshards; ++s) {
+            lock l(&shards_[s].mutex);
+            for (size_t i=0; i < shards_[s].entries.size(); ++i) {
+                entry& e = shards_[s].entries[i];
+                e.used = false;
+                std::vector<char>().swap(e.key);
+                std::vector<unsigned>().swap(e.argmins);
+                std::vector<accum_float_type>().swap(e.mins);
+            }
+            shards_[s].by_hash.clear();
+            shards_[s].hand = 0;
+        }
+    }
+
+    query_cache_stats cache_stats() const { return stats_; }
+    void reset_cache_stats() { memset(&stats_, 0, sizeof(stats_)); }
+
+    nn_obj<Float>* index() const { return nno_; }
+
+    virtual void search_nn(const float_type* qus, unsigned N,
+                           unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, 1, argmins, mins, 0);
+    }
+
+    virtual void search_knn(const float_type* qus, unsigned N, unsigned K,
+                            unsigned* argmins, accum_float_type* mins) const
+    {
+        search_knn_stats(qus, N, K, argmins, mins, 0);
+    }
+
+    /**
+     * Misses are passed on to the index as one batch. The stats of a
+     * hit are all zero.
+     */
+    virtual void search_knn_stats(const float_type* qus, unsigned N, unsigned K,
+                                  unsigned* argmins, accum_float_type* mins, search_stats* stats) const
+    {
+        unsigned D = nno_->ndims();
+        uint64_t generation = *(volatile uint64_t*)&generation_;
+        std::vector<char> keys((size_t)N*key_bytes_);
+        std::vector<uint64_t> hashes(N);
+        std::vector<unsigned> missed;
+        for (unsigned n=0; n < N; ++n) {
+            char* key = &keys[(size_t)n*key_bytes_];
+            make_key(qus + (size_t)n*D, key);
+            hashes[n] = hash_key(key, key_bytes_);
+            if (lookup(key, hashes[n], K, argmins + (size_t)n*K, mins + (size_t)n*K)) {
+                if (stats) memset(&stats[n], 0, sizeof(search_stats));
+            }
+            else missed.push_back(n);
+        }
+        __sync_fetch_and_add(&stats_.hits, N - missed.size());
+        __sync_fetch_and_add(&stats_.misses, missed.size());
+        if (missed.empty()) return;
+
+        unsigned M = (unsigned)missed.size();
+        std::vector<Float> mqus((size_t)M*D);
+        for (unsigned m=0; m < M; ++m) {
+            std::copy(qus + (size_t)missed[m]*D, qus + (size_t)(missed[m] + 1)*D, &mqus[(size_t)m*D]);
+        }
+        std::vector<unsigned> margmins((size_t)M*K);
+        std::vector<accum_float_type> mmins((size_t)M*K);
+        std::vector<search_stats> mstats(stats ? M : 0);
+        if (stats) nno_->search_knn_stats(&mqus[0], M, K, &margmins[0], &mmins[0], &mstats[0]);
+        else nno_->search_knn(&mqus[0], M, K, &margmins[0], &mmins[0]);
+
+        for (unsigned m=0; m < M; ++m) {
+            unsigned n = missed[m];
+            std::copy(&margmins[(size_t)m*K], &margmins[(size_t)(m + 1)*K], argmins + (size_t)n*K);
+            std::copy(&mmins[(size_t)m*K], &mmins[(size_t)(m + 1)*K], mins + (size_t)n*K);
+            if (stats) stats[n] = mstats[m];
+            insert(&keys[(size_t)n*key_bytes_], hashes[n], K, &margmins[(size_t)m*K], &mmins[(size_t)m*K],
+                   generation);
+        }
+    }
+
+    virtual const search_stats_summary* stats_summary() const { return nno_->stats_summary(); }
+    virtual void reset_stats() { nno_->reset_stats(); }
+
+    /**
+     * The index's, with the cache's entries in aux.
+     */
+    virtual memory_breakdown
+    memory_usage() const
+    {
+        memory_breakdown mem = nno_->memory_usage();
+        for (unsigned s=0; s < nshards; ++s) {
+            shard& sh = shards_[s];
+            lock l(&sh.mutex);
+            mem.aux += sh.entries.capacity()*sizeof(entry) +
+                       sh.by_hash.size()*(sizeof(uint64_t) + sizeof(size_t) + 4*sizeof(void*));
+            for (size_t i=0; i < sh.entries.size(); ++i) {
+                const entry& e = sh.entries[i];
+                mem.aux += e.key.capacity() + e.argmins.capacity()*sizeof(unsigned) +
+                           e.mins.capacity()*sizeof(accum_float_type);
+            }
+        }
+        return mem;
+    }
+
+    /**
+     * Adds to the index and drops every cached answer, as any of them
+     * may now be wrong.
+     */
+    virtual void
+    add_points(const float_type* pnts, unsigned N)
+    {
+        nno_->add_points(pnts, N);
+        clear();
+    }
+
+    virtual unsigned ndims() const { return nno_->ndims(); }
+    virtual unsigned npoints() const { return nno_->npoints(); }
+};
+
+}
+
+#endif
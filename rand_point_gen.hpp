@@ -5,7 +5,13 @@
 #ifndef __FASTANN_RAND_POINT_GEN_HPP
 #define __FASTANN_RAND_POINT_GEN_HPP
 
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "randomkit.h"
+#include "thread_pool.hpp"
 
 namespace fastann {
 
@@ -24,17 +30,336 @@ gen_unit_random(unsigned N, unsigned D, unsigned seed)
 
     rk_seed(seed, &state);
 
-    ret = new Float[N*D];
+    ret = new Float[(size_t)N*D];
 
     for (unsigned n=0; n < N; ++n) {
         for (unsigned d=0; d < D; ++d) {
-            ret[n*D + d] = (Float)rk_double(&state);
+            ret[(size_t)n*D + d] = (Float)rk_double(&state);
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Converts a generated coordinate to \c Float. Coordinates are roughly
+ * in [0, 1]; for \c unsigned char they are scaled to [0, 255].
+ */
+template<class Float>
+inline Float
+gen_convert(double v)
+{
+    return (Float)v;
+}
+
+template<>
+inline unsigned char
+gen_convert<unsigned char>(double v)
+{
+    v = floor(v*255.0 + 0.5);
+    return (unsigned char)(v < 0.0 ? 0.0 : (v > 255.0 ? 255.0 : v));
+}
+
+/**
+ * Rows are generated in blocks of \c gen_block_rows, each from its own
+ * randomkit state seeded from the block number, so the output depends
+ * only on the seed and not on the number of threads.
+ */
+static const unsigned gen_block_rows = 1024;
+
+template<class Float, class Model>
+struct
+gen_rows_ctx
+{
+    const Model* model;
+    Float* out;
+    unsigned N;
+    unsigned D;
+    unsigned long seed;
+};
+
+template<class Float, class Model>
+void
+gen_rows_range(void* arg, size_t begin, size_t end)
+{
+    const gen_rows_ctx<Float, Model>* ctx = (const gen_rows_ctx<Float, Model>*)arg;
+    std::vector<double> row(ctx->D);
+
+    for (size_t b=begin; b < end; ++b) {
+        rk_state state;
+        rk_seed(ctx->seed + 0x9e3779b9ul*(b + 1), &state);
+
+        size_t n_end = std::min<size_t>((b + 1)*gen_block_rows, ctx->N);
+        for (size_t n=b*gen_block_rows; n < n_end; ++n) {
+            ctx->model->row(&state, &row[0]);
+            for (unsigned d=0; d < ctx->D; ++d) {
+                ctx->out[n*ctx->D + d] = gen_convert<Float>(row[d]);
+            }
         }
     }
+}
+
+/**
+ * Fills a new[] array of \c N rows from \c model in parallel on
+ * \c pool. \c Model::row(rk_state*, double* row) writes one row.
+ */
+template<class Float, class Model>
+Float*
+gen_rows(const Model& model, unsigned N, unsigned D, unsigned seed, thread_pool& pool = thread_pool::global())
+{
+    Float* ret = new Float[(size_t)N*D];
+    gen_rows_ctx<Float, Model> ctx = { &model, ret, N, D, seed };
+    size_t nblocks = ((size_t)N + gen_block_rows - 1)/gen_block_rows;
+
+    parallel_for(pool, nblocks, 1, &gen_rows_range<Float, Model>, &ctx);
 
     return ret;
 }
 
+/**
+ * Cumulative Zipf weights 1/(i+1) for \c n items; picks item i with
+ * probability proportional to its weight.
+ */
+class
+gen_zipf
+{
+    std::vector<double> cum_;
+
+public:
+    gen_zipf(unsigned n)
+     : cum_(n)
+    {
+        double total = 0.0;
+        for (unsigned i=0; i < n; ++i) cum_[i] = (total += 1.0/(i + 1));
+    }
+
+    unsigned
+    pick(rk_state* state) const
+    {
+        double u = rk_double(state)*cum_.back();
+        size_t i = std::upper_bound(cum_.begin(), cum_.end(), u) - cum_.begin();
+        return (unsigned)std::min(i, cum_.size() - 1);
+    }
+};
+
+class
+gen_mixture_model
+{
+    unsigned D_;
+    std::vector<double> centers_;
+    std::vector<double> sigmas_;
+    gen_zipf clusters_;
+
+public:
+    gen_mixture_model(unsigned D, unsigned nclusters, double sigma, unsigned seed)
+     : D_(D), centers_((size_t)nclusters*D), sigmas_(nclusters), clusters_(nclusters)
+    {
+        rk_state state;
+        rk_seed(seed, &state);
+        for (size_t i=0; i < centers_.size(); ++i) centers_[i] = rk_double(&state);
+        for (unsigned c=0; c < nclusters; ++c) sigmas_[c] = sigma*(0.5 + rk_double(&state));
+    }
+
+    void
+    row(rk_state* state, double* out) const
+    {
+        unsigned c = clusters_.pick(state);
+        const double* center = &centers_[(size_t)c*D_];
+        for (unsigned d=0; d < D_; ++d) out[d] = center[d] + sigmas_[c]*rk_gauss(state);
+    }
+};
+
+class
+gen_low_dim_model
+{
+    unsigned D_;
+    unsigned d_;
+    std::vector<double> lin_;   // D x d
+    std::vector<double> curve_; // D x d
+    double noise_;
+
+public:
+    gen_low_dim_model(unsigned D, unsigned intrinsic_dim, double noise, unsigned seed)
+     : D_(D), d_(intrinsic_dim), lin_((size_t)D*intrinsic_dim),
+       curve_((size_t)D*intrinsic_dim), noise_(noise)
+    {
+        rk_state state;
+        rk_seed(seed, &state);
+        double scale = 1.0/sqrt((double)intrinsic_dim);
+        for (size_t i=0; i < lin_.size(); ++i) lin_[i] = scale*rk_gauss(&state);
+        for (size_t i=0; i < curve_.size(); ++i) curve_[i] = scale*rk_gauss(&state);
+    }
+
+    void
+    row(rk_state* state, double* out) const
+    {
+        double z[64];
+        unsigned d_max = std::min(d_, 64u);
+        for (unsigned k=0; k < d_max; ++k) z[k] = rk_gauss(state);
+
+        for (unsigned d=0; d < D_; ++d) {
+            const double* lin = &lin_[(size_t)d*d_];
+            const double* curve = &curve_[(size_t)d*d_];
+            double a = 0.0, b = 0.0;
+            for (unsigned k=0; k < d_max; ++k) {
+                a += lin[k]*z[k];
+                b += curve[k]*z[k];
+            }
+            out[d] = 0.5 + 0.15*(a + 0.5*sin(2.0*b)) + noise_*rk_gauss(state);
+        }
+    }
+};
+
+class
+gen_heavy_tailed_model
+{
+    unsigned D_;
+    double alpha_;
+
+public:
+    gen_heavy_tailed_model(unsigned D, double alpha)
+     : D_(D), alpha_(alpha)
+    { }
+
+    void
+    row(rk_state* state, double* out) const
+    {
+        double s = 0.1*pow(1.0 - rk_double(state), -1.0/alpha_); // Pareto radius.
+        for (unsigned d=0; d < D_; ++d) out[d] = 0.5 + s*rk_gauss(state);
+    }
+};
+
+class
+gen_duplicate_model
+{
+    unsigned D_;
+    std::vector<double> distinct_;
+    gen_zipf picks_;
+    double jitter_;
+
+public:
+    gen_duplicate_model(unsigned D, unsigned ndistinct, double jitter, unsigned seed)
+     : D_(D), distinct_((size_t)ndistinct*D), picks_(ndistinct), jitter_(jitter)
+    {
+        rk_state state;
+        rk_seed(seed, &state);
+        for (size_t i=0; i < distinct_.size(); ++i) distinct_[i] = rk_double(&state);
+    }
+
+    void
+    row(rk_state* state, double* out) const
+    {
+        const double* src = &distinct_[(size_t)picks_.pick(state)*D_];
+        for (unsigned d=0; d < D_; ++d) {
+            out[d] = src[d] + (jitter_ > 0.0 ? jitter_*rk_gauss(state) : 0.0);
+        }
+    }
+};
+
+class
+gen_sift_model
+{
+    std::vector<double> words_; // nwords x 128
+    gen_zipf picks_;
+
+public:
+    static const unsigned D = 128;
+
+    gen_sift_model(unsigned nwords, unsigned seed)
+     : words_((size_t)nwords*D), picks_(nwords)
+    {
+        rk_state state;
+        rk_seed(seed, &state);
+        for (size_t i=0; i < words_.size(); ++i) {
+            // Sparse, skewed gradient histograms: most bins are near zero.
+            double g = rk_gauss(&state);
+            words_[i] = rk_double(&state) < 0.4 ? g*g : 0.0;
+        }
+    }
+
+    void
+    row(rk_state* state, double* out) const
+    {
+        const double* word = &words_[(size_t)picks_.pick(state)*D];
+        double norm = 0.0;
+        for (unsigned d=0; d < D; ++d) {
+            double v = word[d] + 0.3*rk_gauss(state);
+            out[d] = v > 0.0 ? v : 0.0;
+            norm += out[d]*out[d];
+        }
+
+        // Lowe's normalization: unit length, clip at 0.2, unit length
+        // again, then scale by 512 and saturate at 255.
+        double inv = norm > 0.0 ? 1.0/sqrt(norm) : 0.0;
+        norm = 0.0;
+        for (unsigned d=0; d < D; ++d) {
+            out[d] = std::min(out[d]*inv, 0.2);
+            norm += out[d]*out[d];
+        }
+        inv = norm > 0.0 ? 512.0/255.0/sqrt(norm) : 0.0;
+        for (unsigned d=0; d < D; ++d) out[d] = std::min(out[d]*inv, 1.0);
+    }
+};
+
+/**
+ * Generates \c N points from a mixture of \c nclusters Gaussians with
+ * centers in the unit cube. Cluster sizes follow a Zipf law and each
+ * cluster's standard deviation is within a factor of three of
+ * \c sigma, so dense and sparse regions are both present.
+ */
+template<class Float>
+Float*
+gen_gaussian_mixture(unsigned N, unsigned D, unsigned nclusters, double sigma, unsigned seed)
+{
+    return gen_rows<Float>(gen_mixture_model(D, nclusters, sigma, seed), N, D, seed);
+}
+
+/**
+ * Generates \c N points near a curved \c intrinsic_dim dimensional
+ * manifold (at most 64) embedded in \c D dimensions, plus isotropic
+ * noise of standard deviation \c noise.
+ */
+template<class Float>
+Float*
+gen_low_intrinsic_dim(unsigned N, unsigned D, unsigned intrinsic_dim, double noise, unsigned seed)
+{
+    return gen_rows<Float>(gen_low_dim_model(D, intrinsic_dim, noise, seed), N, D, seed);
+}
+
+/**
+ * Generates \c N Gaussian points whose radius is Pareto distributed
+ * with tail index \c alpha, so a few points are far from the rest.
+ */
+template<class Float>
+Float*
+gen_heavy_tailed(unsigned N, unsigned D, double alpha, unsigned seed)
+{
+    return gen_rows<Float>(gen_heavy_tailed_model(D, alpha), N, D, seed);
+}
+
+/**
+ * Generates \c N copies of \c ndistinct random points, chosen with Zipf
+ * frequencies, each perturbed by Gaussian noise of standard deviation
+ * \c jitter (0 gives exact duplicates).
+ */
+template<class Float>
+Float*
+gen_duplicate_heavy(unsigned N, unsigned D, unsigned ndistinct, double jitter, unsigned seed)
+{
+    return gen_rows<Float>(gen_duplicate_model(D, ndistinct, jitter, seed), N, D, seed);
+}
+
+/**
+ * Generates \c N 128 dimensional SIFT-like descriptors around
+ * \c nwords visual words: sparse non-negative histograms with Lowe's
+ * clipping and 8-bit quantization.
+ */
+inline unsigned char*
+gen_sift_like(unsigned N, unsigned nwords, unsigned seed)
+{
+    return gen_rows<unsigned char>(gen_sift_model(nwords, seed), N, gen_sift_model::D, seed);
+}
+
 }
 
 #endif
@@ -0,0 +1,221 @@
+/**
+ * Search instrumentation. The counters are only collected when the
+ * library is built with FASTANN_STATS defined; otherwise every
+ * FASTANN_STAT_* macro compiles to nothing and the structs stay zero.
+ */
+#ifndef __FASTANN_SEARCH_STATS_HPP
+#define __FASTANN_SEARCH_STATS_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+namespace fastann {
+
+/**
+ * Counters for a single query.
+ */
+struct search_stats
+{
+    uint64_t ndists;   // Distance computations.
+    uint64_t nleaves;  // Leaves visited.
+    uint64_t npushes;  // Branch queue pushes.
+    uint64_t npops;    // Branch queue pops.
+    uint64_t max_heap; // Largest branch queue size.
+    uint64_t ntrees;   // Trees descended from the root.
+    uint64_t nseen;    // Points skipped because an earlier tree found them.
+    uint64_t cycles;   // Time stamp counter ticks for the whole query.
+};
+
+/**
+ * Counters aggregated over every query an nn_obj has answered, with
+ * log2 histograms: bucket b counts queries with a value in
+ * [2^(b-1), 2^b), bucket 0 those with a value of 0.
+ */
+struct search_stats_summary
+{
+    static const unsigned nbuckets = 48;
+
+    uint64_t nqueries;
+    search_stats total;
+    uint64_t max_ndists;
+    uint64_t max_cycles;
+    uint64_t ndists_hist[nbuckets];
+    uint64_t cycles_hist[nbuckets];
+
+    search_stats_summary() { clear(); }
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+
+    static unsigned
+    bucket(uint64_t v)
+    {
+        unsigned b = v ? 64 - __builtin_clzll(v) : 0;
+        return b < nbuckets ? b : nbuckets - 1;
+    }
+
+    /**
+     * Adds one query. Not thread safe: searches add to a summary of
+     * their own (see batch_stats_scope) and publish it once.
+     */
+    void
+    add(const search_stats& st)
+    {
+        nqueries++;
+        total.ndists += st.ndists;
+        total.nleaves += st.nleaves;
+        total.npushes += st.npushes;
+        total.npops += st.npops;
+        total.max_heap += st.max_heap;
+        total.ntrees += st.ntrees;
+        total.nseen += st.nseen;
+        total.cycles += st.cycles;
+        ndists_hist[bucket(st.ndists)]++;
+        cycles_hist[bucket(st.cycles)]++;
+        if (st.ndists > max_ndists) max_ndists = st.ndists;
+        if (st.cycles > max_cycles) max_cycles = st.cycles;
+    }
+
+    /**
+     * As merge(), but safe to call from several threads at once. Empty
+     * histogram buckets are skipped, so a batch of similar queries
+     * costs a dozen or so atomic operations in all.
+     */
+    void
+    merge_atomic(const search_stats_summary& o)
+    {
+        if (o.nqueries == 0) return;
+        __sync_fetch_and_add(&nqueries, o.nqueries);
+        __sync_fetch_and_add(&total.ndists, o.total.ndists);
+        __sync_fetch_and_add(&total.nleaves, o.total.nleaves);
+        __sync_fetch_and_add(&total.npushes, o.total.npushes);
+        __sync_fetch_and_add(&total.npops, o.total.npops);
+        __sync_fetch_and_add(&total.max_heap, o.total.max_heap);
+        __sync_fetch_and_add(&total.ntrees, o.total.ntrees);
+        __sync_fetch_and_add(&total.nseen, o.total.nseen);
+        __sync_fetch_and_add(&total.cycles, o.total.cycles);
+        for (unsigned b=0; b < nbuckets; ++b) {
+            if (o.ndists_hist[b]) __sync_fetch_and_add(&ndists_hist[b], o.ndists_hist[b]);
+            if (o.cycles_hist[b]) __sync_fetch_and_add(&cycles_hist[b], o.cycles_hist[b]);
+        }
+
+        uint64_t m = max_ndists;
+        while (o.max_ndists > m && !__sync_bool_compare_and_swap(&max_ndists, m, o.max_ndists)) m = max_ndists;
+        m = max_cycles;
+        while (o.max_cycles > m && !__sync_bool_compare_and_swap(&max_cycles, m, o.max_cycles)) m = max_cycles;
+    }
+
+    /**
+     * Adds everything in \c o. Not atomic: \c o must be quiescent or
+     * a slightly stale result acceptable.
+     */
+    void
+    merge(const search_stats_summary& o)
+    {
+        nqueries += o.nqueries;
+        total.ndists += o.total.ndists;
+        total.nleaves += o.total.nleaves;
+        total.npushes += o.total.npushes;
+        total.npops += o.total.npops;
+        total.max_heap += o.total.max_heap;
+        total.ntrees += o.total.ntrees;
+        total.nseen += o.total.nseen;
+        total.cycles += o.total.cycles;
+        if (o.max_ndists > max_ndists) max_ndists = o.max_ndists;
+        if (o.max_cycles > max_cycles) max_cycles = o.max_cycles;
+        for (unsigned b=0; b < nbuckets; ++b) {
+            ndists_hist[b] += o.ndists_hist[b];
+            cycles_hist[b] += o.cycles_hist[b];
+        }
+    }
+};
+
+inline uint64_t
+stats_rdtsc()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t a, d;
+    asm volatile ("rdtsc" : "=a" (a), "=d" (d));
+    return ((uint64_t)a | (((uint64_t)d)<<32));
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Brackets one call's worth of queries on one thread: their
+ * query_stats_scope add to the summary returned by get(), which is
+ * merged into \c summary once, on destruction, rather than every
+ * query contending for the shared one. A no-op without FASTANN_STATS.
+ */
+class
+batch_stats_scope
+{
+#ifdef FASTANN_STATS
+    search_stats_summary local_;
+    search_stats_summary* summary_;
+
+    batch_stats_scope(const batch_stats_scope&);
+    batch_stats_scope& operator=(const batch_stats_scope&);
+
+public:
+    explicit batch_stats_scope(search_stats_summary* summary) : summary_(summary) { }
+    ~batch_stats_scope() { summary_->merge_atomic(local_); }
+
+    search_stats_summary* get() { return &local_; }
+#else
+public:
+    explicit batch_stats_scope(search_stats_summary*) { }
+
+    search_stats_summary* get() { return 0; }
+#endif
+};
+
+/**
+ * Brackets the search of one query: counters go to the search_stats
+ * returned by get(), and on destruction are copied to \c out (if
+ * given) and added to \c summary, normally a batch_stats_scope's. In
+ * builds without FASTANN_STATS get() returns 0 and only \c out is
+ * touched (zeroed).
+ */
+class
+query_stats_scope
+{
+#ifdef FASTANN_STATS
+    search_stats st_;
+    uint64_t t0_;
+    search_stats* out_;
+    search_stats_summary* summary_;
+
+public:
+    query_stats_scope(search_stats* out, search_stats_summary* summary)
+     : t0_(stats_rdtsc()), out_(out), summary_(summary)
+    { memset(&st_, 0, sizeof(st_)); }
+
+    ~query_stats_scope()
+    {
+        st_.cycles = stats_rdtsc() - t0_;
+        if (out_) *out_ = st_;
+        summary_->add(st_);
+    }
+
+    search_stats* get() { return &st_; }
+#else
+public:
+    query_stats_scope(search_stats* out, search_stats_summary*)
+    { if (out) memset(out, 0, sizeof(*out)); }
+
+    search_stats* get() { return 0; }
+#endif
+};
+
+}
+
+#ifdef FASTANN_STATS
+#define FASTANN_STAT_ADD(st, field, n) do { if (st) (st)->field += (n); } while (0)
+#define FASTANN_STAT_MAX(st, field, v) do { if ((st) && (uint64_t)(v) > (st)->field) (st)->field = (v); } while (0)
+#else
+#define FASTANN_STAT_ADD(st, field, n) do { } while (0)
+#define FASTANN_STAT_MAX(st, field, v) do { } while (0)
+#endif
+
+#endif
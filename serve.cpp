@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "serve.hpp"
+
+namespace fastann {
+
+namespace {
+
+bool
+read_full(int fd, void* buf, size_t sz)
+{
+    char* p = (char*)buf;
+    while (sz) {
+        ssize_t r = read(fd, p, sz);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        sz -= r;
+    }
+    return true;
+}
+
+bool
+write_full(int fd, const void* buf, size_t sz)
+{
+    const char* p = (const char*)buf;
+    while (sz) {
+        ssize_t r = send(fd, p, sz, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        sz -= r;
+    }
+    return true;
+}
+
+bool
+make_address(const char* path, sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+}
+
+struct query_server::request
+{
+    unsigned N;
+    unsigned K;
+    std::vector<float> qus;
+    std::vector<unsigned> argmins;
+    std::vector<float> mins;
+    int status;
+    bool done;
+    timespec arrival;
+};
+
+query_server::query_server(const nn_obj<float>* nno, const char* socket_path,
+                           unsigned max_batch, unsigned max_wait_us, size_t max_results)
+ : nno_(nno), socket_path_(socket_path), max_batch_(std::max(1u, max_batch)),
+   max_wait_us_(max_wait_us), max_results_(max_results), listen_fd_(-1), running_(false),
+   queued_queries_(0), nconnections_(0), nbatches_(0), nqueries_(0)
+{
+    pthread_mutex_init(&mutex_, 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Deadlines use request arrival times.
+    pthread_cond_init(&queue_cond_, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&done_cond_, 0);
+}
+
+query_server::~query_server()
+{
+    stop();
+    pthread_cond_destroy(&done_cond_);
+    pthread_cond_destroy(&queue_cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void
+query_server::start()
+{
+    sockaddr_un addr;
+    if (!make_address(socket_path_.c_str(), &addr)) throw 0;
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) throw 0;
+
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) || listen(listen_fd_, 128)) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        throw 0;
+    }
+
+    running_ = true;
+    pthread_create(&batcher_, 0, &batcher_main, this);
+    pthread_create(&listener_, 0, &listener_main, this);
+}
+
+void
+query_server::stop()
+{
+    pthread_mutex_lock(&mutex_);
+    if (!running_) { pthread_mutex_unlock(&mutex_); return; }
+    running_ = false;
+    pthread_cond_broadcast(&queue_cond_);
+    for (size_t c=0; c < connection_fds_.size(); ++c) shutdown(connection_fds_[c], SHUT_RDWR);
+    pthread_mutex_unlock(&mutex_);
+
+    shutdown(listen_fd_, SHUT_RDWR);
+    pthread_join(listener_, 0);
+    pthread_join(batcher_, 0);
+
+    // No new connections can appear once the listener has exited, and
+    // their sockets are shut down.
+    pthread_mutex_lock(&mutex_);
+    while (nconnections_) pthread_cond_wait(&done_cond_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+    unlink(socket_path_.c_str());
+}
+
+struct connection_arg
+{
+    query_server* server;
+    int fd;
+};
+
+void*
+query_server::listener_main(void* arg)
+{
+    query_server* self = (query_server*)arg;
+    for (;;) {
+        int fd = accept(self->listen_fd_, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // Shut down by stop().
+        }
+
+        pthread_mutex_lock(&self->mutex_);
+        if (!self->running_) {
+            pthread_mutex_unlock(&self->mutex_);
+            close(fd);
+            break;
+        }
+        connection_arg* carg = new connection_arg;
+        carg->server = self;
+        carg->fd = fd;
+        // Detached, so a long running server keeps no thread per closed
+        // connection; stop() waits for nconnections_ to drain instead.
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t th;
+        if (pthread_create(&th, &attr, &connection_main, carg) == 0) {
+            self->nconnections_++;
+            self->connection_fds_.push_back(fd);
+        }
+        else {
+            delete carg;
+            close(fd);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_mutex_unlock(&self->mutex_);
+    }
+    return 0;
+}
+
+void*
+query_server::connection_main(void* arg)
+{
+    connection_arg* carg = (connection_arg*)arg;
+    query_server* self = carg->server;
+    int fd = carg->fd;
+    delete carg;
+
+    self->serve_connection(fd);
+
+    // The last touch of self: once the mutex is released stop() may
+    // return and the server go.
+    pthread_mutex_lock(&self->mutex_);
+    std::vector<int>& fds = self->connection_fds_;
+    fds.erase(std::remove(fds.begin(), fds.end(), fd), fds.end());
+    self->nconnections_--;
+    pthread_cond_broadcast(&self->done_cond_);
+    pthread_mutex_unlock(&self->mutex_);
+    close(fd);
+    return 0;
+}
+
+void
+query_server::serve_connection(int fd)
+{
+    unsigned D = nno_->ndims();
+    request req;
+
+    for (;;) {
+        serve_request_header hdr;
+        if (!read_full(fd, &hdr, sizeof(hdr))) return;
+
+        serve_reply_header rep;
+        rep.nqueries = hdr.nqueries;
+        rep.K = hdr.K;
+
+        if (hdr.magic != serve_request_magic || hdr.ndims != D ||
+            hdr.nqueries > serve_max_request_queries) {
+            rep.status = SERVE_EINVAL;
+            write_full(fd, &rep, sizeof(rep));
+            return; // Can't resynchronise with the stream.
+        }
+
+        req.N = hdr.nqueries;
+        req.K = hdr.K;
+        if (req.N == 0) {
+            rep.status = SERVE_OK;
+            if (!write_full(fd, &rep, sizeof(rep))) return;
+            continue;
+        }
+        try {
+            req.qus.resize((size_t)req.N*D);
+        }
+        catch (std::bad_alloc&) {
+            rep.status = SERVE_ESEARCH;
+            write_full(fd, &rep, sizeof(rep));
+            return; // The queries are left unread.
+        }
+        if (!read_full(fd, &req.qus[0], req.qus.size()*sizeof(float))) return;
+
+        if (req.K == 0 || req.K > nno_->npoints() || (size_t)req.N*req.K > max_results_) {
+            rep.status = SERVE_EINVAL;
+            if (!write_full(fd, &rep, sizeof(rep))) return;
+            continue;
+        }
+
+        try {
+            req.argmins.resize((size_t)req.N*req.K);
+            req.mins.resize((size_t)req.N*req.K);
+        }
+        catch (std::bad_alloc&) {
+            rep.status = SERVE_ESEARCH;
+            if (!write_full(fd, &rep, sizeof(rep))) return;
+            continue;
+        }
+        req.done = false;
+        clock_gettime(CLOCK_MONOTONIC, &req.arrival);
+
+        pthread_mutex_lock(&mutex_);
+        if (!running_) { pthread_mutex_unlock(&mutex_); return; }
+        queue_.push_back(&req);
+        queued_queries_ += req.N;
+        pthread_cond_signal(&queue_cond_);
+        // The batcher completes every queued request, even on stop().
+        while (!req.done) pthread_cond_wait(&done_cond_, &mutex_);
+        pthread_mutex_unlock(&mutex_);
+
+        rep.status = req.status;
+        if (!write_full(fd, &rep, sizeof(rep))) return;
+        if (rep.status == SERVE_OK) {
+            if (!write_full(fd, &req.argmins[0], req.argmins.size()*sizeof(unsigned)) ||
+                !write_full(fd, &req.mins[0], req.mins.size()*sizeof(float))) return;
+        }
+    }
+}
+
+void*
+query_server::batcher_main(void* arg)
+{
+    query_server* self = (query_server*)arg;
+    std::vector<request*> batch;
+
+    pthread_mutex_lock(&self->mutex_);
+    for (;;) {
+        while (self->queue_.empty() && self->running_) {
+            pthread_cond_wait(&self->queue_cond_, &self->mutex_);
+        }
+        if (!self->running_) break;
+
+        // Wait for the batch to fill, but no longer than max_wait_us
+        // after the oldest request arrived.
+        timespec deadline = self->queue_.front()->arrival;
+        deadline.tv_nsec += (long)(self->max_wait_us_ % 1000000)*1000;
+        deadline.tv_sec += self->max_wait_us_/1000000 + deadline.tv_nsec/1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (self->queued_queries_ < self->max_batch_ && self->running_) {
+            if (pthread_cond_timedwait(&self->queue_cond_, &self->mutex_, &deadline) == ETIMEDOUT) break;
+        }
+        if (!self->running_) break;
+
+        // Always take at least one request, however large. The batch's
+        // results are sized by its largest K, so that is capped too.
+        unsigned nbatch = 0, kbatch = 0;
+        batch.clear();
+        while (!self->queue_.empty()) {
+            request* req = self->queue_.front();
+            unsigned k = std::max(kbatch, req->K);
+            if (!batch.empty() && (nbatch + req->N > self->max_batch_ ||
+                                   (size_t)(nbatch + req->N)*k > self->max_results_)) break;
+            self->queue_.pop_front();
+            nbatch += req->N;
+            kbatch = k;
+            batch.push_back(req);
+        }
+        self->queued_queries_ -= nbatch;
+        pthread_mutex_unlock(&self->mutex_);
+
+        self->run_batch(batch);
+
+        pthread_mutex_lock(&self->mutex_);
+        for (size_t b=0; b < batch.size(); ++b) batch[b]->done = true;
+        self->nbatches_++;
+        self->nqueries_ += nbatch;
+        pthread_cond_broadcast(&self->done_cond_);
+    }
+    // Fail whatever is left; nothing more is queued once !running_.
+    for (size_t q=0; q < self->queue_.size(); ++q) {
+        self->queue_[q]->status = SERVE_ESEARCH;
+        self->queue_[q]->done = true;
+    }
+    self->queue_.clear();
+    self->queued_queries_ = 0;
+    pthread_cond_broadcast(&self->done_cond_);
+    pthread_mutex_unlock(&self->mutex_);
+    return 0;
+}
+
+/**
+ * Fails the whole batch, rather than the server, if memory runs out.
+ */
+void
+query_server::run_batch(std::vector<request*>& batch)
+{
+    try {
+        search_batch(batch);
+    }
+    catch (std::bad_alloc&) {
+        for (size_t b=0; b < batch.size(); ++b) batch[b]->status = SERVE_ESEARCH;
+    }
+}
+
+/**
+ * Searches every request in \c batch with one submit_knn call for the
+ * largest K among them. Results are sorted, so smaller K requests take
+ * a prefix of their rows.
+ */
+void
+query_server::search_batch(std::vector<request*>& batch)
+{
+    unsigned D = nno_->ndims();
+    unsigned N = 0;
+    unsigned K = 0;
+    for (size_t b=0; b < batch.size(); ++b) {
+        N += batch[b]->N;
+        K = std::max(K, batch[b]->K);
+    }
+
+    std::vector<float> qus;
+    if (batch.size() > 1) {
+        qus.reserve((size_t)N*D);
+        for (size_t b=0; b < batch.size(); ++b) {
+            qus.insert(qus.end(), batch[b]->qus.begin(), batch[b]->qus.end());
+        }
+    }
+    else {
+        qus.swap(batch[0]->qus);
+    }
+
+    std::vector<unsigned> argmins((size_t)N*K);
+    std::vector<float> mins((size_t)N*K);
+    search_future* fut = nno_->submit_knn(&qus[0], N, K, &argmins[0], &mins[0]);
+    int status = fut->wait() ? SERVE_ESEARCH : SERVE_OK;
+    delete fut;
+
+    size_t row = 0;
+    for (size_t b=0; b < batch.size(); ++b) {
+        request* req = batch[b];
+        req->status = status;
+        for (unsigned n=0; n < req->N; ++n, ++row) {
+            std::copy(&argmins[row*K], &argmins[row*K] + req->K, &req->argmins[(size_t)n*req->K]);
+            std::copy(&mins[row*K], &mins[row*K] + req->K, &req->mins[(size_t)n*req->K]);
+        }
+    }
+}
+
+int
+serve_connect(const char* socket_path)
+{
+    sockaddr_un addr;
+    if (!make_address(socket_path, &addr)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int
+serve_search_knn(int fd, const float* qus, unsigned N, unsigned D, unsigned K,
+                 unsigned* argmins, float* mins)
+{
+    serve_request_header hdr;
+    hdr.magic = serve_request_magic;
+    hdr.nqueries = N;
+    hdr.K = K;
+    hdr.ndims = D;
+    if (!write_full(fd, &hdr, sizeof(hdr)) ||
+        !write_full(fd, qus, (size_t)N*D*sizeof(float))) return -1;
+
+    serve_reply_header rep;
+    if (!read_full(fd, &rep, sizeof(rep))) return -1;
+    if (rep.status != SERVE_OK || N == 0) return rep.status;
+
+    if (!read_full(fd, argmins, (size_t)N*K*sizeof(unsigned)) ||
+        !read_full(fd, mins, (size_t)N*K*sizeof(float))) return -1;
+    return SERVE_OK;
+}
+
+}
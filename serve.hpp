@@ -0,0 +1,127 @@
+/**
+ * A query server that lets many processes on one host share a single
+ * in-memory index over a Unix domain socket. Concurrent requests are
+ * coalesced into batches before being searched.
+ *
+ * Wire format (native endian, one request/reply at a time per
+ * connection):
+ *   request: serve_request_header, then nqueries*ndims floats.
+ *   reply:   serve_reply_header, then nqueries*K unsigned argmins
+ *            and nqueries*K float mins (absent unless status == 0).
+ */
+#ifndef __FASTANN_SERVE_HPP
+#define __FASTANN_SERVE_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "fastann.hpp"
+
+namespace fastann {
+
+static const uint32_t serve_request_magic = 0x514e4146; // "FANQ"
+static const uint32_t serve_max_request_queries = 1u << 20;
+static const size_t serve_default_max_results = 1u << 24; // nqueries*K, per request and per batch.
+
+struct serve_request_header
+{
+    uint32_t magic;
+    uint32_t nqueries;
+    uint32_t K;
+    uint32_t ndims;
+};
+
+enum serve_status
+{
+    SERVE_OK = 0,
+    SERVE_EINVAL = 1,  // Bad magic, ndims mismatch, K out of range, ...
+    SERVE_ESEARCH = 2  // The search itself failed, or memory ran out.
+};
+
+struct serve_reply_header
+{
+    uint32_t status;
+    uint32_t nqueries;
+    uint32_t K;
+};
+
+class
+query_server
+{
+public:
+    /**
+     * Serves \c nno (not owned) on \c socket_path. A batch is searched
+     * once it holds \c max_batch queries or the oldest request in it
+     * has waited \c max_wait_us microseconds. Requests for more than
+     * \c max_results neighbours in all (nqueries*K) are refused with
+     * SERVE_EINVAL, and no batch holds more than that for its largest
+     * K unless a single request does.
+     */
+    query_server(const nn_obj<float>* nno, const char* socket_path,
+                 unsigned max_batch = 256, unsigned max_wait_us = 500,
+                 size_t max_results = serve_default_max_results);
+    ~query_server();
+
+    /**
+     * Binds the socket and starts serving; throws 0 if the socket
+     * can't be created.
+     */
+    void start();
+    void stop();
+
+    unsigned long long nbatches() const { return nbatches_; }
+    unsigned long long nqueries() const { return nqueries_; }
+
+private:
+    struct request;
+
+    query_server(const query_server&);
+    query_server& operator=(const query_server&);
+
+    static void* listener_main(void* arg);
+    static void* batcher_main(void* arg);
+    static void* connection_main(void* arg);
+
+    void serve_connection(int fd);
+    void run_batch(std::vector<request*>& batch);
+    void search_batch(std::vector<request*>& batch);
+
+    const nn_obj<float>* nno_;
+    std::string socket_path_;
+    unsigned max_batch_;
+    unsigned max_wait_us_;
+    size_t max_results_;
+
+    int listen_fd_;
+    bool running_;
+    pthread_t listener_;
+    pthread_t batcher_;
+
+    pthread_mutex_t mutex_;
+    pthread_cond_t queue_cond_; // Signalled when requests are queued.
+    pthread_cond_t done_cond_;  // Broadcast when a batch completes.
+    std::deque<request*> queue_;
+    unsigned queued_queries_;
+    unsigned nconnections_;             // Detached connection threads still running.
+    std::vector<int> connection_fds_;
+
+    unsigned long long nbatches_;
+    unsigned long long nqueries_;
+};
+
+/**
+ * Client side. serve_connect returns a connected socket (close it when
+ * done) or -1. serve_search_knn sends one request over it and waits for
+ * the reply, returning a serve_status or -1 on a socket error.
+ */
+int serve_connect(const char* socket_path);
+int serve_search_knn(int fd, const float* qus, unsigned N, unsigned D, unsigned K,
+                     unsigned* argmins, float* mins);
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Tests the C interface in fastann_c.h against the exact search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fastann_c.h"
+#include "randomkit.h"
+
+static float*
+gen_unit_random_f32(unsigned N, unsigned D, unsigned seed)
+{
+    rk_state state;
+    float* ret = (float*)malloc(sizeof(float)*N*D);
+    unsigned i;
+
+    rk_seed(seed, &state);
+    for (i=0; i < N*D; ++i) ret[i] = (float)rk_double(&state);
+
+    return ret;
+}
+
+static void
+report(const char* name, int ok, int* num_passed, int* num_failed)
+{
+    printf("%30s %20s\n", name, ok ? "PASSED" : "FAILED");
+    if (ok) (*num_passed)++;
+    else (*num_failed)++;
+}
+
+int
+main()
+{
+    unsigned N = 2000, D = 64, K = 4, n, nd = 0, np = 0;
+    int num_passed = 0, num_failed = 0, same = 1;
+    float* pnts = gen_unit_random_f32(N, D, 42);
+    float* qus = gen_unit_random_f32(N, D, 43);
+    unsigned* argmins_exact = (unsigned*)malloc(sizeof(unsigned)*N*K);
+    float* mins_exact = (float*)malloc(sizeof(float)*N*K);
+    unsigned* argmins_rr = (unsigned*)malloc(sizeof(unsigned)*N*K);
+    float* mins_rr = (float*)malloc(sizeof(float)*N*K);
+    unsigned umins[1];
+    fastann_index* exact = 0;
+    fastann_index* kdt = 0;
+    fastann_index* rr = 0;
+
+    report("build_exact_f32", fastann_build_exact_f32(pnts, N, D, &exact) == FASTANN_OK,
+           &num_passed, &num_failed);
+    report("ndims/npoints", fastann_ndims(exact, &nd) == FASTANN_OK && nd == D &&
+                            fastann_npoints(exact, &np) == FASTANN_OK && np == N,
+           &num_passed, &num_failed);
+    report("search_knn_f32", fastann_search_knn_f32(exact, qus, N, K, argmins_exact, mins_exact) == FASTANN_OK,
+           &num_passed, &num_failed);
+    report("wrong type", fastann_search_knn_u8(exact, (const unsigned char*)qus, 1, 1, argmins_rr, umins) == FASTANN_ETYPE,
+           &num_passed, &num_failed);
+    report("K > npoints", fastann_search_knn_f32(exact, qus, 1, N + 1, argmins_rr, mins_rr) == FASTANN_EINVAL,
+           &num_passed, &num_failed);
+    report("null output", fastann_search_knn_f32(exact, qus, 1, 1, 0, mins_rr) == FASTANN_EINVAL,
+           &num_passed, &num_failed);
+
+    /* A kd-tree reranked over every point must agree with exact. */
+    report("build_kdtree_f32", fastann_build_kdtree_f32(pnts, N, D, 4, 64, &kdt) == FASTANN_OK,
+           &num_passed, &num_failed);
+    report("build_rerank_f32", fastann_build_rerank_f32(kdt, pnts, N, D, N, &rr) == FASTANN_OK,
+           &num_passed, &num_failed);
+    report("search_knn_f32 rerank", fastann_search_knn_f32(rr, qus, N, K, argmins_rr, mins_rr) == FASTANN_OK,
+           &num_passed, &num_failed);
+    for (n=0; n < N*K; ++n) {
+        if (argmins_rr[n] != argmins_exact[n]) same = 0;
+    }
+    report("rerank == exact", same, &num_passed, &num_failed);
+
+    report("map missing file", fastann_map_kdtree_f32("/nonexistent/fastann", 64, &kdt) == FASTANN_EIO,
+           &num_passed, &num_failed);
+
+    fastann_free(exact);
+    fastann_free(rr);
+    fastann_free(0);
+
+    free(pnts);
+    free(qus);
+    free(argmins_exact);
+    free(mins_exact);
+    free(argmins_rr);
+    free(mins_rr);
+
+    printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
+
+    if (num_failed) return -1;
+    else return 0;
+}
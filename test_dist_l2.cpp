@@ -68,6 +68,31 @@ struct dl2func_name_pair
     const char* name;
 };
 
+struct ml2func_name_pair
+{
+    ml2func func;
+    const char* name;
+};
+
+/**
+ * Float queries against byte points: relative error, as the distances
+ * run to millions and the routines sum in different orders.
+ */
+bool
+test_mixed_routine(const float* dm_known_good, const float* qus, const unsigned char* pnts,
+                   unsigned N, unsigned D, ml2func func)
+{
+    float* dm = new float[N*N];
+    for (unsigned n=0; n < N; ++n) func(qus + n*D, pnts, N, D, dm + n*N);
+
+    bool ret = true;
+    for (unsigned s=0; s < N*N; ++s) {
+        if (fabs((double)dm[s] - dm_known_good[s]) > 1.e-5*(1.0 + dm_known_good[s])) ret = false;
+    }
+    delete[] dm;
+    return ret;
+}
+
 void
 test(int N, int D, int& num_passed, int& num_failed)
 {
@@ -91,6 +116,13 @@ test(int N, int D, int& num_passed, int& num_failed)
         { &dl2v_2_8, "dl2v_2_8" },
 #endif
     };
+
+    static const ml2func_name_pair mfuncs[] = {
+        { &ml2s, "ml2s" },
+#ifdef __SSE2__
+        { &ml2v_4_16, "ml2v_4_16" },
+#endif
+    };
     
     unsigned char* pnts_uc;
     float* pnts_s;
@@ -107,6 +139,18 @@ test(int N, int D, int& num_passed, int& num_failed)
     float* pnts_s_dm_slow = new float[N*N];
     double* pnts_d_dm_slow = new double[N*N];
 
+    // Queries on the byte scale, without the rounding.
+    float* qus_m = new float[N*D];
+    for (int i=0; i < N*D; ++i) qus_m[i] = (float)(256.0*pnts_d[i]);
+    float* pnts_m_dm_slow = new float[N*N];
+    for (int n=0; n < N; ++n) {
+        for (int p=0; p < N; ++p) {
+            double dsq = 0;
+            for (int d=0; d < D; ++d) dsq += ((double)qus_m[n*D + d] - pnts_uc[p*D + d])*((double)qus_m[n*D + d] - pnts_uc[p*D + d]);
+            pnts_m_dm_slow[n*N + p] = (float)dsq;
+        }
+    }
+
     compute_distance_matrix(&cl2s, pnts_uc, N, D, pnts_uc_dm_slow);
     compute_distance_matrix(&sl2s, pnts_s, N, D, pnts_s_dm_slow);
     compute_distance_matrix(&dl2s, pnts_d, N, D, pnts_d_dm_slow);
@@ -150,6 +194,21 @@ test(int N, int D, int& num_passed, int& num_failed)
         }
     }
 
+    // Mixed
+    for (size_t i=0; i < sizeof(mfuncs)/sizeof(ml2func_name_pair); ++i) {
+        bool res = test_mixed_routine(pnts_m_dm_slow, qus_m, pnts_uc, N, D, mfuncs[i].func);
+        if (res) {
+            printf("%10d %10d %30s %20s\n", N, D, mfuncs[i].name, "PASSED");
+            num_passed++;
+        }
+        else {
+            printf("%10d %10d %30s %20s\n", N, D, mfuncs[i].name, "FAILED");
+            num_failed++;
+        }
+    }
+
+    delete[] pnts_m_dm_slow;
+    delete[] qus_m;
     delete[] pnts_d_dm_slow;
     delete[] pnts_s_dm_slow;
     delete[] pnts_uc_dm_slow;
@@ -0,0 +1,80 @@
+/**
+ * Tests the blocked ground truth in groundtruth.hpp against the exact
+ * index.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "fastann.hpp"
+#include "groundtruth.hpp"
+#include "rand_point_gen.hpp"
+
+/**
+ * Bytes come from the SIFT-like model (so \c D must be 128), as
+ * gen_unit_random rounds them all to 0.
+ */
+template<class Float>
+Float*
+gen_points(unsigned N, unsigned D, unsigned seed)
+{
+    return fastann::gen_unit_random<Float>(N, D, seed);
+}
+
+template<>
+unsigned char*
+gen_points<unsigned char>(unsigned N, unsigned D, unsigned seed)
+{
+    return fastann::gen_rows<unsigned char>(fastann::gen_sift_model(200, 42), N, D, seed);
+}
+
+template<class Float>
+bool
+test_groundtruth(unsigned N, unsigned NQ, unsigned D, unsigned K, unsigned block)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+
+    Float* pnts = gen_points<Float>(N, D, 42);
+    Float* qus = gen_points<Float>(NQ, D, 43);
+
+    std::vector<unsigned> argmins_exact(NQ*K), argmins_gt(NQ*K);
+    std::vector<AccumFloat> mins_exact(NQ*K), mins_gt(NQ*K);
+
+    fastann::nn_obj<Float>* exact = fastann::nn_obj_build_exact(pnts, N, D);
+    exact->search_knn(qus, NQ, K, &argmins_exact[0], &mins_exact[0]);
+
+    fastann::thread_pool pool(3);
+    fastann::groundtruth_knn<Float> gt(qus, NQ, D, K);
+    for (unsigned b=0; b < N; b += block) {
+        gt.add_block(pnts + b*D, std::min(block, N - b), b, pool);
+    }
+    gt.results(&argmins_gt[0], &mins_gt[0]);
+
+    // The queries aren't points, so every distance is positive.
+    bool ok = argmins_exact == argmins_gt && mins_exact == mins_gt && mins_gt[0] > 0;
+    printf("%10d %10d %10d %20s\n", N, D, K, ok ? "PASSED" : "FAILED");
+
+    delete exact;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+int
+main()
+{
+    int num_passed = 0, num_failed = 0;
+
+    (test_groundtruth<float>(20000, 300, 64, 10, 3000) ? num_passed : num_failed)++;
+    (test_groundtruth<float>(5000, 50, 3, 100, 70) ? num_passed : num_failed)++;
+    (test_groundtruth<double>(5000, 100, 32, 5, 1024) ? num_passed : num_failed)++;
+    (test_groundtruth<unsigned char>(5000, 100, fastann::gen_sift_model::D, 5, 999) ? num_passed : num_failed)++;
+
+    printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
+
+    if (num_failed) return -1;
+    else return 0;
+}
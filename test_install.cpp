@@ -0,0 +1,35 @@
+/**
+ * Built by "make check_install" against the headers and library
+ * installed into a scratch prefix, so a header that includes one which
+ * isn't installed fails to compile.
+ */
+
+#include <stdio.h>
+
+#include <fastann/fastann.hpp>
+#include <fastann/groundtruth.hpp>
+#include <fastann/huge_page_allocator.hpp>
+#include <fastann/managed_index.hpp>
+#include <fastann/pca.hpp>
+#include <fastann/query_cache.hpp>
+#include <fastann/serve.hpp>
+#include <fastann/vecs_io.hpp>
+
+int
+main()
+{
+    unsigned N = 1000, D = 8;
+    fastann::thread_pool pool(2);
+    float* pnts = fastann::gen_rows<float>(fastann::gen_mixture_model(D, 10, 0.05, 42), N, D, 42, pool);
+    fastann::nn_obj<float>* nno = fastann::nn_obj_build_exact(pnts, N, D);
+
+    unsigned argmin;
+    float min;
+    nno->search_nn(pnts + 7*D, 1, &argmin, &min);
+    bool ok = argmin == 7 && min == 0;
+    printf("%30s %20s\n", "installed headers", ok ? "PASSED" : "FAILED");
+
+    delete nno;
+    delete[] pnts;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+/**
+ * The C interface's part of "make check_install": built as C against
+ * the installed fastann_c.h and library.
+ */
+
+#include <stdio.h>
+
+#include <fastann/fastann_c.h>
+
+int
+main()
+{
+    float pnts[8] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+    float qu[2] = { 0.9f, 0.1f };
+    fastann_index* idx = 0;
+    unsigned argmin = ~0u;
+    float min;
+    int ok = fastann_build_exact_f32(pnts, 4, 2, &idx) == FASTANN_OK &&
+             fastann_search_knn_f32(idx, qu, 1, 1, &argmin, &min) == FASTANN_OK && argmin == 1;
+
+    printf("%30s %20s\n", "installed C interface", ok ? "PASSED" : "FAILED");
+    fastann_free(idx);
+    return ok ? 0 : 1;
+}
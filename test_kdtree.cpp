@@ -2,12 +2,24 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include <algorithm>
+#include <new>
 #include <vector>
 
+#include <fcntl.h>
 #include <stdint.h>
+#include <unistd.h>
 
+#include "dist_l2.hpp"
 #include "fastann.hpp"
+#include "huge_page_allocator.hpp"
+#include "managed_index.hpp"
+#include "nn_kdtree.hpp"
+#include "numa.hpp"
+#include "pca.hpp"
+#include "query_cache.hpp"
 #include "rand_point_gen.hpp"
+#include "vecs_io.hpp"
 
 static inline uint64_t rdtsc()
 {
@@ -104,6 +116,1007 @@ test_kdtree<unsigned char>(unsigned N, unsigned D, double min_accuracy)
     delete nnobj_kdt;
 }
 
+/**
+ * A cheap first stage (a kd-forest over 8 principal components of
+ * points with 16 intrinsic dimensions) must be beaten by reranking its
+ * candidates in full dimension, over all K of every query.
+ */
+template<class Float>
+int
+test_rerank(unsigned N, unsigned D, double min_accuracy)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+    Float* pnts = fastann::gen_low_intrinsic_dim<Float>(2*N, D, 16, 0.01, 42);
+    Float* qus = pnts + (size_t)N*D;
+    unsigned K = 5, d = 8;
+
+    std::vector<AccumFloat> mins_exact(N*K), mins_first(N*K), mins_rr(N*K);
+    std::vector<unsigned> argmins_exact(N*K), argmins_first(N*K), argmins_rr(N*K);
+
+    fastann::nn_obj<Float>* nnobj_exact = fastann::nn_obj_build_exact(pnts, N, D);
+    fastann::nn_obj<Float>* nnobj_first = fastann::nn_obj_build_pca_kdtree(pnts, N, D, d, 8, 768);
+    fastann::nn_obj_rerank<Float>* nnobj_rr =
+        fastann::nn_obj_build_rerank(fastann::nn_obj_build_pca_kdtree(pnts, N, D, d, 8, 768), pnts, N, D, 100);
+
+    nnobj_exact->search_knn(qus, N, K, &argmins_exact[0], &mins_exact[0]);
+    nnobj_first->search_knn(qus, N, K, &argmins_first[0], &mins_first[0]);
+    nnobj_rr->search_knn_rerank(qus, N, K, 200, &argmins_rr[0], &mins_rr[0]);
+
+    // The first stage's distances are in the reduced space, so it is
+    // judged on indices alone.
+    unsigned num_first = 0, num_rr = 0;
+    bool sorted = true;
+    for (unsigned i = 0; i < N*K; ++i) {
+        num_first += argmins_exact[i] == argmins_first[i];
+        num_rr += argmins_exact[i] == argmins_rr[i] && mins_exact[i] == mins_rr[i];
+        if (i % K && mins_rr[i] < mins_rr[i - 1]) sorted = false;
+    }
+
+    // A first stage of the wrong size is refused, and deleted.
+    bool refused = false;
+    try {
+        delete fastann::nn_obj_build_rerank(fastann::nn_obj_build_exact(pnts, N/2, D), pnts, N, D, 100);
+    }
+    catch (int) { refused = true; }
+
+    double accuracy_first = (double)num_first/(N*K), accuracy = (double)num_rr/(N*K);
+    bool ok = sorted && refused && accuracy > accuracy_first && accuracy > min_accuracy;
+    printf("Rerank accuracy: %.1f%% (first stage %.1f%%) %s\n", accuracy*100.0, accuracy_first*100.0,
+           ok ? "PASSED" : "FAILED");
+
+    delete[] pnts;
+
+    delete nnobj_exact;
+    delete nnobj_first;
+    delete nnobj_rr;
+
+    return ok;
+}
+
+template<class Float>
+int
+test_copy_points(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    Float* pnts_tmp = new Float[N*D];
+    std::copy(pnts, pnts + N*D, pnts_tmp);
+    unsigned K = 3;
+
+    std::vector<Float> mins_borrow(N*K), mins_copy(N*K);
+    std::vector<unsigned> argmins_borrow(N*K), argmins_copy(N*K);
+
+    fastann::nn_obj<Float>* nnobj_borrow = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768);
+    fastann::nn_obj<Float>* nnobj_copy = fastann::nn_obj_build_kdtree(pnts_tmp, N, D, 8, 768, true);
+    delete[] pnts_tmp; // The copy must not depend on it any more.
+
+    nnobj_borrow->search_knn(qus, N, K, &argmins_borrow[0], &mins_borrow[0]);
+    nnobj_copy->search_knn(qus, N, K, &argmins_copy[0], &mins_copy[0]);
+
+    bool same = (argmins_borrow == argmins_copy) && (mins_borrow == mins_copy);
+    printf("Copied points: %s\n", same ? "same" : "different");
+
+    delete[] pnts;
+    delete[] qus;
+
+    delete nnobj_borrow;
+    delete nnobj_copy;
+
+    return same;
+}
+
+/**
+ * A forest with 64 bit indices must build the same trees and find the
+ * same neighbours as the compact one, whether it borrows the points,
+ * owns them or has had points added.
+ */
+template<class Float>
+int
+test_wide_indices(unsigned N, unsigned D)
+{
+    typedef typename fastann::nn_kdtree_internal::kdtree_types<Float>::DistFloat DistFloat;
+    Float* pnts = fastann::gen_unit_random<Float>(N + 1000, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(1000, D, 43);
+    unsigned NQ = 1000, K = 3;
+    fastann::dist_l2_wrapper<Float> dist = fastann::dist_l2_best<Float>(D);
+
+    bool ok = true;
+    for (unsigned copy=0; copy < 2; ++copy) {
+        fastann::nn_kdtree<Float> narrow(pnts, N, D, 8, 42, copy);
+        fastann::nn_kdtree<Float, uint64_t> wide(pnts, N, D, 8, 42, copy);
+        narrow.add_points(pnts + (size_t)N*D, 1000);
+        wide.add_points(pnts + (size_t)N*D, 1000);
+        ok = ok && wide.npoints() == (uint64_t)N + 1000;
+
+        std::vector< std::pair<unsigned, DistFloat> > nns_narrow(K);
+        std::vector< std::pair<uint64_t, DistFloat> > nns_wide(K);
+        for (unsigned n=0; ok && n < NQ; ++n) {
+            narrow.search(qus + (size_t)n*D, dist, K, &nns_narrow[0], 768);
+            wide.search(qus + (size_t)n*D, dist, K, &nns_wide[0], 768);
+            for (unsigned k=0; k < K; ++k) {
+                ok = ok && nns_narrow[k].first == nns_wide[k].first && nns_narrow[k].second == nns_wide[k].second;
+            }
+        }
+        ok = ok && wide.memory_usage().leaf_indices == 2*narrow.memory_usage().leaf_indices;
+    }
+    printf("64 bit indices: %s\n", ok ? "same" : "different");
+
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+/**
+ * nn_obj searches with the kernel inlined (see dispatch_dist_l2); they
+ * must match a search through the kernel pointer.
+ */
+template<class Float>
+int
+test_dist_dispatch(unsigned N, unsigned D)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(1000, D, 43);
+    unsigned NQ = 1000, K = 3;
+
+    fastann::nn_kdtree<Float> kdt(pnts, N, D, 8, 42);
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768);
+    std::vector<unsigned> argmins(NQ*K);
+    std::vector<AccumFloat> mins(NQ*K);
+    nnobj->search_knn(qus, NQ, K, &argmins[0], &mins[0]);
+
+    bool ok = true;
+    std::vector< std::pair<unsigned, AccumFloat> > nns(K);
+    for (unsigned n=0; ok && n < NQ; ++n) {
+        kdt.search(qus + (size_t)n*D, fastann::dist_l2_best<Float>(D), K, &nns[0], 768);
+        for (unsigned k=0; k < K; ++k) ok = ok && nns[k].first == argmins[n*K + k] && nns[k].second == mins[n*K + k];
+    }
+    printf("Inlined distance: %s\n", ok ? "same" : "different");
+
+    delete nnobj;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+static void
+count_callback(void* user, int status)
+{
+    if (status == 0) __sync_fetch_and_add((unsigned*)user, 1);
+}
+
+template<class Float>
+int
+test_submit_knn(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3;
+
+    std::vector<Float> mins_sync(N*K), mins_fut(N*K), mins_cb(N*K);
+    std::vector<unsigned> argmins_sync(N*K), argmins_fut(N*K), argmins_cb(N*K);
+
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768);
+
+    nnobj->search_knn(qus, N, K, &argmins_sync[0], &mins_sync[0]);
+
+    fastann::search_future* fut = nnobj->submit_knn(qus, N, K, &argmins_fut[0], &mins_fut[0]);
+    int status = fut->wait();
+    delete fut;
+
+    // Many small submissions, completed through the callback.
+    unsigned ndone = 0;
+    unsigned nsub = 0;
+    for (unsigned n = 0; n < N; n += 100, ++nsub) {
+        unsigned nq = std::min(100u, N - n);
+        nnobj->submit_knn(qus + n*D, nq, K, &argmins_cb[n*K], &mins_cb[n*K], &count_callback, &ndone);
+    }
+    while (__sync_fetch_and_add(&ndone, 0) != nsub) usleep(1000);
+
+    bool same = (status == 0) && (argmins_sync == argmins_fut) && (argmins_sync == argmins_cb);
+    printf("Asynchronous search: %s\n", same ? "same" : "different");
+
+    delete[] pnts;
+    delete[] qus;
+
+    delete nnobj;
+
+    return same;
+}
+
+/**
+ * Counts the indices it is given, throwing \c throw_at when it meets
+ * it (and not ~0). Each chunk sleeps a little, so that the pool's
+ * workers take chunks too, even on one CPU.
+ */
+struct
+throwing_range
+{
+    size_t throw_at;
+    bool bad_alloc;
+    size_t ndone;
+
+    static void
+    run(void* arg, size_t begin, size_t end)
+    {
+        throwing_range* r = (throwing_range*)arg;
+        usleep(100);
+        if (r->throw_at >= begin && r->throw_at < end) {
+            if (r->bad_alloc) throw std::bad_alloc();
+            throw 7;
+        }
+        __sync_fetch_and_add(&r->ndone, end - begin);
+    }
+};
+
+/**
+ * A range function that throws must have its exception rethrown by
+ * parallel_for once every helper has let go, with the pool still
+ * usable afterwards.
+ */
+int
+test_parallel_for_throws()
+{
+    fastann::thread_pool pool(4);
+    size_t n = 2000;
+
+    throwing_range r = { n/2, false, 0 };
+    int thrown = 0;
+    try {
+        fastann::parallel_for(pool, n, 1, &throwing_range::run, &r);
+    }
+    catch (int e) {
+        thrown = e;
+    }
+
+    throwing_range r2 = { n/3, true, 0 };
+    bool bad_alloc = false;
+    try {
+        fastann::parallel_for(pool, n, 1, &throwing_range::run, &r2);
+    }
+    catch (const std::bad_alloc&) {
+        bad_alloc = true;
+    }
+
+    throwing_range r3 = { ~(size_t)0, false, 0 };
+    fastann::parallel_for(pool, n, 1, &throwing_range::run, &r3);
+
+    bool ok = thrown == 7 && r.ndone < n && bad_alloc && r3.ndone == n;
+    printf("parallel_for exceptions: %s\n", ok ? "PASSED" : "FAILED");
+    return ok;
+}
+
+/**
+ * Writes a one tree index for \c pnts to \c path, overwrites the first
+ * uint32 of the section whose offset is the header field at byte
+ * \c field with \c value, and returns whether mapping it is refused.
+ */
+template<class Float>
+bool
+corrupt_refused(const char* path, const Float* pnts, unsigned N, unsigned D, off_t field, uint32_t value)
+{
+    uint64_t section = 0;
+    int fd = -1;
+    bool ok = fastann::nn_obj_write_kdtree(path, pnts, N, D, 1) && (fd = open(path, O_RDWR)) >= 0 &&
+              pread(fd, &section, sizeof(section), field) == sizeof(section) &&
+              pwrite(fd, &value, sizeof(value), section) == sizeof(value);
+    if (fd >= 0) close(fd);
+    fastann::nn_obj<Float>* nnobj = ok ? fastann::nn_obj_map_kdtree<Float>(path, 768) : 0;
+    unlink(path);
+    delete nnobj;
+    return ok && !nnobj;
+}
+
+template<class Float>
+struct
+write_race
+{
+    const char* path;
+    const Float* pnts;
+    unsigned N, D;
+    unsigned nfailed;
+};
+
+/**
+ * Rewrites \c path a few times, as another thread does the same.
+ */
+template<class Float>
+void*
+write_race_main(void* arg)
+{
+    write_race<Float>* w = (write_race<Float>*)arg;
+    for (unsigned i=0; i < 4; ++i) {
+        if (!fastann::nn_obj_write_kdtree(w->path, w->pnts, w->N, w->D, 2)) __sync_fetch_and_add(&w->nfailed, 1);
+    }
+    return 0;
+}
+
+template<class Float>
+int
+test_mapped(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/fastann_test_kdtree.%d", (int)getpid());
+
+    std::vector<Float> mins_mem(N*K), mins_map(N*K);
+    std::vector<unsigned> argmins_mem(N*K), argmins_map(N*K);
+
+    fastann::nn_obj<Float>* nnobj_mem = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true);
+    bool written = fastann::nn_obj_write_kdtree(path, pnts, N, D, 8);
+
+    fastann::nn_obj<Float>* nnobj_map = written ? fastann::nn_obj_map_kdtree<Float>(path, 768) : 0;
+    fastann::nn_obj<double>* nnobj_wrong = fastann::nn_obj_map_kdtree<double>(path, 768);
+    unlink(path); // Existing mappings stay valid.
+
+    // No trees, a root past the nodes and a leaf index past the points
+    // (header fields at 48 and 72 hold the roots and leaf index offsets).
+    char bad_path[80];
+    snprintf(bad_path, sizeof(bad_path), "%s.bad", path);
+    bool refused = !fastann::nn_obj_write_kdtree(bad_path, pnts, N, D, 0) &&
+                   corrupt_refused(bad_path, pnts, N, D, 48, 1u << 30) &&
+                   corrupt_refused(bad_path, pnts, N, D, 72, N);
+
+    // Writers racing on one path must each leave a whole file.
+    char race_path[80];
+    snprintf(race_path, sizeof(race_path), "%s.race", path);
+    write_race<Float> w = { race_path, pnts, N, D, 0 };
+    pthread_t ths[2];
+    for (unsigned t=0; t < 2; ++t) pthread_create(&ths[t], 0, &write_race_main<Float>, &w);
+    for (unsigned t=0; t < 2; ++t) pthread_join(ths[t], 0);
+    fastann::nn_obj<Float>* nnobj_race = fastann::nn_obj_map_kdtree<Float>(race_path, 768);
+    bool raced = w.nfailed == 0 && nnobj_race && nnobj_race->npoints() == N;
+    delete nnobj_race;
+    unlink(race_path);
+    delete[] pnts; // The mapped index has its own copy.
+
+    unsigned num_same = 0;
+    if (nnobj_map) {
+        nnobj_mem->search_knn(qus, N, K, &argmins_mem[0], &mins_mem[0]);
+        nnobj_map->search_knn(qus, N, K, &argmins_map[0], &mins_map[0]);
+        for (unsigned n = 0; n < N*K; ++n) {
+            if (argmins_mem[n] == argmins_map[n]) num_same++;
+        }
+    }
+
+    // Ties in the branch queue may be broken differently.
+    bool ok = nnobj_map && !nnobj_wrong && refused && raced && num_same >= 0.999*N*K;
+    printf("Mapped kd-tree: %s\n", ok ? "same" : "different");
+
+    delete[] qus;
+
+    delete nnobj_mem;
+    delete nnobj_map;
+
+    return ok;
+}
+
+/**
+ * memory_usage() should match what went through the allocator, the
+ * estimate should be close, and a build over budget should throw
+ * without leaking.
+ */
+template<class Float>
+int
+test_memory(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+
+    fastann::budget_allocator counted;
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true, &counted);
+    fastann::memory_breakdown mem = nnobj->memory_usage();
+    fastann::memory_breakdown est = fastann::nn_obj_estimate_kdtree<Float>(N, D, 8, true);
+
+    // The point order in aux came from the allocator, the tree vector didn't.
+    size_t allocated = mem.nodes + mem.leaf_indices + mem.points + (size_t)N*sizeof(unsigned);
+    double est_ratio = (double)est.total()/mem.total();
+    bool ok = allocated == counted.current() && counted.peak() >= allocated + N*sizeof(unsigned) &&
+              mem.points == (size_t)N*D*sizeof(Float) && est_ratio > 0.8 && est_ratio < 1.25;
+    delete nnobj;
+    ok = ok && counted.current() == 0;
+
+    fastann::budget_allocator tight(counted.peak()/2);
+    bool threw = false;
+    try {
+        nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true, &tight);
+        delete nnobj;
+    }
+    catch (std::bad_alloc&) {
+        threw = true;
+    }
+    ok = ok && threw && tight.current() == 0 && tight.peak() <= tight.budget();
+
+    printf("Memory: %.1f MB, estimate %.1f MB %s\n", mem.total()/1048576.0, est.total()/1048576.0,
+           ok ? "PASSED" : "FAILED");
+
+    delete[] pnts;
+
+    return ok;
+}
+
+/**
+ * A kd-tree on huge pages (or their fallback) must give the same
+ * answers as one from the default allocator.
+ */
+template<class Float>
+int
+test_huge_pages(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3;
+
+    std::vector<Float> mins(N*K), mins_huge(N*K);
+    std::vector<unsigned> argmins(N*K), argmins_huge(N*K);
+
+    fastann::huge_page_allocator huge;
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true);
+    fastann::nn_obj<Float>* nnobj_huge = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true, &huge);
+
+    nnobj->search_knn(qus, N, K, &argmins[0], &mins[0]);
+    nnobj_huge->search_knn(qus, N, K, &argmins_huge[0], &mins_huge[0]);
+
+    bool ok = argmins == argmins_huge && mins == mins_huge &&
+              huge.hugetlb_bytes() + huge.thp_bytes() >= (size_t)N*D*sizeof(Float);
+    printf("Huge pages: %.1f MB hugetlbfs, %.1f MB THP %s\n", huge.hugetlb_bytes()/1048576.0,
+           huge.thp_bytes()/1048576.0, ok ? "PASSED" : "FAILED");
+
+    delete nnobj;
+    delete nnobj_huge;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+/**
+ * Every NUMA placement must answer exactly as a plain owning kd-tree,
+ * whichever node the search runs on.
+ */
+template<class Float>
+int
+test_numa(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3;
+
+    std::vector<Float> mins(N*K), mins_numa(N*K);
+    std::vector<unsigned> argmins(N*K), argmins_numa(N*K);
+
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true);
+    nnobj->search_knn(qus, N, K, &argmins[0], &mins[0]);
+
+    bool ok = fastann::numa_pin_thread_pool();
+    const fastann::numa_policy policies[] = {
+        fastann::numa_first_touch, fastann::numa_interleaved, fastann::numa_replicated
+    };
+    for (unsigned p=0; p < 3; ++p) {
+        fastann::nn_obj<Float>* nnobj_numa = fastann::nn_obj_build_kdtree_numa(pnts, N, D, 8, 768, policies[p]);
+        fastann::search_future* fut = nnobj_numa->submit_knn(qus, N, K, &argmins_numa[0], &mins_numa[0]);
+        ok = ok && fut->wait() == 0 && argmins == argmins_numa && mins == mins_numa;
+        delete fut;
+        delete nnobj_numa;
+    }
+    printf("NUMA placement (%u nodes): %s\n", fastann::numa_topology::get().nnodes(), ok ? "same" : "different");
+
+    delete nnobj;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+template<class Float>
+struct managed_test
+{
+    fastann::managed_index<Float>* mi;
+    const Float* pnts;
+    const Float* qus;
+    unsigned N, D, K;
+    const unsigned* argmins_ref;
+    fastann::budget_allocator* alloc;
+    volatile bool stop;
+    unsigned nqueries, nwrong;
+};
+
+template<class Float>
+fastann::nn_obj<Float>*
+managed_test_build(void* arg)
+{
+    managed_test<Float>* t = (managed_test<Float>*)arg;
+    return fastann::nn_obj_build_kdtree(t->pnts, t->N, t->D, 8, 768, true, t->alloc);
+}
+
+template<class Float>
+void*
+managed_test_reader(void* arg)
+{
+    managed_test<Float>* t = (managed_test<Float>*)arg;
+    std::vector<unsigned> argmins(t->K);
+    std::vector<typename fastann::nn_obj<Float>::accum_float_type> mins(t->K);
+    unsigned n = 0, nqueries = 0, nwrong = 0;
+    while (!t->stop) {
+        t->mi->search_knn(t->qus + (size_t)n*t->D, 1, t->K, &argmins[0], &mins[0]);
+        if (!std::equal(argmins.begin(), argmins.end(), t->argmins_ref + (size_t)n*t->K)) nwrong++;
+        nqueries++;
+        n = (n + 1) % t->N;
+    }
+    __sync_fetch_and_add(&t->nqueries, nqueries);
+    __sync_fetch_and_add(&t->nwrong, nwrong);
+    return 0;
+}
+
+/**
+ * Rebuilds the index under readers that never stop searching; every
+ * answer must come from a complete index, and the replaced ones must
+ * be freed.
+ */
+template<class Float>
+int
+test_managed(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3, nreaders = 4, nrebuilds = 3;
+
+    std::vector<Float> mins(N*K);
+    std::vector<unsigned> argmins(N*K);
+
+    fastann::budget_allocator alloc;
+    fastann::managed_index<Float> mi(fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, true, &alloc));
+    mi.search_knn(qus, N, K, &argmins[0], &mins[0]);
+    size_t one_index = alloc.current();
+
+    managed_test<Float> t = { &mi, pnts, qus, N, D, K, &argmins[0], &alloc, false, 0, 0 };
+    std::vector<pthread_t> ths(nreaders);
+    for (unsigned r=0; r < nreaders; ++r) pthread_create(&ths[r], 0, &managed_test_reader<Float>, &t);
+
+    bool ok = true;
+    for (unsigned b=0; b < nrebuilds; ++b) {
+        ok = ok && mi.start_rebuild(&managed_test_build<Float>, &t) == 0 && mi.wait_rebuild() == 0;
+    }
+
+    t.stop = true;
+    for (unsigned r=0; r < nreaders; ++r) pthread_join(ths[r], 0);
+    mi.reclaim();
+
+    ok = ok && t.nqueries > 0 && t.nwrong == 0 && alloc.current() == one_index;
+    printf("Managed rebuilds: %u queries during %u swaps %s\n", t.nqueries, nrebuilds,
+           ok ? "PASSED" : "FAILED");
+
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+/**
+ * A managed byte index must pass float queries, stats and added points
+ * through to the index it holds.
+ */
+int
+test_managed_forwarding(unsigned N)
+{
+    unsigned D = fastann::gen_sift_model::D, NQ = 100, K = 3;
+    unsigned char* pnts = fastann::gen_sift_like(N + NQ, 200, 42);
+    std::vector<float> qus(pnts + (size_t)N*D, pnts + (size_t)(N + NQ)*D);
+
+    fastann::nn_obj<unsigned char>* inner = fastann::nn_obj_build_exact(pnts, N, D, true);
+    fastann::managed_index<unsigned char> mi(inner);
+
+    std::vector<unsigned> argmins_mi(NQ*K), argmins_inner(NQ*K);
+    std::vector<float> mins_mi(NQ*K), mins_inner(NQ*K);
+    mi.search_knn_float(&qus[0], NQ, K, &argmins_mi[0], &mins_mi[0], 0);
+    inner->search_knn_float(&qus[0], NQ, K, &argmins_inner[0], &mins_inner[0], 0);
+    bool ok = argmins_mi == argmins_inner && mins_mi == mins_inner;
+
+    ok = ok && mi.stats_summary() && mi.stats_summary() == inner->stats_summary();
+    mi.reset_stats();
+    ok = ok && mi.stats_summary()->nqueries == 0;
+
+    mi.add_points(pnts + (size_t)N*D, NQ);
+    ok = ok && mi.npoints() == N + NQ && inner->npoints() == N + NQ;
+
+    printf("Managed forwarding: %s\n", ok ? "PASSED" : "FAILED");
+    delete[] pnts;
+    return ok;
+}
+
+template<class Float>
+struct add_points_test
+{
+    fastann::nn_obj<Float>* nnobj;
+    const Float* pnts;
+    unsigned N, D;
+    volatile bool stop;
+    unsigned nqueries, nwrong;
+};
+
+template<class Float>
+void*
+add_points_test_reader(void* arg)
+{
+    add_points_test<Float>* t = (add_points_test<Float>*)arg;
+    unsigned argmin;
+    typename fastann::nn_obj<Float>::accum_float_type min;
+    unsigned n = 0, nqueries = 0, nwrong = 0;
+    while (!t->stop) {
+        t->nnobj->search_nn(t->pnts + (size_t)n*t->D, 1, &argmin, &min);
+        if (argmin != n || min != 0) nwrong++;
+        nqueries++;
+        n = (n + 7) % t->N;
+    }
+    __sync_fetch_and_add(&t->nqueries, nqueries);
+    __sync_fetch_and_add(&t->nwrong, nwrong);
+    return 0;
+}
+
+/**
+ * Doubles an index in small batches while readers search it. Every
+ * point, old or new, must then find itself, and whatever the inserts
+ * replaced must have been freed with the index.
+ */
+template<class Float>
+int
+test_add_points(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(2*N, D, 42);
+    unsigned nreaders = 4, batch = 100;
+    const char* names[] = { "kd-tree", "owning kd-tree", "exact" };
+
+    bool ok = true;
+    for (unsigned i=0; i < 3; ++i) {
+        fastann::budget_allocator alloc;
+        fastann::nn_obj<Float>* nnobj = i < 2 ? fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768, i == 1, &alloc)
+                                              : fastann::nn_obj_build_exact(pnts, N, D, true, &alloc);
+
+        add_points_test<Float> t = { nnobj, pnts, N, D, false, 0, 0 };
+        std::vector<pthread_t> ths(nreaders);
+        for (unsigned r=0; r < nreaders; ++r) pthread_create(&ths[r], 0, &add_points_test_reader<Float>, &t);
+
+        for (unsigned n=N; n < 2*N; n += batch) nnobj->add_points(pnts + (size_t)n*D, batch);
+
+        t.stop = true;
+        for (unsigned r=0; r < nreaders; ++r) pthread_join(ths[r], 0);
+
+        unsigned nfound = 0, nchecked = 0;
+        for (unsigned n=0; n < 2*N; n += 5, ++nchecked) {
+            unsigned argmin;
+            typename fastann::nn_obj<Float>::accum_float_type min;
+            nnobj->search_nn(pnts + (size_t)n*D, 1, &argmin, &min);
+            nfound += argmin == n && min == 0;
+        }
+
+        bool this_ok = nnobj->npoints() == 2*N && nfound == nchecked && t.nqueries > 0 && t.nwrong == 0;
+        delete nnobj;
+        this_ok = this_ok && alloc.current() == 0;
+        printf("Add points (%s): %u queries during %u inserts %s\n", names[i], t.nqueries, N,
+               this_ok ? "PASSED" : "FAILED");
+        ok = ok && this_ok;
+    }
+
+    delete[] pnts;
+
+    return ok;
+}
+
+/**
+ * Answers through the cache must match the index's. Repeated queries,
+ * and with a tolerance slightly perturbed ones, must hit; more
+ * distinct queries than the capacity must evict.
+ */
+template<class Float>
+int
+test_query_cache(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3, NQ = 1000;
+
+    std::vector<Float> mins(NQ*K), mins_cached(NQ*K);
+    std::vector<unsigned> argmins(NQ*K), argmins_cached(NQ*K);
+
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768);
+    nnobj->search_knn(qus, NQ, K, &argmins[0], &mins[0]);
+
+    // Keys spread unevenly over the shards, so leave room.
+    fastann::query_cache<Float> exact(fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768), 2*NQ);
+    exact.search_knn(qus, NQ, K, &argmins_cached[0], &mins_cached[0]);
+    bool ok = argmins == argmins_cached && mins == mins_cached;
+    exact.search_knn(qus, NQ, K, &argmins_cached[0], &mins_cached[0]);
+    fastann::query_cache_stats st = exact.cache_stats();
+    ok = ok && argmins == argmins_cached && st.hits == NQ && st.misses == NQ && st.evictions == 0;
+
+    // A tolerance far above the perturbation puts both in one cell,
+    // unless the query sits near a cell's edge.
+    std::vector<Float> nudged(qus, qus + (size_t)NQ*D);
+    for (size_t i=0; i < nudged.size(); ++i) nudged[i] += Float(1e-6);
+    fastann::query_cache<Float> tolerant(fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768), 2*NQ, 0.01);
+    tolerant.search_knn(qus, NQ, K, &argmins_cached[0], &mins_cached[0]);
+    tolerant.search_knn(&nudged[0], NQ, K, &argmins_cached[0], &mins_cached[0]);
+    ok = ok && tolerant.cache_stats().hits > NQ*9/10 && argmins == argmins_cached;
+
+    fastann::query_cache<Float> small(fastann::nn_obj_build_kdtree(pnts, N, D, 8, 768), NQ/10);
+    small.search_knn(qus, NQ, K, &argmins_cached[0], &mins_cached[0]);
+    small.search_knn(qus, NQ, K, &argmins_cached[0], &mins_cached[0]);
+    ok = ok && argmins == argmins_cached && small.cache_stats().evictions >= NQ - NQ/10 &&
+         small.cache_stats().hits <= NQ/10;
+
+    printf("Query cache: %.0f%% of repeats hit, %.0f%% of nudged repeats %s\n", 100.0*st.hits/NQ,
+           100.0*tolerant.cache_stats().hits/NQ, ok ? "PASSED" : "FAILED");
+
+    delete nnobj;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+/**
+ * On data near a low dimensional manifold a few components should
+ * hold nearly all the variance, they must be orthonormal, and a
+ * reduced kd-tree with a full dimension rerank should find most true
+ * nearest neighbours.
+ */
+template<class Float>
+int
+test_pca(unsigned N, unsigned D, unsigned d, double min_accuracy)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+    unsigned NQ = 1000;
+    Float* all = fastann::gen_low_intrinsic_dim<Float>(N + NQ, D, 8, 0.01, 42);
+    Float* qus = all + (size_t)N*D;
+
+    fastann::pca<Float> model;
+    model.train(all, N, D, d);
+    const std::vector<float>& w = model.components();
+    double max_err = 0;
+    for (unsigned i=0; i < d; ++i) {
+        for (unsigned j=0; j < d; ++j) {
+            double dot = 0;
+            for (unsigned k=0; k < D; ++k) dot += (double)w[i*D + k]*w[j*D + k];
+            max_err = std::max(max_err, fabs(dot - (i == j)));
+        }
+    }
+    bool sorted = true;
+    for (unsigned j=1; j < d; ++j) sorted = sorted && model.variances()[j] <= model.variances()[j-1];
+
+    std::vector<unsigned> argmins_exact(NQ), argmins_pca(NQ);
+    std::vector<AccumFloat> mins_exact(NQ), mins_pca(NQ);
+    fastann::nn_obj<Float>* nnobj_exact = fastann::nn_obj_build_exact(all, N, D);
+    fastann::nn_obj<Float>* nnobj_pca = fastann::nn_obj_build_pca_kdtree(all, N, D, d, 8, 768, 10);
+    nnobj_exact->search_nn(qus, NQ, &argmins_exact[0], &mins_exact[0]);
+    nnobj_pca->search_nn(qus, NQ, &argmins_pca[0], &mins_pca[0]);
+
+    unsigned num_same = 0;
+    for (unsigned n=0; n < NQ; ++n) num_same += mins_exact[n] == mins_pca[n];
+    double accuracy = (double)num_same/NQ;
+
+    bool ok = max_err < 1e-4 && sorted && model.explained_variance() > 0.9 &&
+              accuracy > min_accuracy && nnobj_pca->ndims() == D;
+    printf("PCA %u -> %u: %.1f%% of variance, accuracy %.1f%% %s\n", D, d,
+           100*model.explained_variance(), accuracy*100.0, ok ? "PASSED" : "FAILED");
+
+    delete nnobj_exact;
+    delete nnobj_pca;
+    delete[] all;
+
+    return ok;
+}
+
+/**
+ * Streaming the points from a raw file and from an .fvecs file, in
+ * blocks small enough that most straddle rows, must give the same
+ * neighbours as the in-memory exact search.
+ */
+template<class Float>
+int
+test_exact_stream(unsigned N, unsigned D)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned NQ = 500, K = 5;
+
+    char raw_path[64], vecs_path[64];
+    snprintf(raw_path, sizeof(raw_path), "/tmp/fastann_test_stream.%d", (int)getpid());
+    snprintf(vecs_path, sizeof(vecs_path), "/tmp/fastann_test_stream.%d.fvecs", (int)getpid());
+    FILE* f = fopen(raw_path, "wb");
+    bool ok = f && fwrite(pnts, sizeof(Float)*D, N, f) == N;
+    if (f) ok = fclose(f) == 0 && ok;
+    fastann::vecs_writer<Float> w;
+    ok = ok && w.open(vecs_path) && w.write(pnts, N, D) && w.close();
+
+    std::vector<unsigned> argmins_exact(NQ*K), argmins_stream(NQ*K);
+    std::vector<AccumFloat> mins_exact(NQ*K), mins_stream(NQ*K);
+    fastann::nn_obj<Float>* nnobj_exact = fastann::nn_obj_build_exact(pnts, N, D);
+    nnobj_exact->search_knn(qus, NQ, K, &argmins_exact[0], &mins_exact[0]);
+
+    size_t block_bytes = 3*sizeof(Float)*D + 100;
+    fastann::nn_obj<Float>* streams[] = {
+        fastann::nn_obj_open_exact_stream<Float>(raw_path, D, 0, 0, false, block_bytes),
+        fastann::nn_obj_open_exact_stream<Float>(raw_path, D, 0, 0, true, 1000*block_bytes),
+        fastann::nn_obj_open_exact_stream<Float>(vecs_path, D, 4, 0, true, block_bytes)
+    };
+    for (unsigned s=0; s < 3; ++s) {
+        ok = ok && streams[s] && streams[s]->npoints() == N && streams[s]->ndims() == D;
+        if (!ok) break;
+        streams[s]->search_knn(qus, NQ, K, &argmins_stream[0], &mins_stream[0]);
+        ok = ok && mins_stream == mins_exact && argmins_stream == argmins_exact;
+    }
+
+    // Wrong dimensions are refused.
+    fastann::nn_obj<Float>* wrong_raw = fastann::nn_obj_open_exact_stream<Float>(raw_path, D + 1);
+    fastann::nn_obj<Float>* wrong_vecs = fastann::nn_obj_open_exact_stream<Float>(vecs_path, D/2, 4);
+    ok = ok && !wrong_raw && !wrong_vecs;
+    unlink(raw_path);
+    unlink(vecs_path);
+    printf("Exact stream: %s\n", ok ? "PASSED" : "FAILED");
+
+    for (unsigned s=0; s < 3; ++s) delete streams[s];
+    delete wrong_raw;
+    delete wrong_vecs;
+    delete nnobj_exact;
+    delete[] pnts;
+    delete[] qus;
+
+    return ok;
+}
+
+/**
+ * Float queries against byte points: the exact index must agree with
+ * a brute force search in double (which rounding the queries would
+ * not), and the kd-tree with it mostly. Indexes without the mixed
+ * search throw.
+ */
+int
+test_mixed_precision(unsigned N, unsigned NQ)
+{
+    unsigned D = 128, K = 5;
+    unsigned char* all = fastann::gen_sift_like(N + NQ, 200, 42);
+    const unsigned char* qus_uc = all + (size_t)N*D;
+    rk_state state;
+    rk_seed(44, &state);
+    std::vector<float> qus((size_t)NQ*D);
+    for (size_t i=0; i < qus.size(); ++i) qus[i] = qus_uc[i] + (float)(rk_double(&state) - 0.5);
+
+    std::vector<unsigned> argmins_exact(NQ*K), argmins_kdt(NQ*K), argmins_map(NQ*K);
+    std::vector<float> mins_exact(NQ*K), mins_kdt(NQ*K), mins_map(NQ*K);
+    fastann::nn_obj<unsigned char>* nnobj_exact = fastann::nn_obj_build_exact(all, N, D);
+    fastann::nn_obj<unsigned char>* nnobj_kdt = fastann::nn_obj_build_kdtree(all, N, D, 8, 768, true);
+    nnobj_exact->search_knn_float(&qus[0], NQ, K, &argmins_exact[0], &mins_exact[0], 0);
+    nnobj_kdt->search_knn_float(&qus[0], NQ, K, &argmins_kdt[0], &mins_kdt[0], 0);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/fastann_test_mixed.%d", (int)getpid());
+    bool ok = fastann::nn_obj_write_kdtree(path, all, N, D, 8);
+    fastann::nn_obj<unsigned char>* nnobj_map = ok ? fastann::nn_obj_map_kdtree<unsigned char>(path, 768) : 0;
+    unlink(path);
+    ok = ok && nnobj_map;
+    if (ok) nnobj_map->search_knn_float(&qus[0], NQ, K, &argmins_map[0], &mins_map[0], 0);
+    ok = ok && argmins_map == argmins_kdt && mins_map == mins_kdt;
+
+    unsigned num_same = 0;
+    for (unsigned n=0; n < NQ; ++n) {
+        std::vector<double> dsqs(N);
+        for (unsigned p=0; p < N; ++p) {
+            double dsq = 0;
+            for (unsigned d=0; d < D; ++d) {
+                double diff = qus[(size_t)n*D + d] - (double)all[(size_t)p*D + d];
+                dsq += diff*diff;
+            }
+            dsqs[p] = dsq;
+        }
+        std::sort(dsqs.begin(), dsqs.end());
+        for (unsigned k=0; k < K; ++k) {
+            ok = ok && fabs(mins_exact[n*K + k] - dsqs[k]) <= 1e-5*(1.0 + dsqs[k]);
+        }
+        num_same += mins_kdt[n*K] == mins_exact[n*K];
+    }
+    double accuracy = (double)num_same/NQ;
+
+    fastann::nn_obj<unsigned char>* nnobj_rerank = fastann::nn_obj_build_rerank(
+        fastann::nn_obj_build_kdtree(all, N, D, 8, 768), all, N, D, 10);
+    bool threw = false;
+    try {
+        nnobj_rerank->search_knn_float(&qus[0], NQ, K, &argmins_kdt[0], &mins_kdt[0], 0);
+    }
+    catch (int) {
+        threw = true;
+    }
+
+    ok = ok && accuracy > 0.9 && threw;
+    printf("Mixed precision: accuracy %.1f%% %s\n", accuracy*100.0, ok ? "PASSED" : "FAILED");
+
+    delete nnobj_exact;
+    delete nnobj_kdt;
+    delete nnobj_map;
+    delete nnobj_rerank;
+    delete[] all;
+
+    return ok;
+}
+
+/**
+ * The blocked exact index on the first \c N of \c all, the remaining
+ * \c NQ being the queries, must give exactly nn_obj_exact's answers.
+ */
+template<class Float>
+bool
+test_exact_blocked(const char* name, Float* all, unsigned N, unsigned NQ, unsigned D, unsigned block)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+    Float* qus = all + (size_t)N*D;
+    unsigned K = 5;
+
+    std::vector<unsigned> argmins_exact(NQ*K), argmins_blocked(NQ*K);
+    std::vector<AccumFloat> mins_exact(NQ*K), mins_blocked(NQ*K);
+    fastann::nn_obj<Float>* nnobj_exact = fastann::nn_obj_build_exact(all, N, D);
+    fastann::nn_obj<Float>* nnobj_blocked = fastann::nn_obj_build_exact_blocked(all, N, D, block);
+
+    uint64_t t0 = rdtsc();
+    nnobj_exact->search_knn(qus, NQ, K, &argmins_exact[0], &mins_exact[0]);
+    uint64_t t1 = rdtsc();
+    nnobj_blocked->search_knn(qus, NQ, K, &argmins_blocked[0], &mins_blocked[0]);
+    uint64_t t2 = rdtsc();
+
+    bool ok = nnobj_blocked->npoints() == N && argmins_blocked == argmins_exact && mins_blocked == mins_exact;
+    printf("%20s Blocked exact: %.1fx %s\n", name, (double)(t1 - t0)/(t2 - t1), ok ? "PASSED" : "FAILED");
+
+    delete nnobj_exact;
+    delete nnobj_blocked;
+    delete[] all;
+
+    return ok;
+}
+
+/**
+ * Runs the kd-tree on the first \c N of \c all against the remaining
+ * \c NQ as queries; clustered data should do far better than the unit
+ * cube. \c one and \c many are the same rows generated on pools of 1
+ * and 4 threads: every generator must depend only on its seed.
+ */
+template<class Float>
+int
+test_generated(const char* name, Float* all, Float* one, Float* many, unsigned N, unsigned NQ, unsigned D,
+               double min_accuracy)
+{
+    typedef typename fastann::nn_obj<Float>::accum_float_type AccumFloat;
+
+    Float* qus = all + (size_t)N*D;
+    std::vector<unsigned> argmins_exact(NQ), argmins_kdt(NQ);
+    std::vector<AccumFloat> mins_exact(NQ), mins_kdt(NQ);
+
+    fastann::nn_obj<Float>* nnobj_exact = fastann::nn_obj_build_exact(all, N, D);
+    fastann::nn_obj<Float>* nnobj_kdt = fastann::nn_obj_build_kdtree(all, N, D, 8, 768);
+
+    nnobj_exact->search_nn(qus, NQ, &argmins_exact[0], &mins_exact[0]);
+    nnobj_kdt->search_nn(qus, NQ, &argmins_kdt[0], &mins_kdt[0]);
+
+    unsigned num_same = 0; // Compare distances: duplicates make indices ambiguous.
+    for (unsigned n=0; n < NQ; ++n) num_same += mins_exact[n] == mins_kdt[n];
+    double accuracy = (double)num_same/NQ;
+
+    bool repeatable = std::equal(all, all + (size_t)(N + NQ)*D, one) &&
+                      std::equal(all, all + (size_t)(N + NQ)*D, many);
+    bool ok = accuracy > min_accuracy && repeatable;
+    printf("%20s Accuracy: %.1f%% %s\n", name, accuracy*100.0, ok ? "PASSED" : "FAILED");
+
+    delete nnobj_exact;
+    delete nnobj_kdt;
+    delete[] all;
+    delete[] one;
+    delete[] many;
+
+    return ok;
+}
+
 int
 main()
 {
@@ -126,6 +1139,113 @@ main()
     if (test_kdtree<double>(N, D, min_accuracy)) { num_passed++; }
     else { num_failed++; }
 
+    if (test_rerank<float>(N, D, min_accuracy)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_copy_points<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_wide_indices<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_dist_dispatch<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_submit_knn<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_parallel_for_throws()) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_mapped<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_memory<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_huge_pages<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_numa<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_managed<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_managed_forwarding(N)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_add_points<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_query_cache<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_pca<float>(N, D, 16, 0.9)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_pca<double>(N, D, 16, 0.9)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_exact_stream<float>(N, D)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_mixed_precision(N, 200)) { num_passed++; }
+    else { num_failed++; }
+
+    unsigned NQ = 1000;
+    fastann::thread_pool one_thread(1), four_threads(4);
+
+    if (test_generated("gaussian mixture",
+                       fastann::gen_gaussian_mixture<float>(N + NQ, D, 100, 0.05, 42),
+                       fastann::gen_rows<float>(fastann::gen_mixture_model(D, 100, 0.05, 42), N + NQ, D, 42, one_thread),
+                       fastann::gen_rows<float>(fastann::gen_mixture_model(D, 100, 0.05, 42), N + NQ, D, 42, four_threads),
+                       N, NQ, D, 0.85)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_exact_blocked("gaussian mixture",
+                           fastann::gen_gaussian_mixture<float>(N + NQ, 16, 100, 0.05, 42),
+                           N, NQ, 16, 256)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_exact_blocked("sift like",
+                           fastann::gen_sift_like(N + NQ, 200, 42),
+                           N, NQ, D, 100)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_exact_blocked("unit random",
+                           fastann::gen_unit_random<float>(N + NQ, D, 42),
+                           N, NQ, D, 256)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_generated("low intrinsic dim",
+                       fastann::gen_low_intrinsic_dim<float>(N + NQ, D, 8, 0.01, 42),
+                       fastann::gen_rows<float>(fastann::gen_low_dim_model(D, 8, 0.01, 42), N + NQ, D, 42, one_thread),
+                       fastann::gen_rows<float>(fastann::gen_low_dim_model(D, 8, 0.01, 42), N + NQ, D, 42, four_threads),
+                       N, NQ, D, 0.95)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_generated("heavy tailed",
+                       fastann::gen_heavy_tailed<float>(N + NQ, D, 2.0, 42),
+                       fastann::gen_rows<float>(fastann::gen_heavy_tailed_model(D, 2.0), N + NQ, D, 42, one_thread),
+                       fastann::gen_rows<float>(fastann::gen_heavy_tailed_model(D, 2.0), N + NQ, D, 42, four_threads),
+                       N, NQ, D, 0.2)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_generated("duplicate heavy",
+                       fastann::gen_duplicate_heavy<float>(N + NQ, D, 500, 0.0, 42),
+                       fastann::gen_rows<float>(fastann::gen_duplicate_model(D, 500, 0.0, 42), N + NQ, D, 42, one_thread),
+                       fastann::gen_rows<float>(fastann::gen_duplicate_model(D, 500, 0.0, 42), N + NQ, D, 42, four_threads),
+                       N, NQ, D, 0.95)) { num_passed++; }
+    else { num_failed++; }
+
+    if (test_generated("sift like",
+                       fastann::gen_sift_like(N + NQ, 200, 42),
+                       fastann::gen_rows<unsigned char>(fastann::gen_sift_model(200, 42), N + NQ, D, 42, one_thread),
+                       fastann::gen_rows<unsigned char>(fastann::gen_sift_model(200, 42), N + NQ, D, 42, four_threads),
+                       N, NQ, D, 0.9)) { num_passed++; }
+    else { num_failed++; }
+
     printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
     
     if (num_failed) return -1;
@@ -0,0 +1,104 @@
+/**
+ * Tests the query server in serve.hpp against direct searches, with
+ * several clients sending requests concurrently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "fastann.hpp"
+#include "rand_point_gen.hpp"
+#include "serve.hpp"
+
+struct client_arg
+{
+    const char* socket_path;
+    const float* qus;
+    unsigned N;
+    unsigned D;
+    unsigned K;
+    unsigned* argmins;
+    float* mins;
+    int status;
+};
+
+static void*
+client_main(void* arg)
+{
+    client_arg* c = (client_arg*)arg;
+    int fd = fastann::serve_connect(c->socket_path);
+    if (fd < 0) { c->status = -1; return 0; }
+
+    // One query per request so that the server has to batch them.
+    c->status = 0;
+    for (unsigned n=0; n < c->N && c->status == 0; ++n) {
+        c->status = fastann::serve_search_knn(fd, c->qus + n*c->D, 1, c->D, c->K,
+                                              c->argmins + n*c->K, c->mins + n*c->K);
+    }
+    close(fd);
+    return 0;
+}
+
+int
+main()
+{
+    unsigned N = 5000, D = 32, K = 4, nq = 400, nclients = 4;
+    int num_passed = 0, num_failed = 0;
+
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/fastann_test_serve.%d", (int)getpid());
+
+    float* pnts = fastann::gen_unit_random<float>(N, D, 42);
+    float* qus = fastann::gen_unit_random<float>(nq, D, 43);
+    fastann::nn_obj<float>* nno = fastann::nn_obj_build_kdtree(pnts, N, D, 4, 128);
+
+    std::vector<unsigned> argmins_direct(nq*K), argmins_served(nq*K);
+    std::vector<float> mins_direct(nq*K), mins_served(nq*K);
+    nno->search_knn(qus, nq, K, &argmins_direct[0], &mins_direct[0]);
+
+    fastann::query_server server(nno, socket_path, 64, 2000, 1000);
+    server.start();
+
+    unsigned per_client = nq/nclients;
+    std::vector<client_arg> args(nclients);
+    std::vector<pthread_t> threads(nclients);
+    for (unsigned c=0; c < nclients; ++c) {
+        client_arg a = { socket_path, qus + c*per_client*D, per_client, D, K,
+                         &argmins_served[c*per_client*K], &mins_served[c*per_client*K], -1 };
+        args[c] = a;
+        pthread_create(&threads[c], 0, &client_main, &args[c]);
+    }
+    bool ok = true;
+    for (unsigned c=0; c < nclients; ++c) {
+        pthread_join(threads[c], 0);
+        if (args[c].status != 0) ok = false;
+    }
+    ok = ok && argmins_direct == argmins_served && mins_direct == mins_served;
+    printf("%30s %20s\n", "concurrent clients", ok ? "PASSED" : "FAILED");
+    (ok ? num_passed : num_failed)++;
+
+    // Bad requests are refused, not fatal to the server.
+    int fd = fastann::serve_connect(socket_path);
+    bool refused = fd >= 0 &&
+        fastann::serve_search_knn(fd, qus, 1, D, N + 1, &argmins_served[0], &mins_served[0]) == fastann::SERVE_EINVAL &&
+        fastann::serve_search_knn(fd, qus, 300, D, K, &argmins_served[0], &mins_served[0]) == fastann::SERVE_EINVAL &&
+        fastann::serve_search_knn(fd, qus, 1, D, K, &argmins_served[0], &mins_served[0]) == fastann::SERVE_OK;
+    if (fd >= 0) close(fd);
+    printf("%30s %20s\n", "bad requests refused", refused ? "PASSED" : "FAILED");
+    (refused ? num_passed : num_failed)++;
+
+    server.stop();
+    printf("Served %llu queries in %llu batches\n", server.nqueries(), server.nbatches());
+
+    delete nno;
+    delete[] pnts;
+    delete[] qus;
+
+    printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
+
+    if (num_failed) return -1;
+    else return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * Tests the search counters of search_stats.hpp. Built both with and
+ * without FASTANN_STATS: compiled out they must all stay zero,
+ * compiled in they must count and the summary must add up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fastann.hpp"
+#include "rand_point_gen.hpp"
+
+/**
+ * Whether \c summary is exactly the queries in \c stats, plus
+ * \c nextra more that only it saw.
+ */
+bool
+consistent(const fastann::search_stats_summary& summary, const std::vector<fastann::search_stats>& stats,
+           unsigned nextra)
+{
+    uint64_t ndists = 0, nleaves = 0, max_ndists = 0, nhist = 0;
+    for (size_t n = 0; n < stats.size(); ++n) {
+        ndists += stats[n].ndists;
+        nleaves += stats[n].nleaves;
+        max_ndists = std::max(max_ndists, stats[n].ndists);
+    }
+    for (unsigned b = 0; b < fastann::search_stats_summary::nbuckets; ++b) nhist += summary.ndists_hist[b];
+
+    bool ok = summary.nqueries == stats.size() + nextra && nhist == summary.nqueries;
+    if (nextra == 0) {
+        ok = ok && summary.total.ndists == ndists && summary.total.nleaves == nleaves &&
+             summary.max_ndists == max_ndists;
+    }
+    return ok;
+}
+
+template<class Float>
+bool
+test_stats(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3, nchecks = 256, nq = 100;
+
+    std::vector<Float> mins((size_t)N*K);
+    std::vector<unsigned> argmins((size_t)N*K);
+    std::vector<fastann::search_stats> stats(nq);
+
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_kdtree(pnts, N, D, 8, nchecks);
+    nnobj->search_knn_stats(qus, nq, K, &argmins[0], &mins[0], &stats[0]);
+    const fastann::search_stats_summary* summary = nnobj->stats_summary();
+
+    bool ok = summary != 0;
+#ifdef FASTANN_STATS
+    for (unsigned n = 0; ok && n < nq; ++n) {
+        if (stats[n].ndists < nchecks || stats[n].ntrees != 8 || stats[n].nleaves == 0 ||
+            stats[n].max_heap == 0 || stats[n].cycles == 0) ok = false;
+    }
+    ok = ok && consistent(*summary, stats, 0);
+    printf("Search stats: %.1f distances, %.1f leaves per query\n",
+           (double)summary->total.ndists/nq, (double)summary->total.nleaves/nq);
+
+    // Chunks searched on several pool threads at once all arrive.
+    fastann::search_future* fut = nnobj->submit_knn(qus, N, K, &argmins[0], &mins[0]);
+    ok = ok && fut->wait() == 0 && consistent(*summary, stats, N) &&
+         summary->total.ndists >= (uint64_t)(nq + N)*nchecks;
+    delete fut;
+
+    nnobj->reset_stats();
+    ok = ok && summary->nqueries == 0;
+#else
+    for (unsigned n = 0; n < nq; ++n) {
+        if (stats[n].ndists || stats[n].nleaves) ok = false;
+    }
+    ok = ok && summary->nqueries == 0;
+    printf("Search stats: compiled out\n");
+#endif
+    printf("%30s %20s\n", "kd-tree stats", ok ? "PASSED" : "FAILED");
+
+    delete[] pnts;
+    delete[] qus;
+
+    delete nnobj;
+
+    return ok;
+}
+
+template<class Float>
+bool
+test_exact_stats(unsigned N, unsigned D)
+{
+    Float* pnts = fastann::gen_unit_random<Float>(N, D, 42);
+    Float* qus = fastann::gen_unit_random<Float>(N, D, 43);
+    unsigned K = 3, nq = 50;
+
+    std::vector<Float> mins(nq*K);
+    std::vector<unsigned> argmins(nq*K);
+    std::vector<fastann::search_stats> stats(nq);
+
+    fastann::nn_obj<Float>* nnobj = fastann::nn_obj_build_exact(pnts, N, D);
+    nnobj->search_knn_stats(qus, nq, K, &argmins[0], &mins[0], &stats[0]);
+
+    bool ok = true;
+#ifdef FASTANN_STATS
+    for (unsigned n = 0; n < nq; ++n) ok = ok && stats[n].ndists == N;
+    ok = ok && consistent(*nnobj->stats_summary(), stats, 0);
+#else
+    for (unsigned n = 0; n < nq; ++n) ok = ok && stats[n].ndists == 0;
+#endif
+    printf("%30s %20s\n", "exact stats", ok ? "PASSED" : "FAILED");
+
+    delete[] pnts;
+    delete[] qus;
+
+    delete nnobj;
+
+    return ok;
+}
+
+/**
+ * The blocked exact index counts the blocks it reads as leaves; on
+ * clustered low dimensional points it must skip most of them.
+ */
+bool
+test_blocked_stats(const char* name, float* all, unsigned N, unsigned NQ, unsigned D, double max_read)
+{
+    unsigned K = 5, block = 256;
+    std::vector<float> mins(NQ*K);
+    std::vector<unsigned> argmins(NQ*K);
+    std::vector<fastann::search_stats> stats(NQ);
+
+    fastann::nn_obj<float>* nnobj = fastann::nn_obj_build_exact_blocked(all, N, D, block);
+    nnobj->search_knn_stats(all + (size_t)N*D, NQ, K, &argmins[0], &mins[0], &stats[0]);
+
+    bool ok = true;
+#ifdef FASTANN_STATS
+    const fastann::search_stats_summary* summary = nnobj->stats_summary();
+    unsigned nblocks = (N + block - 1)/block;
+    double read = (double)summary->total.nleaves/((double)NQ*nblocks);
+    for (unsigned n = 0; n < NQ; ++n) {
+        ok = ok && stats[n].nleaves > 0 && stats[n].ndists <= stats[n].nleaves*block;
+    }
+    ok = ok && consistent(*summary, stats, 0) && read <= max_read;
+    printf("%s: %.1f%% of blocks read\n", name, 100.0*read);
+#else
+    for (unsigned n = 0; n < NQ; ++n) ok = ok && stats[n].nleaves == 0;
+#endif
+    printf("%30s %20s\n", "blocked exact stats", ok ? "PASSED" : "FAILED");
+
+    delete nnobj;
+    delete[] all;
+
+    return ok;
+}
+
+int
+main()
+{
+    int num_passed = 0, num_failed = 0;
+
+    (test_stats<float>(10000, 128) ? num_passed : num_failed)++;
+    (test_exact_stats<float>(5000, 32) ? num_passed : num_failed)++;
+    (test_blocked_stats("gaussian mixture", fastann::gen_gaussian_mixture<float>(10500, 16, 100, 0.05, 42),
+                        10000, 500, 16, 0.25) ? num_passed : num_failed)++;
+    (test_blocked_stats("unit random", fastann::gen_unit_random<float>(10500, 128, 42),
+                        10000, 500, 128, 1.0) ? num_passed : num_failed)++;
+
+    printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
+
+    if (num_failed) return -1;
+    else return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * Tests the vecs file readers and writers in vecs_io.hpp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "rand_point_gen.hpp"
+#include "vecs_io.hpp"
+
+static void
+report(const char* name, bool ok, int& num_passed, int& num_failed)
+{
+    printf("%30s %20s\n", name, ok ? "PASSED" : "FAILED");
+    if (ok) num_passed++;
+    else num_failed++;
+}
+
+template<class T>
+void
+test_roundtrip(const char* name, const T* rows, unsigned N, unsigned D, int& num_passed, int& num_failed)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/fastann_test_vecs.%d", (int)getpid());
+
+    fastann::vecs_writer<T> w;
+    bool ok = w.open(path) && w.write(rows, N/2, D) && w.write(rows + (N/2)*D, N - N/2, D) && w.close();
+
+    fastann::vecs_view<T> view;
+    ok = ok && view.open(path) && view.npoints() == N && view.ndims() == D;
+    for (unsigned n=0; ok && n < N; ++n) {
+        if (memcmp(view.row(n), rows + n*D, D*sizeof(T))) ok = false;
+    }
+
+    std::vector<T> packed((N - 3)*D);
+    if (ok) view.repack(&packed[0], 3, N);
+    ok = ok && memcmp(&packed[0], rows + 3*D, packed.size()*sizeof(T)) == 0;
+
+    unsigned rN = 0, rD = 0;
+    T* read = fastann::read_vecs<T>(path, &rN, &rD);
+    ok = ok && read && rN == N && rD == D && memcmp(read, rows, N*D*sizeof(T)) == 0;
+    delete[] read;
+
+    // A truncated file is refused.
+    ok = ok && truncate(path, (off_t)(N*(4 + D*sizeof(T)) - 1)) == 0 && !view.open(path);
+    unlink(path);
+
+    report(name, ok, num_passed, num_failed);
+}
+
+int
+main()
+{
+    int num_passed = 0, num_failed = 0;
+    unsigned N = 10000, D = 17;
+
+    float* f = fastann::gen_unit_random<float>(N, D, 42);
+    std::vector<int> iv(N*D);
+    std::vector<unsigned char> bv(N*D);
+    for (unsigned i=0; i < N*D; ++i) {
+        iv[i] = (int)(1000*f[i]);
+        bv[i] = (unsigned char)(256*f[i]);
+    }
+
+    test_roundtrip("fvecs", f, N, D, num_passed, num_failed);
+    test_roundtrip("ivecs", &iv[0], N, D, num_passed, num_failed);
+    test_roundtrip("bvecs", &bv[0], N, D, num_passed, num_failed);
+
+    report("missing file", !fastann::read_vecs<float>("/nonexistent/fastann", &N, &D), num_passed, num_failed);
+
+    delete[] f;
+
+    printf("NUM_PASSED %d  NUM_FAILED %d\n", num_passed, num_failed);
+
+    if (num_failed) return -1;
+    else return 0;
+}
@@ -0,0 +1,275 @@
+/**
+ * A minimal fixed size pool of pthreads with a FIFO task queue, and a
+ * blocking parallel_for on top of it.
+ */
+#ifndef __FASTANN_THREAD_POOL_HPP
+#define __FASTANN_THREAD_POOL_HPP
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <deque>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "numa.hpp"
+
+namespace fastann {
+
+class
+thread_pool
+{
+public:
+    typedef void (*task_func)(void* arg);
+
+private:
+    struct task { task_func func; void* arg; };
+
+    std::vector<pthread_t> threads_;
+    std::deque<task> tasks_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+    bool stopping_;
+
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+
+    static void*
+    worker_main(void* arg)
+    {
+        thread_pool* pool = (thread_pool*)arg;
+        for (;;) {
+            pthread_mutex_lock(&pool->mutex_);
+            while (pool->tasks_.empty() && !pool->stopping_) {
+                pthread_cond_wait(&pool->cond_, &pool->mutex_);
+            }
+            if (pool->tasks_.empty()) { // Stopping and drained.
+                pthread_mutex_unlock(&pool->mutex_);
+                return 0;
+            }
+            task t = pool->tasks_.front();
+            pool->tasks_.pop_front();
+            pthread_mutex_unlock(&pool->mutex_);
+
+            t.func(t.arg);
+        }
+    }
+
+public:
+    /**
+     * \c nthreads == 0 means one thread per online CPU.
+     */
+    explicit thread_pool(unsigned nthreads = 0)
+     : stopping_(false)
+    {
+        if (nthreads == 0) {
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = ncpus > 0 ? (unsigned)ncpus : 1;
+        }
+        pthread_mutex_init(&mutex_, 0);
+        pthread_cond_init(&cond_, 0);
+
+        threads_.resize(nthreads);
+        for (unsigned t=0; t < nthreads; ++t) {
+            pthread_create(&threads_[t], 0, &worker_main, this);
+        }
+    }
+
+    /**
+     * Runs every queued task before returning.
+     */
+    ~thread_pool()
+    {
+        pthread_mutex_lock(&mutex_);
+        stopping_ = true;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+
+        for (size_t t=0; t < threads_.size(); ++t) pthread_join(threads_[t], 0);
+
+        pthread_cond_destroy(&cond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    void
+    submit(task_func func, void* arg)
+    {
+        task t = { func, arg };
+        pthread_mutex_lock(&mutex_);
+        tasks_.push_back(t);
+        pthread_cond_signal(&cond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    unsigned nthreads() const { return (unsigned)threads_.size(); }
+
+    /**
+     * Pins worker \c t to numa_topology::spread_cpu(t), so the workers
+     * are spread evenly over the NUMA nodes and stay where their
+     * memory is. Returns false if any pin was refused.
+     */
+    bool
+    pin_workers()
+    {
+        const numa_topology& topo = numa_topology::get();
+        bool ok = true;
+        for (size_t t=0; t < threads_.size(); ++t) {
+            ok = numa_pin_to_cpu(threads_[t], topo.spread_cpu((unsigned)t)) && ok;
+        }
+        return ok;
+    }
+
+    /**
+     * The library's shared pool, created on first use.
+     */
+    static thread_pool&
+    global()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+};
+
+namespace thread_pool_internal {
+
+typedef void (*range_func)(void* ctx, size_t begin, size_t end);
+
+/**
+ * Shared by the caller and the helpers. Helpers may start after the
+ * caller has returned, so it is reference counted rather than living
+ * on the caller's stack.
+ */
+struct parallel_for_state
+{
+    range_func func;
+    void* ctx;
+    size_t n;
+    size_t grain;
+    size_t next;    // Next unclaimed index, advanced atomically.
+    size_t ndone;   // Indices finished, under mutex.
+    unsigned nrefs; // Advanced atomically.
+    int failed;     // A failure_kind, set once under mutex.
+    int thrown;     // The int thrown, for failed_int.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+enum failure_kind { failed_none, failed_bad_alloc, failed_int, failed_other };
+
+inline void
+parallel_for_release(parallel_for_state* st)
+{
+    if (__sync_sub_and_fetch(&st->nrefs, 1) == 0) {
+        pthread_cond_destroy(&st->cond);
+        pthread_mutex_destroy(&st->mutex);
+        delete st;
+    }
+}
+
+inline void
+parallel_for_run(parallel_for_state* st)
+{
+    for (;;) {
+        size_t begin = __sync_fetch_and_add(&st->next, st->grain);
+        if (begin >= st->n) break;
+        size_t end = begin + st->grain < st->n ? begin + st->grain : st->n;
+
+        // Once a chunk has thrown the rest are skipped, but still counted
+        // as done, so the caller's wait ends and its ctx outlives us.
+        int failed = failed_none, thrown = 0;
+        if (!__atomic_load_n(&st->failed, __ATOMIC_RELAXED)) {
+            try {
+                st->func(st->ctx, begin, end);
+            }
+            catch (const std::bad_alloc&) {
+                failed = failed_bad_alloc;
+            }
+            catch (int e) {
+                failed = failed_int;
+                thrown = e;
+            }
+            catch (...) {
+                failed = failed_other;
+            }
+        }
+
+        pthread_mutex_lock(&st->mutex);
+        if (failed && !st->failed) {
+            st->thrown = thrown;
+            __atomic_store_n(&st->failed, failed, __ATOMIC_RELAXED);
+        }
+        st->ndone += end - begin;
+        if (st->ndone == st->n) pthread_cond_signal(&st->cond);
+        pthread_mutex_unlock(&st->mutex);
+    }
+}
+
+inline void
+parallel_for_helper(void* arg)
+{
+    parallel_for_state* st = (parallel_for_state*)arg;
+    parallel_for_run(st);
+    parallel_for_release(st);
+}
+
+}
+
+/**
+ * Calls \c func(ctx, begin, end) over [0, n) in chunks of \c grain
+ * using \c pool, returning when every chunk is done. The calling thread
+ * takes chunks too and never waits on a helper that hasn't started, so
+ * this is safe (if serial) when called from inside the pool. If \c func
+ * throws, chunks not yet started are skipped and, once every chunk is
+ * accounted for, the first failure is rethrown here: std::bad_alloc and
+ * ints as they were, anything else as std::runtime_error.
+ */
+inline void
+parallel_for(thread_pool& pool, size_t n, size_t grain,
+             thread_pool_internal::range_func func, void* ctx)
+{
+    using namespace thread_pool_internal;
+    if (n == 0) return;
+    if (grain == 0) grain = 1;
+
+    size_t nchunks = (n + grain - 1)/grain;
+    unsigned nhelpers = pool.nthreads();
+    if (nhelpers > nchunks - 1) nhelpers = (unsigned)(nchunks - 1);
+
+    parallel_for_state* st = new parallel_for_state;
+    st->func = func;
+    st->ctx = ctx;
+    st->n = n;
+    st->grain = grain;
+    st->next = 0;
+    st->ndone = 0;
+    st->nrefs = nhelpers + 1;
+    st->failed = failed_none;
+    st->thrown = 0;
+    pthread_mutex_init(&st->mutex, 0);
+    pthread_cond_init(&st->cond, 0);
+
+    unsigned nsubmitted = 0;
+    try {
+        for (; nsubmitted < nhelpers; ++nsubmitted) pool.submit(&parallel_for_helper, st);
+    }
+    catch (const std::bad_alloc&) { // Make do with the helpers queued.
+        __sync_sub_and_fetch(&st->nrefs, nhelpers - nsubmitted);
+    }
+    parallel_for_run(st);
+
+    pthread_mutex_lock(&st->mutex);
+    while (st->ndone != n) pthread_cond_wait(&st->cond, &st->mutex);
+    int failed = st->failed, thrown = st->thrown;
+    pthread_mutex_unlock(&st->mutex);
+
+    parallel_for_release(st);
+
+    if (failed == failed_bad_alloc) throw std::bad_alloc();
+    if (failed == failed_int) throw thrown;
+    if (failed == failed_other) throw std::runtime_error("parallel_for: range function threw");
+}
+
+}
+
+#endif
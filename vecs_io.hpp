@@ -0,0 +1,214 @@
+/**
+ * Readers and writers for the TEXMEX vector formats (.fvecs, .ivecs,
+ * .bvecs) used by the standard ANN datasets (SIFT1M, GIST1M, ...).
+ * Every row is a 4 byte little endian dimension followed by that many
+ * elements: float for fvecs, int for ivecs, unsigned char for bvecs.
+ */
+#ifndef __FASTANN_VECS_IO_HPP
+#define __FASTANN_VECS_IO_HPP
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thread_pool.hpp"
+
+namespace fastann {
+
+/**
+ * A read-only mapping of a vecs file. Nothing is copied: row(n) points
+ * straight into the mapping, one dimension header apart from the next.
+ * Kernels wanting contiguous rows can repack() a range, so a dataset
+ * is never resident twice (the mapped pages are clean page cache).
+ */
+template<class T>
+class
+vecs_view
+{
+    void* base_;
+    size_t size_;
+    size_t nrows_;
+    unsigned dim_;
+    size_t stride_; // Bytes per row, header included.
+
+    vecs_view(const vecs_view&);
+    vecs_view& operator=(const vecs_view&);
+
+    struct repack_ctx
+    {
+        const vecs_view* view;
+        T* dst;
+        size_t begin;
+    };
+
+    static void
+    repack_range(void* arg, size_t begin, size_t end)
+    {
+        repack_ctx* ctx = (repack_ctx*)arg;
+        size_t D = ctx->view->dim_;
+        for (size_t n=begin; n < end; ++n) {
+            memcpy(ctx->dst + n*D, ctx->view->row(ctx->begin + n), D*sizeof(T));
+        }
+    }
+
+public:
+    vecs_view() : base_(0), size_(0), nrows_(0), dim_(0), stride_(0) { }
+    ~vecs_view() { close(); }
+
+    /**
+     * Maps \c path, returning false if it can't be mapped or isn't a
+     * whole number of rows. Only the first and last row headers are
+     * checked, so opening doesn't fault in the file.
+     */
+    bool
+    open(const char* path)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) || st.st_size < (off_t)sizeof(uint32_t)) { ::close(fd); return false; }
+
+        void* base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) return false;
+
+        uint32_t dim;
+        memcpy(&dim, base, sizeof(dim));
+        size_t stride = sizeof(uint32_t) + (size_t)dim*sizeof(T);
+        uint32_t last_dim = 0;
+        if (dim && st.st_size % stride == 0) {
+            memcpy(&last_dim, (const char*)base + st.st_size - stride, sizeof(last_dim));
+        }
+        if (!dim || last_dim != dim) {
+            munmap(base, st.st_size);
+            return false;
+        }
+
+        base_ = base;
+        size_ = st.st_size;
+        dim_ = dim;
+        stride_ = stride;
+        nrows_ = size_/stride_;
+        return true;
+    }
+
+    void
+    close()
+    {
+        if (base_) munmap(base_, size_);
+        base_ = 0;
+        size_ = nrows_ = stride_ = 0;
+        dim_ = 0;
+    }
+
+    size_t npoints() const { return nrows_; }
+    unsigned ndims() const { return dim_; }
+    size_t stride_bytes() const { return stride_; }
+
+    const T* row(size_t n) const { return (const T*)((const char*)base_ + n*stride_ + sizeof(uint32_t)); }
+
+    /**
+     * Hints the kernel about the access pattern of rows [begin, end),
+     * e.g. MADV_SEQUENTIAL for a single streaming pass.
+     */
+    void
+    advise(size_t begin, size_t end, int advice) const
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t off = (begin*stride_) & ~(page - 1);
+        madvise((char*)base_ + off, end*stride_ - off, advice);
+    }
+
+    /**
+     * Copies rows [begin, end) to \c dst as (end-begin)*ndims()
+     * contiguous elements, in parallel on \c pool.
+     */
+    void
+    repack(T* dst, size_t begin, size_t end, thread_pool& pool = thread_pool::global()) const
+    {
+        repack_ctx ctx = { this, dst, begin };
+        parallel_for(pool, end - begin, 4096, &repack_range, &ctx);
+    }
+};
+
+/**
+ * Reads a whole vecs file into a new[]'d array of \c *N contiguous rows
+ * of \c *D elements. Returns 0 if the file can't be read, or holds
+ * 2^32 rows or more (map it with vecs_view instead).
+ */
+template<class T>
+T*
+read_vecs(const char* path, unsigned* N, unsigned* D)
+{
+    vecs_view<T> view;
+    if (!view.open(path) || view.npoints() > ~0u) return 0;
+
+    view.advise(0, view.npoints(), MADV_SEQUENTIAL);
+    T* ret = new T[view.npoints()*view.ndims()];
+    view.repack(ret, 0, view.npoints());
+
+    *N = (unsigned)view.npoints();
+    *D = view.ndims();
+    return ret;
+}
+
+/**
+ * Streams rows to a vecs file, e.g. search results as ivecs.
+ */
+template<class T>
+class
+vecs_writer
+{
+    FILE* fp_;
+
+    vecs_writer(const vecs_writer&);
+    vecs_writer& operator=(const vecs_writer&);
+
+public:
+    vecs_writer() : fp_(0) { }
+    ~vecs_writer() { close(); }
+
+    bool
+    open(const char* path)
+    {
+        close();
+        fp_ = fopen(path, "wb");
+        return fp_ != 0;
+    }
+
+    /**
+     * Appends \c N rows of \c D contiguous elements from \c rows.
+     */
+    bool
+    write(const T* rows, size_t N, unsigned D)
+    {
+        uint32_t dim = D;
+        for (size_t n=0; n < N; ++n) {
+            if (fwrite(&dim, sizeof(dim), 1, fp_) != 1 ||
+                fwrite(rows + n*D, sizeof(T), D, fp_) != D) return false;
+        }
+        return true;
+    }
+
+    /**
+     * Returns false if anything failed to reach the file.
+     */
+    bool
+    close()
+    {
+        if (!fp_) return true;
+        bool ok = fclose(fp_) == 0;
+        fp_ = 0;
+        return ok;
+    }
+};
+
+}
+
+#endif